@@ -0,0 +1,239 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#include <arch/i386/apic.h>
+#include <arch/i386/util.h>
+#include <virtual.h>
+#include <uptime.h>
+#include <clockevent.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#define LAPIC_ID				0x020
+#define LAPIC_VERSION			0x030
+#define LAPIC_TPR				0x080
+#define LAPIC_EOI				0x0B0
+#define LAPIC_SVR				0x0F0
+#define LAPIC_ESR				0x280
+#define LAPIC_ICR_LO			0x300
+#define LAPIC_ICR_HI			0x310
+#define LAPIC_LVT_TIMER			0x320
+#define LAPIC_TIMER_INITIAL		0x380
+#define LAPIC_TIMER_CURRENT		0x390
+#define LAPIC_TIMER_DIVIDE		0x3E0
+
+#define LAPIC_SVR_ENABLE		(1 << 8)
+#define LAPIC_ICR_PENDING		(1 << 12)
+#define LAPIC_ICR_INIT			0x00004500
+#define LAPIC_ICR_STARTUP		0x00004600
+#define LAPIC_ICR_FIXED			0x00004000
+#define LAPIC_ICR_ALL_BUT_SELF	0x000C4000
+#define LAPIC_TIMER_MASKED		(1 << 16)
+#define LAPIC_TIMER_DIVIDE_16	0x3
+
+#define IA32_APIC_BASE_MSR		0x1B
+#define IA32_APIC_BASE_ENABLE	(1 << 11)
+
+#define kLAPIC_CALIBRATION_MS	10
+#define kCPU_START_TIMEOUT_MS	100
+
+static volatile uint32_t *lapic = NULL;
+static uint32_t lapic_ticks_per_ms = 0;
+
+static void lapic_timer_program(uint64_t delta);
+
+static struct clock_event lapic_clock_event = {
+	.name = "lapic",
+	.min_delta = 10,
+	.max_delta = 1000000,
+	.program = lapic_timer_program,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline uint32_t lapic_read(uint32_t reg)
+{
+	return lapic[reg >> 2];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value)
+{
+	lapic[reg >> 2] = value;
+	(void)lapic[LAPIC_ID >> 2];
+}
+
+static void lapic_delay(uint32_t ms)
+{
+	// The uptime is kept by the PIT, which only interrupts the bootstrap 
+	// processor. That is the only processor that starts others.
+	suseconds_t end = get_uptime_ms() + ms;
+	while (get_uptime_ms() < end)
+		__asm__ __volatile__("pause");
+}
+
+static void lapic_send_ipi(uint8_t apic_id, uint32_t command)
+{
+	lapic_write(LAPIC_ICR_HI, (uint32_t)apic_id << 24);
+	lapic_write(LAPIC_ICR_LO, command);
+	while (lapic_read(LAPIC_ICR_LO) & LAPIC_ICR_PENDING)
+		__asm__ __volatile__("pause");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void lapic_prepare(uintptr_t address)
+{
+	if (lapic)
+		return;
+
+	lapic = (volatile uint32_t *)kpage_map_device(address, 0x1000);
+	fprintf(dbgout, "Local APIC registers at %p mapped to %p (version %02x)\n",
+		address, lapic, lapic_read(LAPIC_VERSION) & 0xFF);
+	lapic_enable();
+}
+
+int lapic_available(void)
+{
+	return lapic != NULL;
+}
+
+void lapic_enable(void)
+{
+	// The Local APIC may have been hardware disabled by the BIOS, in which case
+	// it needs to be enabled through the MSR first.
+	uint64_t base = read_msr(IA32_APIC_BASE_MSR);
+	if (!(base & IA32_APIC_BASE_ENABLE))
+		write_msr(IA32_APIC_BASE_MSR, base | IA32_APIC_BASE_ENABLE);
+
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | kLAPIC_SPURIOUS_VECTOR);
+	lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_MASKED);
+	lapic_write(LAPIC_ESR, 0);
+}
+
+uint8_t lapic_id(void)
+{
+	return lapic ? (lapic_read(LAPIC_ID) >> 24) : 0;
+}
+
+void lapic_eoi(void)
+{
+	lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_broadcast_ipi(uint8_t vector)
+{
+	if (!lapic)
+		return;
+	lapic_send_ipi(0, LAPIC_ICR_ALL_BUT_SELF | vector);
+}
+
+void lapic_unicast_ipi(uint8_t apic_id, uint8_t vector)
+{
+	if (!lapic)
+		return;
+	lapic_send_ipi(apic_id, LAPIC_ICR_FIXED | vector);
+}
+
+int lapic_start_cpu(
+	uint8_t apic_id, 
+	uintptr_t trampoline, 
+	volatile uint8_t *online
+) {
+	// INIT, followed by two STARTUP IPIs as the MP specification recommends.
+	// The second is ignored if the first was successful.
+	lapic_write(LAPIC_ESR, 0);
+	lapic_send_ipi(apic_id, LAPIC_ICR_INIT);
+	lapic_delay(10);
+
+	for (int attempt = 0; attempt < 2 && !*online; ++attempt) {
+		lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | (trampoline >> 12));
+		lapic_delay(1);
+	}
+
+	suseconds_t end = get_uptime_ms() + kCPU_START_TIMEOUT_MS;
+	while (!*online && get_uptime_ms() < end)
+		__asm__ __volatile__("pause");
+
+	return *online;
+}
+
+void lapic_park_cpu(uint8_t apic_id)
+{
+	// An INIT puts the CPU back in to the wait-for-SIPI state, where it stays
+	// until it is started again.
+	lapic_send_ipi(apic_id, LAPIC_ICR_INIT);
+	lapic_delay(10);
+}
+
+int lapic_timer_calibrate(void)
+{
+	// Count down from the largest value for a fixed time, and see how far the
+	// timer got. Waiting for the start of a tick removes most of the error.
+	lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+	lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_MASKED);
+
+	suseconds_t start = get_uptime_ms();
+	while (get_uptime_ms() == start)
+		__asm__ __volatile__("pause");
+
+	lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+	lapic_delay(kLAPIC_CALIBRATION_MS);
+	uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+	lapic_write(LAPIC_TIMER_INITIAL, 0);
+
+	// A timer that did not count is of no use as a clock event device, and
+	// would leave nothing to divide by.
+	lapic_ticks_per_ms = elapsed / kLAPIC_CALIBRATION_MS;
+	if (lapic_ticks_per_ms == 0) {
+		fprintf(dbgout, "WARNING: The Local APIC timer did not count\n");
+		return 0;
+	}
+
+	fprintf(dbgout, "Local APIC timer runs at %d ticks per millisecond\n",
+		lapic_ticks_per_ms);
+	return 1;
+}
+
+static void lapic_timer_program(uint64_t delta)
+{
+	// Writing the initial count starts a new countdown, replacing whatever 
+	// was programmed before.
+	uint64_t ticks = (delta * lapic_ticks_per_ms) / 1000;
+	if (ticks == 0)
+		ticks = 1;
+	else if (ticks > 0xFFFFFFFF)
+		ticks = 0xFFFFFFFF;
+	lapic_write(LAPIC_TIMER_INITIAL, (uint32_t)ticks);
+}
+
+void lapic_timer_start(uint8_t vector)
+{
+	// The timer fires once each time that it is programmed. It is limited to 
+	// a delay that the 32-bit count is able to hold.
+	lapic_clock_event.max_delta = (0xFFFFFFFFULL * 1000) / lapic_ticks_per_ms;
+
+	lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+	lapic_write(LAPIC_LVT_TIMER, vector);
+	clock_event_register(&lapic_clock_event);
+}
+
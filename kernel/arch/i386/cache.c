@@ -0,0 +1,198 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#include <arch/i386/cache.h>
+#include <arch/i386/features.h>
+#include <arch/i386/util.h>
+#include <arch/i386/tlb.h>
+#include <atomic.h>
+#include <stdio.h>
+
+#define MSR_MTRR_CAP		0x0FE
+#define MSR_MTRR_PHYS_BASE	0x200
+#define MSR_MTRR_PHYS_MASK	0x201
+#define MSR_PAT				0x277
+#define MSR_MTRR_DEF_TYPE	0x2FF
+
+#define MTRR_CAP_COUNT		0xFF
+#define MTRR_CAP_WC			(1 << 10)
+#define MTRR_DEF_ENABLE		(1 << 11)
+#define MTRR_MASK_VALID		(1 << 11)
+#define MTRR_PAGE_MASK		0xFFFULL
+#define MTRR_MAX_RANGES		8
+
+#define MEMORY_TYPE_UC		0x00
+#define MEMORY_TYPE_WC		0x01
+#define MEMORY_TYPE_WT		0x04
+#define MEMORY_TYPE_WB		0x06
+#define MEMORY_TYPE_UC_MINUS	0x07
+
+#define CR0_NW				(1 << 29)
+#define CR0_CD				(1 << 30)
+
+static int pat_enabled = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+
+void cache_flush(void)
+{
+	__asm__ __volatile__("wbinvd" ::: "memory");
+}
+
+static uint32_t cache_disable(void)
+{
+	// The caches must be disabled and flushed while memory types change.
+	uint32_t cr0 = get_cr0();
+	set_cr0((cr0 | CR0_CD) & ~CR0_NW);
+	cache_flush();
+	return cr0;
+}
+
+static void cache_enable(uint32_t cr0)
+{
+	cache_flush();
+	tlb_flush_global();
+	set_cr0(cr0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void cache_prepare(void)
+{
+	if (!cpu_pat_available()) {
+		fprintf(dbgout, "The CPU does not have a Page Attribute Table\n");
+		return;
+	}
+
+	// The power on default for PAT entry 1 is write-through. Nothing in the
+	// kernel selects it, so it is replaced by write-combining. The upper four
+	// entries mirror the lower four.
+	uint64_t pat = ((uint64_t)MEMORY_TYPE_WB << 0)
+				 | ((uint64_t)MEMORY_TYPE_WC << 8)
+				 | ((uint64_t)MEMORY_TYPE_UC_MINUS << 16)
+				 | ((uint64_t)MEMORY_TYPE_UC << 24);
+	pat |= (pat << 32);
+
+	atom_t atom;
+	atomic_start(atom);
+	uint32_t cr0 = cache_disable();
+	write_msr(MSR_PAT, pat);
+	cache_enable(cr0);
+	atomic_end(atom);
+
+	pat_enabled = 1;
+	fprintf(dbgout, "Page Attribute Table programmed with write-combining\n");
+}
+
+int cache_pat_available(void)
+{
+	return pat_enabled;
+}
+
+static uint32_t cache_mtrr_split(
+	uint64_t base, 
+	uint64_t end, 
+	uint64_t *bases, 
+	uint64_t *sizes
+) {
+	// Variable ranges must be a power of two in size, and aligned to it. The
+	// range is covered exactly by taking the largest such block that fits at
+	// each step, so no memory beyond it is affected.
+	uint32_t count = 0;
+	while (base < end) {
+		if (count == MTRR_MAX_RANGES)
+			return 0;
+
+		uint64_t size = 0x1000;
+		while ((base & ((size << 1) - 1)) == 0 && base + (size << 1) <= end)
+			size <<= 1;
+
+		bases[count] = base;
+		sizes[count] = size;
+		count++;
+		base += size;
+	}
+	return count;
+}
+
+int cache_mtrr_write_combining(uintptr_t base, uint32_t length)
+{
+	if (!cpu_mtrr_available() || length == 0)
+		return kCACHE_ERROR;
+
+	uint64_t capabilities = read_msr(MSR_MTRR_CAP);
+	if (!(capabilities & MTRR_CAP_WC))
+		return kCACHE_ERROR;
+
+	// MTRRs work on whole pages. The mask covers every bit of a physical 
+	// address that the CPU implements.
+	uint64_t start = (uint64_t)base & ~MTRR_PAGE_MASK;
+	uint64_t end = ((uint64_t)base + length + MTRR_PAGE_MASK) & ~MTRR_PAGE_MASK;
+	uint64_t address_mask = ((1ULL << cpu_physical_address_bits()) - 1) 
+						  & ~MTRR_PAGE_MASK;
+
+	uint64_t bases[MTRR_MAX_RANGES];
+	uint64_t sizes[MTRR_MAX_RANGES];
+	uint32_t needed = cache_mtrr_split(start, end, bases, sizes);
+	if (needed == 0) {
+		fprintf(dbgout, "Too many MTRRs are needed to cover %p (%d bytes)\n",
+			base, length);
+		return kCACHE_ERROR;
+	}
+
+	// Find enough free variable ranges before changing any of them, so the
+	// range is either covered entirely or not at all.
+	uint32_t count = capabilities & MTRR_CAP_COUNT;
+	uint32_t slots[MTRR_MAX_RANGES];
+	uint32_t found = 0;
+	for (uint32_t n = 0; n < count && found < needed; ++n) {
+		uint64_t mask = read_msr(MSR_MTRR_PHYS_MASK + (n * 2));
+		if (!(mask & MTRR_MASK_VALID))
+			slots[found++] = n;
+	}
+
+	if (found < needed)
+		return kCACHE_ERROR;
+
+	atom_t atom;
+	atomic_start(atom);
+	uint32_t cr0 = cache_disable();
+
+	uint64_t def_type = read_msr(MSR_MTRR_DEF_TYPE);
+	write_msr(MSR_MTRR_DEF_TYPE, def_type & ~MTRR_DEF_ENABLE);
+	for (uint32_t n = 0; n < needed; ++n) {
+		write_msr(MSR_MTRR_PHYS_BASE + (slots[n] * 2), 
+			(bases[n] & address_mask) | MEMORY_TYPE_WC);
+		write_msr(MSR_MTRR_PHYS_MASK + (slots[n] * 2),
+			(~(sizes[n] - 1) & address_mask) | MTRR_MASK_VALID);
+	}
+	write_msr(MSR_MTRR_DEF_TYPE, def_type);
+
+	cache_enable(cr0);
+	atomic_end(atom);
+
+	for (uint32_t n = 0; n < needed; ++n) {
+		fprintf(dbgout, "MTRR %d set to write-combining for %p (%d bytes)\n",
+			slots[n], (uint32_t)bases[n], (uint32_t)sizes[n]);
+	}
+	return kCACHE_OK;
+}
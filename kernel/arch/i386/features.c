@@ -24,16 +24,30 @@
 #include <stdint.h>
 
 #define CPUID_GETFEATURES	1
+#define CPUID_EXTENDED_MAX	0x80000000
+#define CPUID_POWER_MGMT	0x80000007
+#define CPUID_ADDRESS_SIZES	0x80000008
 
 ////////////////////////////////////////////////////////////////////////////////
 
 enum cpuid_features
 {
+	CPUID_FEATURE_EDX_PSE	= 1 << 3,
+	CPUID_FEATURE_EDX_TSC	= 1 << 4,
+	CPUID_FEATURE_EDX_PAE	= 1 << 6,
+	CPUID_FEATURE_EDX_PGE	= 1 << 13,
+	CPUID_FEATURE_EDX_MTRR	= 1 << 12,
+	CPUID_FEATURE_EDX_PAT	= 1 << 16,
 	CPUID_FEATURE_EDX_MMX	= 1 << 23,
 	CPUID_FEATURE_EDX_SSE 	= 1 << 25,
 	CPUID_FEATURE_EDX_SSE2	= 1 << 26,
 };
 
+enum cpuid_power_features
+{
+	CPUID_POWER_EDX_INVARIANT_TSC	= 1 << 8,
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static inline void cpuid(
@@ -60,9 +74,70 @@ int cpu_sse_available(void)
 	return ((edx & CPUID_FEATURE_EDX_SSE) == 1);
 }
 
+int cpu_pse_available(void)
+{
+	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+	cpuid(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
+	return ((edx & CPUID_FEATURE_EDX_PSE) != 0);
+}
+
+int cpu_pge_available(void)
+{
+	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+	cpuid(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
+	return ((edx & CPUID_FEATURE_EDX_PGE) != 0);
+}
+
+int cpu_pat_available(void)
+{
+	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+	cpuid(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
+	return ((edx & CPUID_FEATURE_EDX_PAT) != 0);
+}
+
+int cpu_mtrr_available(void)
+{
+	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+	cpuid(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
+	return ((edx & CPUID_FEATURE_EDX_MTRR) != 0);
+}
+
 int cpu_mmx_available(void)
 {
 	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
 	cpuid(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
 	return ((edx & CPUID_FEATURE_EDX_MMX) == 1);
-}
\ No newline at end of file
+}
+
+int cpu_tsc_available(void)
+{
+	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+	cpuid(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
+	return ((edx & CPUID_FEATURE_EDX_TSC) != 0);
+}
+
+int cpu_invariant_tsc_available(void)
+{
+	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+	cpuid(CPUID_EXTENDED_MAX, &eax, &ebx, &ecx, &edx);
+	if (eax < CPUID_POWER_MGMT)
+		return 0;
+
+	cpuid(CPUID_POWER_MGMT, &eax, &ebx, &ecx, &edx);
+	return ((edx & CPUID_POWER_EDX_INVARIANT_TSC) != 0);
+}
+
+int cpu_physical_address_bits(void)
+{
+	// Older CPUs do not report the width. They support 36 bits if they have
+	// PAE, and 32 bits otherwise.
+	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+	cpuid(CPUID_EXTENDED_MAX, &eax, &ebx, &ecx, &edx);
+	if (eax >= CPUID_ADDRESS_SIZES) {
+		cpuid(CPUID_ADDRESS_SIZES, &eax, &ebx, &ecx, &edx);
+		return eax & 0xFF;
+	}
+
+	cpuid(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
+	return (edx & CPUID_FEATURE_EDX_PAE) ? 36 : 32;
+}
@@ -24,17 +24,38 @@
 #include <memory.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static struct gdt_segment _segments[6] = { 0 };
-static struct gdt_pointer _gdt = { 0 };
-static struct tss _tss = { 0 };
+// Every CPU has its own copy of the GDT. They are identical apart from the
+// double fault task descriptor, which refers to the double fault task of the
+// CPU. The IDT is shared, so its task gate uses the same selector everywhere.
+static struct gdt_segment _segments[kMAX_CPUS][kGDT_COUNT] = { { { 0 } } };
+static struct gdt_pointer _gdt[kMAX_CPUS] = { { 0 } };
+static struct tss _double_fault_tss[kMAX_CPUS] = { 0 };
+static struct tss _cpu_tss[kMAX_CPUS] = { 0 };
 
 extern void gdt_load(struct gdt_pointer *);
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void gdt_encode_descriptor(
+	struct gdt_segment *segment,
+	uint32_t base, 
+	uint32_t limit, 
+	uint8_t access, 
+	uint8_t flags
+) {
+	segment->base_lo = (base & 0xFFFF);
+	segment->base_mid = ((base >> 16) & 0xFF);
+	segment->base_hi = ((base >> 24) & 0xFF);
+	segment->limit_lo = (limit & 0xFFFF);
+	segment->limit_hi = ((limit >> 16) & 0x0F);
+	segment->access = access;
+	segment->granularity = (flags & 0x0F);
+}
+
 static void gdt_set_descriptor(
 	uint8_t n, 
 	uint32_t base, 
@@ -47,34 +68,91 @@ static void gdt_set_descriptor(
 		"Set GDT Descriptor(%d): base=%p limit=%05x access=%02x flags=%02x\n", 
 		n, base, limit, access, flags
 	);
-	_segments[n].base_lo = (base & 0xFFFF);
-	_segments[n].base_mid = ((base >> 16) & 0xFF);
-	_segments[n].base_hi = ((base >> 24) & 0xFF);
-	_segments[n].limit_lo = (limit & 0xFFFF);
-	_segments[n].limit_hi = ((limit >> 16) & 0x0F);
-	_segments[n].access = access;
-	_segments[n].granularity = (flags & 0x0F);
+	for (uint32_t cpu = 0; cpu < kMAX_CPUS; ++cpu)
+		gdt_encode_descriptor(&_segments[cpu][n], base, limit, access, flags);
 }
 
-void gdt_set_tss_descriptor(uint8_t n, uint32_t ss0, uint32_t esp0)
+static void gdt_prepare_tss(struct tss *tss)
+{
+	memset(tss, 0x00, sizeof(*tss));
+
+	tss->ss0 = 0x10;
+	tss->cs = 0x8;
+	tss->ss = 0x10;
+	tss->ds = 0x10;
+	tss->es = 0x10;
+	tss->fs = 0x10;
+	tss->gs = 0x10;
+	tss->iopb = sizeof(*tss);
+}
+
+static void gdt_set_tss_descriptor(uint8_t n, struct tss *tss)
 {
 	fprintf(dbgout, "Set GDT::TSS Descriptor(%d)\n", n);
-	uintptr_t base = (uintptr_t)&_tss;
-	uintptr_t limit = (uintptr_t)base + sizeof(_tss);
-
-	gdt_set_descriptor(n, base, limit, 0xE9, 0x00);
-
-	memset(&_tss, 0x00, sizeof(_tss));
-
-	_tss.ss0 = ss0;
-	_tss.esp0 = esp0;
-	_tss.cs = 0x8;
-	_tss.ss = 0x10;
-	_tss.ds = 0x10;
-	_tss.es = 0x10;
-	_tss.fs = 0x10;
-	_tss.gs = 0x10;
-	_tss.iopb = sizeof(_tss);
+	gdt_set_descriptor(n, (uintptr_t)tss, sizeof(*tss) - 1, 0x89, 0x00);
+	gdt_prepare_tss(tss);
+}
+
+uint16_t gdt_set_double_fault_task(
+	uint32_t cpu, 
+	void *entry, 
+	void *stack, 
+	uint32_t cr3
+) {
+	// The task is only ever entered through the task gate of the double fault
+	// exception, so that the fault has a known good stack to be handled on.
+	// Only the GDT of the CPU refers to it, so two CPUs faulting at once each
+	// get their own task and stack.
+	struct tss *tss = &_double_fault_tss[cpu];
+	gdt_encode_descriptor(
+		&_segments[cpu][kGDT_DOUBLE_FAULT], 
+		(uintptr_t)tss, sizeof(*tss) - 1, 0x89, 0x00
+	);
+	gdt_prepare_tss(tss);
+
+	tss->eip = (uintptr_t)entry;
+	tss->esp = (uintptr_t)stack;
+	tss->ebp = 0;
+	tss->cr3 = cr3;
+	tss->eflags = 0x2;
+	return kGDT_DOUBLE_FAULT << 3;
+}
+
+uint32_t gdt_double_fault_cpu(void)
+{
+	// Each CPU has its own GDT, so the one that is loaded identifies the CPU 
+	// that entered the double fault task.
+	struct gdt_pointer gdt;
+	__asm__ __volatile__("sgdt %0" : "=m"(gdt));
+	return (gdt.offset - (uintptr_t)_segments) / sizeof(_segments[0]);
+}
+
+uint16_t gdt_set_cpu_task(uint32_t cpu)
+{
+	// The task of each CPU is never switched to. It only exists as somewhere
+	// for the processor to save state when it enters the double fault task.
+	uint8_t n = kGDT_TASK_FIRST + cpu;
+	gdt_set_tss_descriptor(n, &_cpu_tss[cpu]);
+	return n << 3;
+}
+
+struct tss *gdt_get_cpu_task(uint32_t cpu)
+{
+	return (cpu < kMAX_CPUS) ? &_cpu_tss[cpu] : NULL;
+}
+
+uint16_t gdt_set_cpu_descriptor(uint32_t cpu, uint32_t base, uint32_t limit)
+{
+	// Each CPU has a small data segment covering its cpu structure, which is
+	// loaded in to GS.
+	uint8_t n = kGDT_CPU_FIRST + cpu;
+	gdt_set_descriptor(n, base, limit, 0x92, 0x4);
+	return n << 3;
+}
+
+void gdt_reload(uint32_t cpu)
+{
+	gdt_load(&_gdt[cpu]);
 }
 
 void gdt_prepare(void)
@@ -96,12 +174,14 @@ void gdt_prepare(void)
 	// Userland Data Segment
 	gdt_set_descriptor(4, 0, 0xFFFFF, 0xF2, 0xC);
 
-	// TSS
-	gdt_set_tss_descriptor(5, 0x10, 0x0);
+	// The double fault TSS of each CPU is set up along with the double fault
+	// handler.
 
-	// Make sure the pointer is correct, and load it.
-	_gdt.size = (sizeof(_segments) - 1);
-	_gdt.offset = (uintptr_t)&_segments;
+	// Make sure the pointers are correct, and load the one for this CPU.
+	for (uint32_t cpu = 0; cpu < kMAX_CPUS; ++cpu) {
+		_gdt[cpu].size = (sizeof(_segments[cpu]) - 1);
+		_gdt[cpu].offset = (uintptr_t)&_segments[cpu];
+	}
 
-	gdt_load(&_gdt);
+	gdt_load(&_gdt[0]);
 }
\ No newline at end of file
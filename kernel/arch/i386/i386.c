@@ -30,6 +30,9 @@ void architecture_prepare(struct boot_config *config __attribute__((unused)))
 {
 	fprintf(dbgout, "Preparing system architecture: i386\n");
 	gdt_prepare();
+	cpu_prepare();
+	tlb_prepare();
+	cache_prepare();
 }
 
 #endif
\ No newline at end of file
@@ -32,34 +32,165 @@
 #include <memory.h>
 #include <task.h>
 #include <macro.h>
+#include <panic.h>
+#include <virtual.h>
+#include <clockevent.h>
+#include <arch/i386/util.h>
+#include <arch/i386/smp.h>
+#include <arch/i386/apic.h>
+#include <arch/i386/tlb.h>
+#include <arch/i386/gdt.h>
 
+struct idt_gate {
+	uint16_t offset_lo;
+	uint16_t selector;
+	uint8_t zero;
+	uint8_t flags;
+	uint16_t offset_hi;
+} __attribute__((packed));
+
+static struct idt_gate *idt = NULL;
 static interrupt_handler_t *idt_stubs = NULL;
 static interrupt_handler_t *interrupt_handlers = NULL;
-static uint8_t yield_timer = 0;
 
-#define YIELD_THRESHOLD 20
+#define DOUBLE_FAULT	0x08
+#define PAGE_FAULT		0x0E
+
+#ifndef kDOUBLE_FAULT_STACK_SIZE
+#	define kDOUBLE_FAULT_STACK_SIZE		8192
+#endif
+
+static uint8_t double_fault_stack[kMAX_CPUS][kDOUBLE_FAULT_STACK_SIZE] 
+	__attribute__((aligned(16)));
+
+extern void page_fault_entry(void);
 
 void request_preemption(void)
 {
-	yield_timer = YIELD_THRESHOLD;
+	clock_event_expire_slice();
 }
 
 void interrupt_irq_stub(struct interrupt_frame *frame)
 {
-	// Attempt to find the appropriate handler, and execute it.
+	// The stubs of CoreLoader reset GS along with the other segments. IRQs
+	// from the PIC are only ever delivered to the bootstrap processor.
+	struct cpu *cpu = cpu_get(0);
+	cpu_load_segment(cpu);
+
+	// Attempt to find the appropriate handler, and execute it. The PIT is the
+	// clock event device of this CPU, and its handler takes care of switching
+	// tasks. Any other IRQ only causes a switch if it wakes a task that 
+	// outranks the current one.
 	uint8_t irq = frame->interrupt + 0x20;
 	interrupt_handler_t fn = interrupt_handlers[irq];
-	if (fn) {
+	if (fn)
 		fn(frame);
-		if (irq != 0x20)
-			yield_timer = YIELD_THRESHOLD;
+}
+
+void lapic_timer_handler(struct interrupt_frame *frame)
+{
+	// The other CPUs use their own Local APIC timer as their clock event 
+	// device. The interrupt is acknowledged first, as yield does not return.
+	lapic_eoi();
+	clock_event_interrupt(frame, 0);
+}
+
+void reschedule_handler(struct interrupt_frame *frame)
+{
+	// Another CPU has queued a task on this one. It may need to run straight 
+	// away, or the current task may now need a timeslice.
+	lapic_eoi();
+	if (task_preempt_needed())
+		yield(frame, 0);
+	clock_event_reprogram();
+}
+
+void tlb_shootdown_handler(struct interrupt_frame *frame __attribute__((unused)))
+{
+	tlb_shootdown_poll();
+	lapic_eoi();
+}
+
+void page_fault_handler(struct interrupt_frame *frame)
+{
+	// GS holds the per-CPU segment, unless the fault was taken inside one of 
+	// the IRQ stubs of CoreLoader. Those only run on the bootstrap processor.
+	// The original GS is restored when the handler returns.
+	if ((frame->gs & 0xFFFF) == 0x10)
+		cpu_load_segment(cpu_get(0));
+
+	uintptr_t address = get_cr2();
+	if (kpage_fault(address, frame->error_code) == kPAGE_ALLOC_OK)
+		return;
+
+	// Guard pages only exist to catch stacks overflowing.
+	if (is_page_allocated(address) == kPAGE_GUARD) {
+		struct panic_info info = (struct panic_info) {
+			panic_memory,
+			"KERNEL STACK OVERFLOW",
+			"A thread has overflowed its stack and touched the guard page "
+			"beneath it."
+		};
+		panic(&info, frame);
 	}
 
-	if (irq == 0x20 && (++yield_timer >= YIELD_THRESHOLD))
-	{
-		yield_timer = 0;
-		yield(frame);
+	// The fault is genuine, so report it in the same way as CoreLoader would.
+	panic(NULL, frame);
+}
+
+__attribute__((noreturn))
+static void double_fault_task(void)
+{
+	// The double fault task starts with a flat GS, so the segment of the CPU
+	// that faulted has to be restored before anything asks for the current
+	// CPU. Its registers were saved in its own task state segment.
+	uint32_t index = gdt_double_fault_cpu();
+	cpu_load_segment(cpu_get(index));
+	struct tss *task = gdt_get_cpu_task(index);
+
+	struct interrupt_frame frame = (struct interrupt_frame) {
+		.gs = task->gs, .fs = task->fs, .es = task->es, .ds = task->ds,
+		.eax = task->eax, .ecx = task->ecx, .edx = task->edx, 
+		.ebx = task->ebx, .esp = task->esp, .ebp = task->ebp, 
+		.esi = task->esi, .edi = task->edi, .interrupt = DOUBLE_FAULT,
+		.eip = task->eip, .cs = task->cs, .eflags = task->eflags,
+		.ss = task->ss
+	};
+
+	// A stack overflowing in to its guard page faults again when the page 
+	// fault is pushed on to it, which is why it ends up here.
+	if (is_page_allocated(get_cr2()) == kPAGE_GUARD) {
+		struct panic_info info = (struct panic_info) {
+			panic_memory,
+			"KERNEL STACK OVERFLOW",
+			"A thread has overflowed its stack and touched the guard page "
+			"beneath it."
+		};
+		panic(&info, &frame);
 	}
+	panic(NULL, &frame);
+
+	while (1)
+		__asm__ __volatile__("cli; hlt");
+}
+
+static void interrupt_task_gate_install(uint8_t interrupt, uint16_t selector)
+{
+	idt[interrupt].offset_lo = 0x0000;
+	idt[interrupt].offset_hi = 0x0000;
+	idt[interrupt].selector = selector;
+	idt[interrupt].zero = 0x00;
+	idt[interrupt].flags = 0x85;
+}
+
+void interrupt_gate_install(uint8_t interrupt, void *entry)
+{
+	uintptr_t offset = (uintptr_t)entry;
+	idt[interrupt].offset_lo = (offset & 0xFFFF);
+	idt[interrupt].offset_hi = ((offset >> 16) & 0xFFFF);
+	idt[interrupt].selector = 0x08;
+	idt[interrupt].zero = 0x00;
+	idt[interrupt].flags = 0x8E;
 }
 
 void interrupt_handlers_prepare(struct boot_config *config)
@@ -67,6 +198,8 @@ void interrupt_handlers_prepare(struct boot_config *config)
 	// Disable interrupts for the duration of this function.
 	__asm__ __volatile__("cli");
 
+	idt = (struct idt_gate *)config->idt_base;
+
 	idt_stubs = (interrupt_handler_t *)config->interrupt_stubs;
 	fprintf(dbgout, "Interrupt stubs table is located at %p\n", idt_stubs);
 
@@ -82,6 +215,25 @@ void interrupt_handlers_prepare(struct boot_config *config)
 
 	fprintf(dbgout, "Installed interrupt stubs for each IRQ\n");
 
+	// Page faults are resolved by the kernel rather than being a panic.
+	interrupt_gate_install(PAGE_FAULT, page_fault_entry);
+	fprintf(dbgout, "Installed page fault handler\n");
+
+	// Double faults are handled as a separate task with its own stack, as the 
+	// stack of the faulting thread is likely to be the cause. Every CPU has
+	// its own task and stack, behind the same selector in its own GDT.
+	uint16_t double_fault = 0;
+	for (uint32_t cpu = 0; cpu < kMAX_CPUS; ++cpu) {
+		double_fault = gdt_set_double_fault_task(
+			cpu,
+			double_fault_task,
+			double_fault_stack[cpu] + kDOUBLE_FAULT_STACK_SIZE,
+			address_space_get_kernel()->directory_frame
+		);
+	}
+	interrupt_task_gate_install(DOUBLE_FAULT, double_fault);
+	fprintf(dbgout, "Installed double fault task\n");
+
 	// Re-enable interrupts
 	__asm__ __volatile__("sti");
 }
@@ -0,0 +1,182 @@
+; Copyright (c) 2017-2018 Tom Hancocks
+; 
+; Permission is hereby granted, free of charge, to any person obtaining a copy
+; of this software and associated documentation files (the "Software"), to deal
+; in the Software without restriction, including without limitation the rights
+; to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+; copies of the Software, and to permit persons to whom the Software is
+; furnished to do so, subject to the following conditions:
+; 
+; The above copyright notice and this permission notice shall be included in all
+; copies or substantial portions of the Software.
+; 
+; THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+; IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+; FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+; AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+; LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+; OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+; SOFTWARE.
+
+	[bits 	32]
+
+	global	page_fault_entry
+	global	lapic_timer_entry
+	global	tlb_shootdown_entry
+	global	reschedule_entry
+	global	lapic_spurious_entry
+	extern	page_fault_handler
+	extern	lapic_timer_handler
+	extern	tlb_shootdown_handler
+	extern	reschedule_handler
+
+;;
+;; Entry point for Page Faults. The CPU has already pushed an error code, so
+;; only the interrupt number needs to be pushed to complete the interrupt frame.
+;; The handler either resolves the fault and returns, or panics.
+;; WARNING: This is a naked function and it should not be called directly.
+;;
+;;	void page_fault_entry(void)
+;;
+page_fault_entry:
+	.construct_stack_values:
+		push byte 14
+		pushad
+		push ds
+		push es
+		push fs
+		push gs
+	.correct_segments:
+		mov ax, 0x10
+		mov ds, ax
+		mov es, ax
+		mov fs, ax
+		cld
+	.handle_fault:
+		push esp
+		call page_fault_handler
+		add esp, 4
+	.conclude:
+		pop gs
+		pop fs
+		pop es
+		pop ds
+		popad
+		add esp, 8
+		iret
+
+;;
+;; Entry point for the Local APIC timer. The frame is built in the same way as
+;; for a page fault, so that the handler is able to switch tasks with it. The
+;; handler signals the end of the interrupt itself.
+;; WARNING: This is a naked function and it should not be called directly.
+;;
+;;	void lapic_timer_entry(void)
+;;
+lapic_timer_entry:
+	.construct_stack_values:
+		push byte 0
+		push byte 0x40
+		pushad
+		push ds
+		push es
+		push fs
+		push gs
+	.correct_segments:
+		mov ax, 0x10
+		mov ds, ax
+		mov es, ax
+		mov fs, ax
+		cld
+	.handle_tick:
+		push esp
+		call lapic_timer_handler
+		add esp, 4
+	.conclude:
+		pop gs
+		pop fs
+		pop es
+		pop ds
+		popad
+		add esp, 8
+		iret
+
+;;
+;; Entry point for reschedule requests sent by other CPUs. The handler may
+;; switch tasks, so the frame is built in the same way as for a page fault.
+;; WARNING: This is a naked function and it should not be called directly.
+;;
+;;	void reschedule_entry(void)
+;;
+reschedule_entry:
+	.construct_stack_values:
+		push byte 0
+		push byte 0x42
+		pushad
+		push ds
+		push es
+		push fs
+		push gs
+	.correct_segments:
+		mov ax, 0x10
+		mov ds, ax
+		mov es, ax
+		mov fs, ax
+		cld
+	.handle_request:
+		push esp
+		call reschedule_handler
+		add esp, 4
+	.conclude:
+		pop gs
+		pop fs
+		pop es
+		pop ds
+		popad
+		add esp, 8
+		iret
+
+;;
+;; Entry point for TLB shootdown requests sent by other CPUs.
+;; WARNING: This is a naked function and it should not be called directly.
+;;
+;;	void tlb_shootdown_entry(void)
+;;
+tlb_shootdown_entry:
+	.construct_stack_values:
+		push byte 0
+		push byte 0x41
+		pushad
+		push ds
+		push es
+		push fs
+		push gs
+	.correct_segments:
+		mov ax, 0x10
+		mov ds, ax
+		mov es, ax
+		mov fs, ax
+		cld
+	.handle_request:
+		push esp
+		call tlb_shootdown_handler
+		add esp, 4
+	.conclude:
+		pop gs
+		pop fs
+		pop es
+		pop ds
+		popad
+		add esp, 8
+		iret
+
+;;
+;; Entry point for spurious interrupts from the Local APIC. These must not be
+;; acknowledged.
+;; WARNING: This is a naked function and it should not be called directly.
+;;
+;;	void lapic_spurious_entry(void)
+;;
+lapic_spurious_entry:
+	.conclude:
+		iret
@@ -0,0 +1,233 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#include <arch/i386/mp.h>
+#include <virtual.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#define MP_FLOATING_SIGNATURE	0x5F504D5F	// "_MP_"
+#define MP_TABLE_SIGNATURE		0x504D4350	// "PCMP"
+
+#define MP_ENTRY_PROCESSOR		0
+#define MP_ENTRY_BUS			1
+#define MP_ENTRY_IOAPIC			2
+#define MP_ENTRY_IO_INTERRUPT	3
+#define MP_ENTRY_LOCAL_INTERRUPT	4
+
+#define MP_PROCESSOR_ENABLED	(1 << 0)
+#define MP_PROCESSOR_BSP		(1 << 1)
+#define MP_IOAPIC_ENABLED		(1 << 0)
+
+#define kLOW_MEMORY_LIMIT		0x100000
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct mp_floating_pointer
+{
+	uint32_t signature;
+	uint32_t table;
+	uint8_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	uint8_t features[5];
+} __attribute__((packed));
+
+struct mp_table_header
+{
+	uint32_t signature;
+	uint16_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem[8];
+	char product[12];
+	uint32_t oem_table;
+	uint16_t oem_table_size;
+	uint16_t entry_count;
+	uint32_t lapic_address;
+	uint16_t extended_length;
+	uint8_t extended_checksum;
+	uint8_t reserved;
+} __attribute__((packed));
+
+struct mp_processor_entry
+{
+	uint8_t type;
+	uint8_t apic_id;
+	uint8_t apic_version;
+	uint8_t flags;
+	uint32_t signature;
+	uint32_t features;
+	uint32_t reserved[2];
+} __attribute__((packed));
+
+struct mp_ioapic_entry
+{
+	uint8_t type;
+	uint8_t id;
+	uint8_t version;
+	uint8_t flags;
+	uint32_t address;
+} __attribute__((packed));
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint8_t mp_checksum(const void *ptr, uint32_t length)
+{
+	const uint8_t *bytes = ptr;
+	uint8_t sum = 0;
+	for (uint32_t n = 0; n < length; ++n)
+		sum += bytes[n];
+	return sum;
+}
+
+static struct mp_floating_pointer *mp_search(uintptr_t start, uint32_t length)
+{
+	// The floating pointer is always aligned to 16 bytes. The first MiB of
+	// memory is identity mapped, so it can be searched directly.
+	for (uintptr_t address = start; address < start + length; address += 16) {
+		struct mp_floating_pointer *fp = (void *)address;
+		if (fp->signature != MP_FLOATING_SIGNATURE)
+			continue;
+		else if (mp_checksum(fp, fp->length * 16) != 0)
+			continue;
+		return fp;
+	}
+	return NULL;
+}
+
+static struct mp_floating_pointer *mp_find(void)
+{
+	// Search the first KiB of the EBDA, the last KiB of base memory, and then
+	// the BIOS ROM, as given by the MP specification.
+	struct mp_floating_pointer *fp = NULL;
+	uintptr_t ebda = (uintptr_t)(*(uint16_t *)0x40E) << 4;
+	uintptr_t base_memory = (uintptr_t)(*(uint16_t *)0x413) * 1024;
+
+	if (ebda && (fp = mp_search(ebda, 1024)))
+		return fp;
+	else if (base_memory && (fp = mp_search(base_memory - 1024, 1024)))
+		return fp;
+	return mp_search(0xF0000, 0x10000);
+}
+
+static void *mp_table_map(uintptr_t address, uint32_t length)
+{
+	// Tables in low memory are reached through the identity map. Anything 
+	// else has to be mapped.
+	if (address + length <= kLOW_MEMORY_LIMIT)
+		return (void *)address;
+	return (void *)kpage_map_device(address, length);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int mp_prepare(struct mp_configuration *config)
+{
+	memset(config, 0, sizeof(*config));
+
+	struct mp_floating_pointer *fp = mp_find();
+	if (!fp) {
+		fprintf(dbgout, "No MP floating pointer structure was found\n");
+		return 0;
+	}
+	else if (fp->features[0] != 0 || fp->table == 0) {
+		// Default configurations describe fixed systems with two CPUs. They
+		// predate anything that the kernel is likely to run on.
+		fprintf(dbgout, "MP default configuration %d is not supported\n",
+			fp->features[0]);
+		return 0;
+	}
+
+	struct mp_table_header *header = mp_table_map(fp->table, sizeof(*header));
+	if (!header || header->signature != MP_TABLE_SIGNATURE) {
+		fprintf(dbgout, "MP configuration table is invalid\n");
+		return 0;
+	}
+
+	header = mp_table_map(fp->table, header->length);
+	if (!header || mp_checksum(header, header->length) != 0) {
+		fprintf(dbgout, "MP configuration table has a bad checksum\n");
+		return 0;
+	}
+
+	fprintf(dbgout, "MP configuration table found at %p (%d entries)\n", 
+		fp->table, header->entry_count);
+	config->lapic_address = header->lapic_address;
+
+	// Walk the entries. Only processors and I/O APICs are of interest, but 
+	// the size of every entry must be known to reach the next.
+	uint8_t *entry = (uint8_t *)(header + 1);
+	for (uint32_t n = 0; n < header->entry_count; ++n) {
+		switch (*entry) {
+			case MP_ENTRY_PROCESSOR: {
+				struct mp_processor_entry *cpu = (void *)entry;
+				entry += sizeof(*cpu);
+
+				if (!(cpu->flags & MP_PROCESSOR_ENABLED))
+					break;
+				else if (cpu->flags & MP_PROCESSOR_BSP)
+					config->bsp_apic_id = cpu->apic_id;
+
+				fprintf(dbgout, "  Processor with APIC ID %d%s\n", 
+					cpu->apic_id, 
+					(cpu->flags & MP_PROCESSOR_BSP) ? " (bootstrap)" : "");
+				if (config->cpu_count < kMAX_CPUS)
+					config->cpu_apic_ids[config->cpu_count++] = cpu->apic_id;
+				break;
+			}
+
+			case MP_ENTRY_IOAPIC: {
+				struct mp_ioapic_entry *ioapic = (void *)entry;
+				entry += sizeof(*ioapic);
+
+				if (!(ioapic->flags & MP_IOAPIC_ENABLED))
+					break;
+				else if (config->ioapic_count >= kMP_MAX_IOAPICS)
+					break;
+
+				struct mp_ioapic *info = &config->ioapics[config->ioapic_count++];
+				info->id = ioapic->id;
+				info->address = ioapic->address;
+				break;
+			}
+
+			case MP_ENTRY_BUS:
+			case MP_ENTRY_IO_INTERRUPT:
+			case MP_ENTRY_LOCAL_INTERRUPT: {
+				entry += 8;
+				break;
+			}
+
+			default: {
+				// The size of an unknown entry can not be known, so nothing
+				// after it can be trusted.
+				fprintf(dbgout, "Unknown MP configuration entry type %d\n",
+					*entry);
+				return config->cpu_count > 0;
+			}
+		}
+	}
+
+	return config->cpu_count > 0;
+}
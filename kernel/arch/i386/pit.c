@@ -25,70 +25,129 @@
 #include <arch/i386/interrupt.h>
 #include <arch/i386/interrupt_frame.h>
 #include <stdio.h>
+#include <sema.h>
+#include <clockevent.h>
+#include <clocksource.h>
+
+#define kPIT_MIN_COUNT		16
+#define kPIT_MAX_COUNT		0xFFFF
+
+#define PIT_READBACK_CH0	0xC2
+#define PIT_STATUS_OUT		(1 << 7)
+#define PIT_STATUS_NULL		(1 << 6)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// The PIT only ever counts down a single interval, and the uptime is the sum of
+// the intervals that have passed. The position in the current interval is read
+// back from the counter, which carries on counting down once it passes zero. 
+// The output of the counter stays high from then on, which tells a late read
+// that the counter has wrapped.
 static struct {
-	uint32_t phase;
-	uint64_t subticks;
-	uint64_t ticks;
+	struct spinlock lock;
+	uint64_t counts;
+	uint64_t last;
+	uint16_t interval;
 } pit_info;
 
+static void pit_program(uint64_t delta);
+static uint64_t pit_read(void);
+
+static struct clock_event pit_clock_event = {
+	.name = "pit",
+	.min_delta = (kPIT_MIN_COUNT * 1000000ULL) / kPIT_FREQUENCY,
+	.max_delta = (kPIT_MAX_COUNT * 1000000ULL) / kPIT_FREQUENCY,
+	.program = pit_program,
+};
+
+static struct clock_source pit_clock_source = {
+	.name = "pit",
+	.frequency = kPIT_FREQUENCY,
+	.rating = 100,
+	.read = pit_read,
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static void pit_set_frequency(uint32_t freq)
+static uint8_t pit_read_counter(uint16_t *count)
 {
-	int32_t divisor = 1193180 / freq;
+	// The read-back command latches the status and the count together, so
+	// that they agree with each other.
+	outb(0x43, PIT_READBACK_CH0);
+	uint8_t status = inb(0x40);
+	*count = inb(0x40);
+	*count |= (uint16_t)inb(0x40) << 8;
+	return status;
+}
 
-	fprintf(dbgout, 
-		"Setting frequency of Programmable Interrupt Timer to %dHz\n",
-		freq);
+static uint64_t pit_counts(void)
+{
+	// Correct for up to a full period of the PIT after the interval expired,
+	// which is far longer than the IRQ can be left waiting. Until the counter
+	// has been loaded with a new interval, none of it has passed.
+	if (!pit_info.interval)
+		return pit_info.counts;
+
+	uint16_t count;
+	uint8_t status = pit_read_counter(&count);
+	if (status & PIT_STATUS_NULL)
+		return pit_info.counts;
+	else if (status & PIT_STATUS_OUT)
+		return pit_info.counts + pit_info.interval + (uint16_t)(0 - count);
+	return pit_info.counts + (uint16_t)(pit_info.interval - count);
+}
 
-	outb(0x43, 0x36);
-	outb(0x40, divisor & 0xFF);
-	outb(0x40, (divisor >> 8) & 0xFF);
+static uint64_t pit_read(void)
+{
+	// Reading the counter can not be allowed to race with it being loaded
+	// again. The count never goes backwards, even if a read lands at the 
+	// moment that a new interval is being loaded.
+	irq_flags_t flags = spin_lock_irqsave(&pit_info.lock);
+	uint64_t counts = pit_counts();
+	if (counts < pit_info.last)
+		counts = pit_info.last;
+	pit_info.last = counts;
+	spin_unlock_irqrestore(&pit_info.lock, flags);
+	return counts;
 }
 
+static void pit_program(uint64_t delta)
+{
+	// The part of the current interval that has passed is folded into the
+	// uptime before the counter is loaded with the new interval. Mode 0 
+	// raises the IRQ once when the count reaches zero.
+	uint64_t count = (delta * kPIT_FREQUENCY) / 1000000;
+	if (count < kPIT_MIN_COUNT)
+		count = kPIT_MIN_COUNT;
+	else if (count > kPIT_MAX_COUNT)
+		count = kPIT_MAX_COUNT;
+
+	irq_flags_t flags = spin_lock_irqsave(&pit_info.lock);
+	pit_info.counts = pit_counts();
+	pit_info.interval = (uint16_t)count;
+	outb(0x43, 0x30);
+	outb(0x40, count & 0xFF);
+	outb(0x40, (count >> 8) & 0xFF);
+	spin_unlock_irqrestore(&pit_info.lock, flags);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static void pit_interrupt_event(
-	struct interrupt_frame *frame __attribute__((unused))
-) {
-	if (++pit_info.subticks >= pit_info.phase) {
-		pit_info.subticks = 0;
-		++pit_info.ticks;
-	}
-
-	// TODO: Send notification to timers.
+static void pit_interrupt_event(struct interrupt_frame *frame)
+{
+	// The PIT is always wired to the PIC.
+	clock_event_interrupt(frame, 1);
 }
 
-
 ////////////////////////////////////////////////////////////////////////////////
 
 void pit_prepare(void)
 {
-	fprintf(dbgout, "Installing the Programmable Interrupt Timer.\n");
-	pit_info.phase = 1000;
+	fprintf(dbgout, "Installing the Programmable Interrupt Timer as a one-shot "
+		"clock event device.\n");
+	spin_init(&pit_info.lock);
 
-	pit_set_frequency(pit_info.phase);
 	interrupt_handler_add(0x20, pit_interrupt_event);
+	clock_source_register(&pit_clock_source);
+	clock_event_register(&pit_clock_event);
 }
-
-uint32_t pit_get_ticks(void)
-{
-	return (uint32_t)pit_info.ticks;
-}
-
-uint32_t pit_get_subticks(void)
-{
-	return (uint32_t)pit_info.subticks;
-}
-
-void arch_get_ticks(uint64_t *ticks, uint64_t *subticks, uint32_t *phase)
-{
-	if (ticks) *ticks = pit_info.ticks;
-	if (subticks) *subticks = pit_info.subticks;
-	if (phase) *phase = pit_info.phase;
-}
\ No newline at end of file
@@ -0,0 +1,261 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#include <arch/arch.h>
+#include <boot_config.h>
+#include <physical.h>
+#include <virtual.h>
+#include <kheap.h>
+#include <memory.h>
+#include <atomic.h>
+#include <task.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#define kSMP_STACK_PAGES	4
+#define kIDT_LIMIT			((256 * 8) - 1)
+#define kLOW_MEMORY_LIMIT	0x100000
+
+#define CR0_WP				(1 << 16)
+
+struct idt_pointer {
+	uint16_t limit;
+	uint32_t base;
+} __attribute__((packed));
+
+static struct cpu cpus[kMAX_CPUS] = { 0 };
+static uint32_t cpu_total = 0;
+static struct idt_pointer idt_pointer = { 0 };
+
+extern uint8_t smp_trampoline[];
+extern uint8_t smp_trampoline_protected[];
+extern uint8_t smp_trampoline_gdt[];
+extern uint8_t smp_trampoline_gdtr[];
+extern uint8_t smp_trampoline_jump[];
+extern uint8_t smp_trampoline_cr3[];
+extern uint8_t smp_trampoline_cr4[];
+extern uint8_t smp_trampoline_stack[];
+extern uint8_t smp_trampoline_cpu[];
+extern uint8_t smp_trampoline_entry[];
+extern uint8_t smp_trampoline_end[];
+
+extern void lapic_timer_entry(void);
+extern void tlb_shootdown_entry(void);
+extern void reschedule_entry(void);
+extern void lapic_spurious_entry(void);
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void cpu_setup(struct cpu *cpu, uint32_t index, uint8_t apic_id)
+{
+	memset(cpu, 0, sizeof(*cpu));
+	cpu->self = cpu;
+	cpu->index = index;
+	cpu->apic_id = apic_id;
+	cpu->selector = gdt_set_cpu_descriptor(
+		index, (uintptr_t)cpu, sizeof(*cpu) - 1
+	);
+	cpu->task = gdt_set_cpu_task(index);
+}
+
+static void cpu_load_task(struct cpu *cpu)
+{
+	// The task register is never changed after this. It is only needed so the
+	// processor can switch to the double fault task.
+	__asm__ __volatile__("ltr %0" :: "r"(cpu->task) : "memory");
+}
+
+void cpu_prepare(void)
+{
+	// Read-only pages have to be enforced for the kernel as well, or writes to
+	// copy-on-write pages would never fault. The other CPUs enable this in the
+	// trampoline.
+	set_cr0(get_cr0() | CR0_WP);
+
+	// The bootstrap processor is always the first CPU. Its APIC ID is not 
+	// known until the Local APIC has been found.
+	cpu_setup(&cpus[0], 0, 0);
+	cpus[0].bsp = 1;
+	cpus[0].online = 1;
+	cpu_total = 1;
+	cpu_load_segment(&cpus[0]);
+	cpu_load_task(&cpus[0]);
+}
+
+void cpu_load_segment(struct cpu *cpu)
+{
+	__asm__ __volatile__("movw %0, %%gs" :: "r"(cpu->selector) : "memory");
+}
+
+struct cpu *cpu_get(uint32_t index)
+{
+	return (index < cpu_total) ? &cpus[index] : NULL;
+}
+
+uint32_t cpu_count(void)
+{
+	return cpu_total;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *smp_trampoline_field(uintptr_t page, uint8_t *field)
+{
+	return (void *)(page + (field - smp_trampoline));
+}
+
+__attribute__((noreturn))
+static void smp_cpu_main(struct cpu *cpu)
+{
+	// The trampoline left the CPU with the flat GDT that it used to reach
+	// protected mode. Switch to the kernel GDT and the per-CPU segment before
+	// anything else.
+	gdt_reload(cpu->index);
+	cpu_load_segment(cpu);
+	cpu_load_task(cpu);
+	__asm__ __volatile__("lidt (%0)" :: "r"(&idt_pointer));
+	address_space_switch(address_space_get_kernel());
+
+	// The memory types and Local APIC are per-CPU, so need to be configured
+	// the same as on the bootstrap processor.
+	cache_prepare();
+	lapic_enable();
+	lapic_timer_start(kLAPIC_TIMER_VECTOR);
+
+	task_cpu_enter();
+}
+
+static uintptr_t smp_trampoline_prepare(void)
+{
+	// The trampoline has to be reachable in real mode, and identity mapped so
+	// that it survives paging being enabled.
+	uintptr_t page = kframe_alloc_zone(0, frame_zone_low);
+	uint32_t length = smp_trampoline_end - smp_trampoline;
+	if (!page || page + length > kLOW_MEMORY_LIMIT) {
+		fprintf(dbgout, "No memory below 1MiB is available for the trampoline\n");
+		return 0;
+	}
+	else if (kpage_physical_address(page) != page) {
+		fprintf(dbgout, "Trampoline page %p is not identity mapped\n", page);
+		kframe_free(page);
+		return 0;
+	}
+
+	memcpy((void *)page, smp_trampoline, length);
+
+	uint16_t *gdtr = smp_trampoline_field(page, smp_trampoline_gdtr);
+	*(uint32_t *)(gdtr + 1) = page + (smp_trampoline_gdt - smp_trampoline);
+
+	uint32_t *jump = smp_trampoline_field(page, smp_trampoline_jump);
+	*jump = page + (smp_trampoline_protected - smp_trampoline);
+
+	*(uint32_t *)smp_trampoline_field(page, smp_trampoline_cr3) = get_cr3();
+	*(uint32_t *)smp_trampoline_field(page, smp_trampoline_cr4) = get_cr4();
+	*(uint32_t *)smp_trampoline_field(page, smp_trampoline_entry) = 
+		(uintptr_t)smp_cpu_main;
+
+	return page;
+}
+
+static void smp_start_cpu(uintptr_t page, uint8_t apic_id)
+{
+	if (cpu_total >= kMAX_CPUS)
+		return;
+
+	// Stacks are committed up front, as the CPU can not take a page fault
+	// until it has loaded the IDT.
+	struct cpu *cpu = &cpus[cpu_total];
+	cpu_setup(cpu, cpu_total, apic_id);
+	uintptr_t stack = (uintptr_t)kalloc_pages(kSMP_STACK_PAGES);
+
+	*(uint32_t *)smp_trampoline_field(page, smp_trampoline_stack) = 
+		stack + (kSMP_STACK_PAGES * 0x1000);
+	*(uint32_t *)smp_trampoline_field(page, smp_trampoline_cpu) = 
+		(uintptr_t)cpu;
+
+	fprintf(dbgout, "Starting CPU %d (APIC ID %d)\n", cpu->index, apic_id);
+	if (!lapic_start_cpu(apic_id, page, &cpu->online)) {
+		// The CPU may just be slow, and still be about to run on this stack.
+		// It is parked, but the stack is never reused in case that failed.
+		fprintf(dbgout, "WARNING: CPU with APIC ID %d did not start\n", apic_id);
+		lapic_park_cpu(apic_id);
+		return;
+	}
+
+	++cpu_total;
+}
+
+void smp_prepare(struct boot_config *config)
+{
+	struct mp_configuration mp;
+	if (!mp_prepare(&mp)) {
+		fprintf(dbgout, "Continuing with a single CPU\n");
+		return;
+	}
+
+	lapic_prepare(mp.lapic_address);
+	cpus[0].apic_id = lapic_id();
+
+	// Legacy IRQs stay routed through the PIC to the bootstrap processor, and
+	// the I/O APICs are left as the firmware configured them.
+	for (uint32_t n = 0; n < mp.ioapic_count; ++n) {
+		fprintf(dbgout, "I/O APIC %d at %p is not used\n", 
+			mp.ioapics[n].id, mp.ioapics[n].address);
+	}
+
+	if (mp.cpu_count < 2)
+		return;
+
+	// Install the entry points for the interrupts that the Local APICs send.
+	// The other CPUs share the IDT of the bootstrap processor, which always 
+	// has 256 gates.
+	interrupt_gate_install(kLAPIC_TIMER_VECTOR, lapic_timer_entry);
+	interrupt_gate_install(kTLB_SHOOTDOWN_VECTOR, tlb_shootdown_entry);
+	interrupt_gate_install(kRESCHEDULE_VECTOR, reschedule_entry);
+	interrupt_gate_install(kLAPIC_SPURIOUS_VECTOR, lapic_spurious_entry);
+	idt_pointer.limit = kIDT_LIMIT;
+	idt_pointer.base = (uintptr_t)config->idt_base;
+
+	// The other CPUs use the Local APIC timer as their clock event device, so
+	// there is no point starting them without it.
+	if (!lapic_timer_calibrate()) {
+		fprintf(dbgout, "Continuing with a single CPU\n");
+		return;
+	}
+
+	uintptr_t page = smp_trampoline_prepare();
+	if (!page)
+		return;
+
+	// From here on critical sections have to exclude the other CPUs, and not
+	// just interrupts.
+	atomic_enable_kernel_lock();
+
+	for (uint32_t n = 0; n < mp.cpu_count; ++n) {
+		if (mp.cpu_apic_ids[n] != cpus[0].apic_id)
+			smp_start_cpu(page, mp.cpu_apic_ids[n]);
+	}
+
+	fprintf(dbgout, "%d CPUs are online\n", cpu_total);
+	kframe_free(page);
+}
@@ -0,0 +1,110 @@
+; Copyright (c) 2017-2018 Tom Hancocks
+; 
+; Permission is hereby granted, free of charge, to any person obtaining a copy
+; of this software and associated documentation files (the "Software"), to deal
+; in the Software without restriction, including without limitation the rights
+; to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+; copies of the Software, and to permit persons to whom the Software is
+; furnished to do so, subject to the following conditions:
+; 
+; The above copyright notice and this permission notice shall be included in all
+; copies or substantial portions of the Software.
+; 
+; THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+; IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+; FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+; AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+; LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+; OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+; SOFTWARE.
+
+	[bits 	32]
+
+	global	smp_trampoline
+	global	smp_trampoline_protected
+	global	smp_trampoline_gdt
+	global	smp_trampoline_gdtr
+	global	smp_trampoline_jump
+	global	smp_trampoline_cr3
+	global	smp_trampoline_cr4
+	global	smp_trampoline_stack
+	global	smp_trampoline_cpu
+	global	smp_trampoline_entry
+	global	smp_trampoline_end
+
+;;
+;; Startup code for the application processors. This is never executed where it
+;; is linked. It is copied to a page below 1MiB, and each processor is started
+;; at the beginning of that page in real mode. The code is position independent
+;; and the fields following it are filled in by smp_prepare on the copy. The
+;; trampoline enters protected mode with a flat GDT, enables paging with the 
+;; kernel page directory and then jumps to the entry function on the stack that
+;; it has been given.
+;;
+;;	__attribute__((noreturn))
+;;	void entry(struct cpu *cpu);
+;;
+	[bits	16]
+smp_trampoline:
+	.real_mode:
+		cli
+		cld
+		mov ax, cs
+		mov ds, ax
+		movzx ebx, ax
+		shl ebx, 4							; Physical address of the page
+	.protected_mode:
+		lgdt [smp_trampoline_gdtr - smp_trampoline]
+		mov eax, cr0
+		and eax, 0x9FFFFFFF					; Enable caches (CD and NW)
+		or eax, 1							; Enable protected mode
+		mov cr0, eax
+		jmp dword far [smp_trampoline_jump - smp_trampoline]
+
+	[bits	32]
+smp_trampoline_protected:
+	.segments:
+		mov ax, 0x10
+		mov ds, ax
+		mov es, ax
+		mov fs, ax
+		mov gs, ax
+		mov ss, ax
+	.paging:
+		mov eax, [ebx + smp_trampoline_cr4 - smp_trampoline]
+		mov cr4, eax
+		mov eax, [ebx + smp_trampoline_cr3 - smp_trampoline]
+		mov cr3, eax
+		mov eax, cr0
+		or eax, 0x80010000					; Enable paging and write protect
+		mov cr0, eax
+	.enter:
+		mov esp, [ebx + smp_trampoline_stack - smp_trampoline]
+		xor ebp, ebp
+		push dword [ebx + smp_trampoline_cpu - smp_trampoline]
+		push dword 0						; No return address
+		jmp [ebx + smp_trampoline_entry - smp_trampoline]
+
+	align 8
+smp_trampoline_gdt:
+		dq 0x0000000000000000				; NULL Segment
+		dq 0x00CF9A000000FFFF				; Kernel Code Segment
+		dq 0x00CF92000000FFFF				; Kernel Data Segment
+smp_trampoline_gdtr:
+		dw 0x17								; Limit
+		dd 0								; Base (physical)
+smp_trampoline_jump:
+		dd 0								; Offset of smp_trampoline_protected
+		dw 0x08								; Kernel Code Segment
+	align 4
+smp_trampoline_cr3:
+		dd 0
+smp_trampoline_cr4:
+		dd 0
+smp_trampoline_stack:
+		dd 0
+smp_trampoline_cpu:
+		dd 0
+smp_trampoline_entry:
+		dd 0
+smp_trampoline_end:
@@ -0,0 +1,152 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#include <arch/i386/tlb.h>
+#include <arch/i386/features.h>
+#include <arch/i386/util.h>
+#include <arch/i386/smp.h>
+#include <arch/i386/apic.h>
+#include <stdio.h>
+
+#define CR4_PGE				(1 << 7)
+#define TLB_RANGE_LIMIT		32	// Pages invalidated individually before flushing
+
+static int global_pages = 0;
+static volatile uint32_t shootdown_generation = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+
+void tlb_prepare(void)
+{
+	if (!cpu_pge_available()) {
+		fprintf(dbgout, "Global pages are not supported by this CPU\n");
+		return;
+	}
+
+	set_cr4(get_cr4() | CR4_PGE);
+	global_pages = 1;
+	fprintf(dbgout, "Global pages have been enabled\n");
+}
+
+int tlb_global_pages_enabled(void)
+{
+	return global_pages;
+}
+
+void tlb_invalidate_page(uintptr_t address)
+{
+	__asm__ __volatile__("invlpg (%0)" :: "r"(address) : "memory");
+}
+
+void tlb_invalidate_range(uintptr_t start, uintptr_t end)
+{
+	start &= ~0xFFF;
+	if (end <= start)
+		return;
+
+	// Past a certain point it is cheaper to flush everything and let the TLB
+	// refill, than to invalidate each page in turn.
+	if (((end - start + 0xFFF) >> 12) > TLB_RANGE_LIMIT) {
+		tlb_flush_global();
+		return;
+	}
+
+	for (uintptr_t address = start; address < end; address += 0x1000)
+		tlb_invalidate_page(address);
+}
+
+void tlb_flush(void)
+{
+	__asm__ __volatile__(
+		"movl %%cr3, %%eax\n"
+		"movl %%eax, %%cr3"
+		::: "%eax", "memory"
+	);
+}
+
+void tlb_flush_global(void)
+{
+	// Toggling PGE flushes the entire TLB, global entries included. Without
+	// global pages a CR3 reload has the same effect.
+	if (!global_pages) {
+		tlb_flush();
+		return;
+	}
+
+	uint32_t cr4 = get_cr4();
+	set_cr4(cr4 & ~CR4_PGE);
+	set_cr4(cr4);
+}
+
+static inline uint32_t tlb_next_generation(void)
+{
+	uint32_t generation = 1;
+	__asm__ __volatile__(
+		"lock;"
+		"xaddl %0, %1"
+		: "+r"(generation), "+m"(shootdown_generation)
+		:
+		: "memory"
+	);
+	return generation + 1;
+}
+
+void tlb_shootdown(void)
+{
+	if (cpu_count() <= 1)
+		return;
+
+	// The other CPUs flush their entire TLB when they receive the interrupt,
+	// and then record the generation that they flushed for. The caller is 
+	// likely to free the frames that were mapped as soon as this returns, so
+	// it has to wait until nobody can still reach them.
+	uint32_t generation = tlb_next_generation();
+	lapic_broadcast_ipi(kTLB_SHOOTDOWN_VECTOR);
+
+	struct cpu *self = cpu_current();
+	for (uint32_t n = 0; n < cpu_count(); ++n) {
+		struct cpu *cpu = cpu_get(n);
+		if (cpu == self || !cpu->online)
+			continue;
+
+		// Another CPU may be waiting on a shootdown of its own, with
+		// interrupts disabled, so keep servicing them while waiting.
+		while ((int32_t)(cpu->tlb_generation - generation) < 0) {
+			tlb_shootdown_poll();
+			__asm__ __volatile__("pause" ::: "memory");
+		}
+	}
+}
+
+void tlb_shootdown_poll(void)
+{
+	// The generation is read before flushing, and only published afterwards,
+	// so a sender never sees a flush that has not happened yet.
+	struct cpu *cpu = cpu_current();
+	uint32_t generation = shootdown_generation;
+	if (cpu->tlb_generation == generation)
+		return;
+
+	tlb_flush_global();
+	__asm__ __volatile__("" ::: "memory");
+	cpu->tlb_generation = generation;
+}
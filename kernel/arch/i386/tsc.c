@@ -0,0 +1,139 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#include <arch/i386/tsc.h>
+#include <arch/i386/pit.h>
+#include <arch/i386/port.h>
+#include <arch/i386/util.h>
+#include <arch/i386/features.h>
+#include <clocksource.h>
+#include <sema.h>
+#include <stdio.h>
+
+#define PIT_CHANNEL2_DATA		0x42
+#define PIT_COMMAND				0x43
+#define PIT_CHANNEL2_ONESHOT	0xB0
+#define PORT_B					0x61
+#define PORT_B_GATE2			(1 << 0)
+#define PORT_B_SPEAKER			(1 << 1)
+#define PORT_B_OUT2				(1 << 5)
+
+#define kTSC_CALIBRATION_MS		10
+#define kTSC_CALIBRATION_RUNS	3
+
+// Reading port B takes around a microsecond, so this allows the count to take
+// about a hundred times longer than it should before giving up on it.
+#ifndef kTSC_CALIBRATION_POLLS
+#	define kTSC_CALIBRATION_POLLS	1000000
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t tsc_rate = 0;
+
+static struct clock_source tsc_clock_source = {
+	.name = "tsc",
+	.frequency = 0,
+	.rating = 300,
+	.read = read_tsc,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t tsc_calibrate_once(void)
+{
+	// Channel 2 is gated by port B rather than wired to an IRQ, so it can be
+	// polled without disturbing channel 0. The speaker is kept off, and the
+	// output goes high once the count has run out.
+	uint32_t count = (kPIT_FREQUENCY * kTSC_CALIBRATION_MS) / 1000;
+	uint8_t port_b = inb(PORT_B);
+	outb(PORT_B, (port_b & ~PORT_B_SPEAKER) | PORT_B_GATE2);
+
+	outb(PIT_COMMAND, PIT_CHANNEL2_ONESHOT);
+	outb(PIT_CHANNEL2_DATA, count & 0xFF);
+	outb(PIT_CHANNEL2_DATA, (count >> 8) & 0xFF);
+
+	// Some virtual machines and chipsets do not emulate channel 2, in which 
+	// case the output never goes high.
+	uint64_t start = read_tsc();
+	uint32_t polls = 0;
+	while (!(inb(PORT_B) & PORT_B_OUT2) && ++polls < kTSC_CALIBRATION_POLLS)
+		;
+	uint64_t end = read_tsc();
+
+	outb(PORT_B, port_b);
+	if (polls >= kTSC_CALIBRATION_POLLS)
+		return 0;
+	return ((end - start) * 1000) / kTSC_CALIBRATION_MS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void tsc_prepare(void)
+{
+	if (!cpu_tsc_available()) {
+		fprintf(dbgout, "No Time Stamp Counter is available\n");
+		return;
+	}
+
+	// A run can be thrown off by something outside of the kernel, such as a
+	// virtual machine being descheduled or an SMI, so the median of several
+	// runs is used. Interrupts are disabled so that nothing on this CPU gets 
+	// in the way.
+	uint64_t runs[kTSC_CALIBRATION_RUNS];
+	irq_flags_t flags = irq_save();
+	for (int run = 0; run < kTSC_CALIBRATION_RUNS; ++run) {
+		uint64_t measured = tsc_calibrate_once();
+		if (measured == 0) {
+			irq_restore(flags);
+			fprintf(dbgout, "PIT channel 2 did not run out, so the Time Stamp "
+				"Counter can not be measured\n");
+			return;
+		}
+
+		int slot = run;
+		for (; slot > 0 && runs[slot - 1] > measured; --slot)
+			runs[slot] = runs[slot - 1];
+		runs[slot] = measured;
+	}
+	irq_restore(flags);
+
+	uint64_t rate = runs[kTSC_CALIBRATION_RUNS / 2];
+	tsc_rate = rate;
+	fprintf(dbgout, "Time Stamp Counter runs at %d kHz\n",
+		(uint32_t)(tsc_rate / 1000));
+
+	// A counter that changes rate with the power state of the CPU is useless
+	// for keeping time, so the PIT remains the clock source.
+	if (!cpu_invariant_tsc_available()) {
+		fprintf(dbgout, "Time Stamp Counter is not invariant\n");
+		return;
+	}
+
+	tsc_clock_source.frequency = tsc_rate;
+	clock_source_register(&tsc_clock_source);
+}
+
+uint64_t tsc_frequency(void)
+{
+	return tsc_rate;
+}
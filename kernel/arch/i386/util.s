@@ -21,6 +21,16 @@
 	[bits 	32]
 
 	global 	get_eflags
+	global	get_cr4
+	global	set_cr4
+	global	get_cr0
+	global	set_cr0
+	global	get_cr2
+	global	get_cr3
+	global	set_cr3
+	global	read_msr
+	global	write_msr
+	global	read_tsc
 
 ;;
 ;; Returns the current value of the EFLAGS register.
@@ -32,3 +42,110 @@ get_eflags:
 			pushfd
 			pop eax
 			ret
+
+;;
+;; Returns the current value of the CR4 register.
+;;
+;;	uint32_t get_cr4(void)
+;;
+get_cr4:
+		.main:
+			mov eax, cr4
+			ret
+
+;;
+;; Sets the value of the CR4 register.
+;;
+;;	void set_cr4(uint32_t value)
+;;
+set_cr4:
+		.main:
+			mov eax, [esp + 4]
+			mov cr4, eax
+			ret
+
+;;
+;; Returns the current value of the CR0 register.
+;;
+;;	uint32_t get_cr0(void)
+;;
+get_cr0:
+		.main:
+			mov eax, cr0
+			ret
+
+;;
+;; Sets the value of the CR0 register.
+;;
+;;	void set_cr0(uint32_t value)
+;;
+set_cr0:
+		.main:
+			mov eax, [esp + 4]
+			mov cr0, eax
+			ret
+
+;;
+;; Returns the current value of the CR2 register, the last faulting address.
+;;
+;;	uint32_t get_cr2(void)
+;;
+get_cr2:
+		.main:
+			mov eax, cr2
+			ret
+
+;;
+;; Returns the current value of the CR3 register.
+;;
+;;	uint32_t get_cr3(void)
+;;
+get_cr3:
+		.main:
+			mov eax, cr3
+			ret
+
+;;
+;; Sets the value of the CR3 register, switching to another page directory.
+;;
+;;	void set_cr3(uint32_t value)
+;;
+set_cr3:
+		.main:
+			mov eax, [esp + 4]
+			mov cr3, eax
+			ret
+
+;;
+;; Reads the specified model specific register.
+;;
+;;	uint64_t read_msr(uint32_t msr)
+;;
+read_msr:
+		.main:
+			mov ecx, [esp + 4]
+			rdmsr
+			ret
+
+;;
+;; Writes a value to the specified model specific register.
+;;
+;;	void write_msr(uint32_t msr, uint64_t value)
+;;
+write_msr:
+		.main:
+			mov ecx, [esp + 4]
+			mov eax, [esp + 8]
+			mov edx, [esp + 12]
+			wrmsr
+			ret
+
+;;
+;; Reads the Time Stamp Counter.
+;;
+;;	uint64_t read_tsc(void)
+;;
+read_tsc:
+		.main:
+			rdtsc
+			ret
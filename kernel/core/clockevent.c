@@ -0,0 +1,165 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#include <clockevent.h>
+#include <timer.h>
+#include <task.h>
+#include <sema.h>
+#include <uptime.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <arch/arch.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct clock_event_cpu
+{
+	struct clock_event *device;
+	uint64_t armed;			// Uptime at which the device is due to fire
+	uint64_t slice_end;		// Uptime at which the current timeslice ends
+	uint32_t events;
+};
+
+static struct clock_event_cpu clock_event_cpus[kMAX_CPUS];
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline struct clock_event_cpu *clock_event_this_cpu(void)
+{
+	return &clock_event_cpus[cpu_current()->index];
+}
+
+static void clock_event_arm(struct clock_event_cpu *state, uint64_t deadline)
+{
+	// The delay is clamped to what the device supports. A deadline beyond the
+	// longest delay causes an early interrupt, which simply programs the rest.
+	uint64_t now = get_uptime_u();
+	uint64_t delta = (deadline > now) ? deadline - now : 0;
+	if (delta < state->device->min_delta)
+		delta = state->device->min_delta;
+	else if (delta > state->device->max_delta)
+		delta = state->device->max_delta;
+
+	state->armed = now + delta;
+	state->device->program(delta);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void clock_event_register(struct clock_event *device)
+{
+	irq_flags_t flags = irq_save();
+	struct clock_event_cpu *state = clock_event_this_cpu();
+
+	fprintf(dbgout, "CPU %d uses the %s for clock events (%d-%dus)\n",
+		cpu_current()->index, device->name, 
+		(uint32_t)device->min_delta, (uint32_t)device->max_delta);
+
+	state->device = device;
+	state->slice_end = get_uptime_u() + task_timeslice();
+	clock_event_arm(state, UINT64_MAX);
+	irq_restore(flags);
+}
+
+void clock_event_reprogram(void)
+{
+	irq_flags_t flags = irq_save();
+	struct clock_event_cpu *state = clock_event_this_cpu();
+	if (!state->device) {
+		irq_restore(flags);
+		return;
+	}
+
+	// The end of the timeslice only matters if there is somebody else to give
+	// the CPU to. Otherwise only timers wake the CPU, and it is able to halt
+	// for as long as the device allows.
+	uint64_t deadline = timer_next_deadline();
+	if (task_timeslice_needed() && state->slice_end < deadline)
+		deadline = state->slice_end;
+
+	if (deadline < state->armed)
+		clock_event_arm(state, deadline);
+
+	irq_restore(flags);
+}
+
+void clock_event_expire_slice(void)
+{
+	irq_flags_t flags = irq_save();
+	struct clock_event_cpu *state = clock_event_this_cpu();
+	state->slice_end = 0;
+	if (state->device)
+		clock_event_arm(state, 0);
+	irq_restore(flags);
+}
+
+void clock_event_start_slice(void)
+{
+	irq_flags_t flags = irq_save();
+	struct clock_event_cpu *state = clock_event_this_cpu();
+	state->slice_end = get_uptime_u() + task_timeslice();
+	irq_restore(flags);
+	clock_event_reprogram();
+}
+
+void clock_event_interrupt(struct interrupt_frame *frame, int ack_pic)
+{
+	// Interrupts are disabled for the duration of the handler. The device has
+	// fired, so nothing is armed until it is programmed again.
+	struct clock_event_cpu *state = clock_event_this_cpu();
+	state->events++;
+	state->armed = UINT64_MAX;
+
+	uint64_t now = get_uptime_u();
+	timer_expire(now);
+
+	// Switching tasks starts a new timeslice and programs the device for it,
+	// in which case yield does not return. Otherwise the current task carries
+	// on with a fresh timeslice.
+	if (now >= state->slice_end || task_preempt_needed()) {
+		yield(frame, ack_pic);
+		state->slice_end = now + task_timeslice();
+	}
+
+	clock_event_reprogram();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint32_t clock_event_count(uint32_t cpu)
+{
+	return (cpu < kMAX_CPUS) ? clock_event_cpus[cpu].events : 0;
+}
+
+void clock_event_dump_stats(void)
+{
+	suseconds_t uptime = get_uptime_ms();
+	fprintf(dbgout, "=== Clock Event Statistics ===\n");
+	for (uint32_t n = 0; n < cpu_count(); ++n) {
+		struct clock_event_cpu *state = &clock_event_cpus[n];
+		if (!state->device)
+			continue;
+		uint32_t rate = uptime ? (state->events * 1000ULL) / uptime : 0;
+		fprintf(dbgout, "  CPU %d (%s): %d interrupts, %d per second\n",
+			n, state->device->name, state->events, rate);
+	}
+}
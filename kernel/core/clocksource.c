@@ -0,0 +1,91 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#include <clocksource.h>
+#include <sema.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#define kNS_PER_SECOND		1000000000ULL
+
+////////////////////////////////////////////////////////////////////////////////
+
+static struct clock_source *clock_source = NULL;
+static uint64_t clock_source_base_cycles = 0;
+static uint64_t clock_source_base_ns = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+
+void clock_source_register(struct clock_source *source)
+{
+	irq_flags_t flags = irq_save();
+	if (clock_source && clock_source->rating >= source->rating) {
+		irq_restore(flags);
+		return;
+	}
+
+	// The new clock source counts from the uptime of the old one, so that the
+	// uptime never jumps.
+	uint64_t now = clock_source_uptime();
+	clock_source_base_cycles = source->read();
+	clock_source_base_ns = now;
+	clock_source = source;
+	irq_restore(flags);
+
+	fprintf(dbgout, "Keeping the uptime with the %s clock source (%d kHz)\n",
+		source->name, (uint32_t)(source->frequency / 1000));
+}
+
+const char *clock_source_name(void)
+{
+	return clock_source ? clock_source->name : "none";
+}
+
+uint64_t clock_source_uptime(void)
+{
+	if (!clock_source)
+		return 0;
+
+	uint64_t cycles = get_cycles() - clock_source_base_cycles;
+	return clock_source_base_ns + cycles_to_ns(cycles);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint64_t get_cycles(void)
+{
+	return clock_source ? clock_source->read() : 0;
+}
+
+uint64_t cycles_to_ns(uint64_t cycles)
+{
+	// Whole seconds are converted separately from the remainder, so that the
+	// multiplication can not overflow.
+	if (!clock_source)
+		return 0;
+
+	uint64_t frequency = clock_source->frequency;
+	uint64_t seconds = cycles / frequency;
+	uint64_t remainder = cycles % frequency;
+	return (seconds * kNS_PER_SECOND) 
+		+ ((remainder * kNS_PER_SECOND) / frequency);
+}
@@ -0,0 +1,249 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#include <timer.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <spinlock.h>
+#include <clockevent.h>
+#include <arch/arch.h>
+
+#ifndef kTIMER_MAX
+#	define kTIMER_MAX	256
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+static struct timer *timer_heap[kTIMER_MAX];
+static uint32_t timer_count = 0;
+static struct timer *timer_aside = NULL;
+static struct spinlock timer_lock = { 0 };
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void timer_heap_place(struct timer *timer, uint32_t slot)
+{
+	timer_heap[slot] = timer;
+	timer->slot = slot;
+}
+
+static void timer_heap_sift_up(uint32_t slot)
+{
+	struct timer *timer = timer_heap[slot];
+	while (slot > 0) {
+		uint32_t parent = (slot - 1) / 2;
+		if (timer_heap[parent]->deadline <= timer->deadline)
+			break;
+		timer_heap_place(timer_heap[parent], slot);
+		slot = parent;
+	}
+	timer_heap_place(timer, slot);
+}
+
+static void timer_heap_sift_down(uint32_t slot)
+{
+	struct timer *timer = timer_heap[slot];
+	while (1) {
+		uint32_t child = (slot * 2) + 1;
+		if (child >= timer_count)
+			break;
+		else if (child + 1 < timer_count 
+			&& timer_heap[child + 1]->deadline < timer_heap[child]->deadline
+		) {
+			child++;
+		}
+
+		if (timer->deadline <= timer_heap[child]->deadline)
+			break;
+		timer_heap_place(timer_heap[child], slot);
+		slot = child;
+	}
+	timer_heap_place(timer, slot);
+}
+
+static void timer_heap_remove(struct timer *timer)
+{
+	// Fill the hole with the last timer, and then restore the heap order
+	// around it in whichever direction is required.
+	uint32_t slot = timer->slot;
+	timer->slot = kTIMER_INACTIVE;
+
+	struct timer *last = timer_heap[--timer_count];
+	if (last == timer)
+		return;
+
+	timer_heap_place(last, slot);
+	timer_heap_sift_up(slot);
+	timer_heap_sift_down(last->slot);
+}
+
+static void timer_heap_insert(struct timer *timer)
+{
+	timer_heap_place(timer, timer_count++);
+	timer_heap_sift_up(timer->slot);
+}
+
+static void timer_aside_remove(struct timer *timer)
+{
+	struct timer **link = &timer_aside;
+	while (*link && *link != timer)
+		link = &(*link)->next;
+	if (*link)
+		*link = timer->next;
+
+	timer->next = NULL;
+	timer->slot = kTIMER_INACTIVE;
+}
+
+static void timer_remove(struct timer *timer)
+{
+	if (timer->slot == kTIMER_SET_ASIDE)
+		timer_aside_remove(timer);
+	else if (timer->slot != kTIMER_INACTIVE && timer->slot != kTIMER_FIRING)
+		timer_heap_remove(timer);
+}
+
+static struct timer *timer_take_expired(uint64_t now)
+{
+	if (timer_count && timer_heap[0]->deadline <= now) {
+		struct timer *timer = timer_heap[0];
+		timer_heap_remove(timer);
+		return timer;
+	}
+
+	// Timers that were set aside either fire now, or move in to the heap if
+	// there is room for them.
+	struct timer **link = &timer_aside;
+	while (*link) {
+		struct timer *timer = *link;
+		if (timer->deadline <= now) {
+			timer_aside_remove(timer);
+			return timer;
+		}
+		else if (timer_count < kTIMER_MAX) {
+			*link = timer->next;
+			timer->next = NULL;
+			timer_heap_insert(timer);
+		}
+		else {
+			link = &timer->next;
+		}
+	}
+
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void timer_init(struct timer *timer, void(*fire)(void *), void *context)
+{
+	timer->deadline = 0;
+	timer->fire = fire;
+	timer->context = context;
+	timer->slot = kTIMER_INACTIVE;
+	timer->next = NULL;
+}
+
+void timer_start(struct timer *timer, uint64_t deadline)
+{
+	irq_flags_t flags = spin_lock_irqsave(&timer_lock);
+
+	timer_remove(timer);
+	timer->deadline = deadline;
+
+	// A full heap must not cause the timer to be lost, or whatever is waiting
+	// on it would never be woken. It is set aside until there is room.
+	int reprogram;
+	if (timer_count >= kTIMER_MAX) {
+		fprintf(dbgout, "WARNING: Too many timers are active. Setting a timer "
+			"aside until there is room for it.\n");
+		timer->slot = kTIMER_SET_ASIDE;
+		timer->next = timer_aside;
+		timer_aside = timer;
+		reprogram = 1;
+	}
+	else {
+		timer_heap_insert(timer);
+		reprogram = (timer->slot == 0);
+	}
+
+	spin_unlock(&timer_lock);
+
+	// The clock event device of this CPU may have to fire earlier than it was
+	// going to. Reprogramming it looks at the timers again, so it is done 
+	// without the lock.
+	if (reprogram)
+		clock_event_reprogram();
+
+	irq_restore(flags);
+}
+
+void timer_cancel(struct timer *timer)
+{
+	irq_flags_t flags = spin_lock_irqsave(&timer_lock);
+	while (timer->slot == kTIMER_FIRING) {
+		spin_unlock(&timer_lock);
+		__asm__ __volatile__("pause" ::: "memory");
+		spin_lock(&timer_lock);
+	}
+	timer_remove(timer);
+	spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+int timer_active(struct timer *timer)
+{
+	return timer->slot != kTIMER_INACTIVE && timer->slot != kTIMER_FIRING;
+}
+
+uint64_t timer_next_deadline(void)
+{
+	irq_flags_t flags = spin_lock_irqsave(&timer_lock);
+	uint64_t deadline = timer_count ? timer_heap[0]->deadline : UINT64_MAX;
+	for (struct timer *timer = timer_aside; timer; timer = timer->next) {
+		if (timer->deadline < deadline)
+			deadline = timer->deadline;
+	}
+	spin_unlock_irqrestore(&timer_lock, flags);
+	return deadline;
+}
+
+void timer_expire(uint64_t now)
+{
+	// Timers are removed before they fire, so that they are free to start
+	// themselves again. Other CPUs may be starting timers at the same time.
+	// The lock is dropped while each function is called, as waking a task
+	// takes the lock of its CPU, which may in turn start a timer. The timer
+	// is marked as firing meanwhile, so that it is not freed under us.
+	irq_flags_t flags = spin_lock_irqsave(&timer_lock);
+	struct timer *timer;
+	while ((timer = timer_take_expired(now))) {
+		timer->slot = kTIMER_FIRING;
+		spin_unlock(&timer_lock);
+
+		timer->fire(timer->context);
+
+		spin_lock(&timer_lock);
+		if (timer->slot == kTIMER_FIRING)
+			timer->slot = kTIMER_INACTIVE;
+	}
+	spin_unlock_irqrestore(&timer_lock, flags);
+}
@@ -21,24 +21,25 @@
 */
 
 #include <uptime.h>
-#include <arch/arch.h>
+#include <clocksource.h>
 #include <stddef.h>
 
+uint64_t get_uptime_ns(void)
+{
+	return clock_source_uptime();
+}
+
 useconds_t get_uptime_u(void)
 {
-	return get_uptime_ms() * 1000;
+	return get_uptime_ns() / 1000;
 }
 
 suseconds_t get_uptime_ms(void)
 {
-	uint64_t subticks, ticks;
-	arch_get_ticks(&ticks, &subticks, NULL);
-	return (ticks * 1000) + subticks;
+	return get_uptime_ns() / 1000000;
 }
 
 time_t get_uptime_s(void)
 {
-	uint64_t ticks;
-	arch_get_ticks(&ticks, NULL, NULL);
-	return ticks;
-}
\ No newline at end of file
+	return get_uptime_ns() / 1000000000;
+}
@@ -26,7 +26,6 @@
 #include <string.h>
 #include <stddef.h>
 #include <ascii.h>
-#include <atomic.h>
 #include <memory.h>
 #include <panic.h>
 #include <kheap.h>
@@ -221,9 +220,9 @@ static void vt100_setattr_with_esccode(struct VT100_info *vt100)
 
 static void vt100_putc(struct VT100_info *vt100, const char c)
 {
-	atom_t putc;
-	atomic_start(putc);
-
+	// Writes to the terminal are serialised by the mutex of the device. Only
+	// the terminal process writes to the console, so parsing and rendering
+	// happen with interrupts enabled.
 	if (c <= kASCII_US || c == kASCII_DEL) {
 		// Handle this as a control code.
 		vt100_ascii_control_code(vt100, c);
@@ -237,8 +236,6 @@ static void vt100_putc(struct VT100_info *vt100, const char c)
 
 	vt100_wrap(vt100);
 	vt100_update_cursor(vt100);
-
-	atomic_end(putc);
 }
 
 static void vt100_restore(struct VT100_info *info)
@@ -359,7 +356,7 @@ void VT100_prepare(struct boot_config *config)
 	__vt100.dev_id = __VT100_ID;
 	__vt100.name = "VT100";
 	__vt100.kind = device_VT100;
-	__vt100.opts = DP_WRITE | DP_ATOMIC_WRITE | DP_ALLOWS_ANSI;
+	__vt100.opts = DP_WRITE | DP_BLOCKING_WRITE | DP_ALLOWS_ANSI;
 	__vt100.write_byte = vt100_write;
 	__vt100.can_write = vt100_ready;
 	__vt100.start_batch = vt100_start_batch;
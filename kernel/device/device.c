@@ -23,7 +23,7 @@
 #include <device/device.h>
 #include <stdlib.h>
 #include <stddef.h>
-#include <atomic.h>
+#include <sema.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -71,11 +71,13 @@ int dv_write(struct device *dev, const char *restrict str)
 		return DEV_NOWRITE;
 	}
 
-	// Does the device require atomic writes? If so, then ensure we're in an
-	// atomic context.
-	atom_t atomic_write;
+	// Does the device require its writes to be serialised? Only the device is
+	// locked, rather than the entire kernel.
+	irq_flags_t flags = 0;
 	if (dev->opts & DP_ATOMIC_WRITE)
-		atomic_start(atomic_write);
+		flags = spin_lock_irqsave(&dev->write_lock);
+	else if (dev->opts & DP_BLOCKING_WRITE)
+		mutex_lock(&dev->write_mutex);
 
 	// Begin batching certain operations on the device.
 	if (dev->batch_commit)
@@ -100,8 +102,10 @@ int dv_write(struct device *dev, const char *restrict str)
 	if (dev->batch_commit)
 		dev->batch_commit(dev);
 
-	if (dev->opts & DP_ATOMIC_WRITE || atomic_write)
-		atomic_end(atomic_write);
+	if (dev->opts & DP_ATOMIC_WRITE)
+		spin_unlock_irqrestore(&dev->write_lock, flags);
+	else if (dev->opts & DP_BLOCKING_WRITE)
+		mutex_unlock(&dev->write_mutex);
 
 	return DEV_OK;
 }
@@ -32,6 +32,10 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static struct wait_queue key_waiters = { { 0 }, NULL, NULL };
+
+////////////////////////////////////////////////////////////////////////////////
+
 static struct pipe *keyboard_get_frontmost_pipe()
 {
 	// Ask the process API for the Keyboard Receiver pipe for the frontmost
@@ -70,10 +74,7 @@ static uint8_t kbdin_read_scancode(void)
 	if (!pipe)
 		return '\0';
 	
-	while (!pipe_has_unread(pipe, NULL)) {
-		__asm__ __volatile__("hlt");
-	}
-
+	wait_event(&pipe->readers, pipe_has_unread(pipe, NULL));
 	return pipe_read_byte(pipe, NULL);
 }
 
@@ -88,7 +89,12 @@ void keyboard_driver_prepare(void)
 void keyboard_received_scancode(uint8_t scancode)
 {	
 	kbdin_write_scancode(scancode);
-	task_resume_any_for(reason_key_wait, 0);
+	wake_all(&key_waiters);
+}
+
+struct wait_queue *keyboard_wait_queue(void)
+{
+	return &key_waiters;
 }
 
 struct keyevent *keyboard_consume_key_event(void)
@@ -22,11 +22,13 @@
 
 #include <drawing/base.h>
 #include <memory.h>
-#include <atomic.h>
+#include <sema.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <string.h>
 #include <uptime.h>
+#include <virtual.h>
+#include <kheap.h>
 
 #define BLIT_WIDTH	16
 #define BLIT_HEIGHT	16
@@ -69,6 +71,44 @@ void drawing_prepare(struct boot_config *config)
 	vesa_buffer = config->front_buffer;
 	buffer = config->back_buffer;
 
+	// The bootloader maps both buffers with 4KiB pages. The front buffer is
+	// identity mapped, so can be remapped in place with 4MiB pages. Only the
+	// regions that lie entirely within it are remapped, as anything beyond 
+	// the end of the front buffer must stay unmapped. The back buffer is moved
+	// to memory backed by 4MiB pages. Blitting touches every page of both 
+	// buffers, so this removes most of the TLB misses.
+	if (kpage_large_available()) {
+		uintptr_t front = ((uintptr_t)vesa_buffer + kLARGE_PAGE_SIZE - 1) 
+						& ~(kLARGE_PAGE_SIZE - 1);
+		uintptr_t front_end = ((uintptr_t)vesa_buffer + screen_size) 
+							& ~(kLARGE_PAGE_SIZE - 1);
+		for (; front < front_end; front += kLARGE_PAGE_SIZE) {
+			if (kpage_map_large(front, front) != kPAGE_ALLOC_OK) {
+				fprintf(dbgout, "Front buffer at %p remains in 4KiB pages\n",
+					front);
+			}
+		}
+	}
+
+	// The front buffer is only ever written to by blitting, so it can be made
+	// write-combining. Writes are then batched into full bus transactions.
+	if (kpage_set_cache_mode(
+		(uintptr_t)vesa_buffer, screen_size, cache_write_combining
+	) == kPAGE_ALLOC_OK) {
+		fprintf(dbgout, "Front buffer is mapped as write-combining\n");
+	}
+
+	if (kpage_large_available()) {
+		uint32_t pages = (screen_size + kLARGE_PAGE_SIZE - 1) 
+					   / kLARGE_PAGE_SIZE * kLARGE_PAGE_PAGES;
+		uint32_t *large_buffer = kalloc_pages(pages);
+		memcpy(large_buffer, buffer, screen_size);
+
+		// The back buffer of the bootloader is not used again.
+		kfree_pages(buffer, (screen_size + 0xFFF) / 0x1000);
+		buffer = large_buffer;
+	}
+
 	blit_rect_width = screen_width / BLIT_WIDTH;
 	blit_rect_height = screen_height / BLIT_HEIGHT;
 	blit_count = BLIT_WIDTH * BLIT_HEIGHT;
@@ -86,8 +126,9 @@ static inline void _mark_blit(uint32_t x, uint32_t y)
 
 static inline void _blit_rect(uint32_t x, uint32_t y, uint32_t x2, uint32_t y2)
 {
-	atom_t atom;
-	atomic_start(atom);
+	// The MMX registers are not saved when switching tasks, so nothing may run
+	// on this CPU in the middle of the copy. Other CPUs are unaffected.
+	irq_flags_t flags = irq_save();
 
 	uint32_t *source = buffer + (y*(screen_pitch/screen_bpp)) + x;
 	uint32_t *dest = vesa_buffer + (y*(screen_pitch/screen_bpp)) + x;
@@ -99,7 +140,7 @@ static inline void _blit_rect(uint32_t x, uint32_t y, uint32_t x2, uint32_t y2)
 		source += (screen_pitch / screen_bpp);
 	}
 
-	atomic_end(atom);
+	irq_restore(flags);
 }
 
 static inline void _blit(void)
@@ -137,7 +137,7 @@ void vesa_console_prepare(uint16_t *buffer, uint32_t cols, uint32_t rows)
 	console_buffer = buffer;
 
 	uint32_t console_size = text_console_width * text_console_height;
-	console_mirror = kalloc(console_size * 2);
+	console_mirror = kalloc_aligned(console_size * 2, 64);
 	memsetw(console_mirror, 0, console_size);
 
 	clear_screen(color_map[0]);
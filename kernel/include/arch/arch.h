@@ -32,6 +32,12 @@
 #	include <arch/i386/gdt.h>
 #	include <arch/i386/interrupt.h>
 #	include <arch/i386/pit.h>
+#	include <arch/i386/tsc.h>
+#	include <arch/i386/tlb.h>
+#	include <arch/i386/cache.h>
+#	include <arch/i386/smp.h>
+#	include <arch/i386/mp.h>
+#	include <arch/i386/apic.h>
 #else
 #	error Architecture is not supported by Veracyon
 #endif
@@ -40,9 +46,4 @@ struct boot_config;
 
 void architecture_prepare(struct boot_config *config);
 
-/**
- Provides information about the architecture's internal tick count.
- */
-void arch_get_ticks(uint64_t *ticks, uint64_t *subticks, uint32_t *phase);
-
 #endif
\ No newline at end of file
@@ -0,0 +1,121 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#ifndef __VKERNEL_i386_APIC__
+#define __VKERNEL_i386_APIC__
+
+#include <stdint.h>
+
+#define kLAPIC_TIMER_VECTOR		0x40
+#define kTLB_SHOOTDOWN_VECTOR	0x41
+#define kRESCHEDULE_VECTOR		0x42
+#define kLAPIC_SPURIOUS_VECTOR	0xFF
+
+/**
+ Map the Local APIC registers, and enable the Local APIC of the calling CPU.
+
+ 	- address: The physical address of the Local APIC registers.
+ */
+void lapic_prepare(uintptr_t address);
+
+/**
+ Reports whether the Local APIC registers have been mapped.
+ */
+int lapic_available(void);
+
+/**
+ Enable the Local APIC of the calling CPU. The registers must already have been
+ mapped by lapic_prepare.
+ */
+void lapic_enable(void);
+
+/**
+ Returns the APIC ID of the calling CPU.
+ */
+uint8_t lapic_id(void);
+
+/**
+ Signal the end of an interrupt delivered by the Local APIC.
+ */
+void lapic_eoi(void);
+
+/**
+ Send an interrupt to every other CPU.
+
+ 	- vector: The interrupt vector to deliver.
+ */
+void lapic_broadcast_ipi(uint8_t vector);
+
+/**
+ Send an interrupt to a single CPU.
+
+ 	- apic_id: The APIC ID of the CPU to interrupt.
+ 	- vector: The interrupt vector to deliver.
+ */
+void lapic_unicast_ipi(uint8_t apic_id, uint8_t vector);
+
+/**
+ Start the CPU with the specified APIC ID with the INIT-SIPI-SIPI sequence. It 
+ begins executing in real mode at the start of the specified page.
+
+ 	- apic_id: The APIC ID of the CPU to start.
+ 	- trampoline: The physical address of the code to start at. It must be 
+ 	  page aligned and below 1MiB.
+ 	- online: A flag that the CPU sets once it has started.
+
+ RETURNS:
+ 	1 if the CPU reported that it has started, or 0 if it did not.
+ */
+int lapic_start_cpu(
+	uint8_t apic_id, 
+	uintptr_t trampoline, 
+	volatile uint8_t *online
+);
+
+/**
+ Return the CPU with the specified APIC ID to the state that it was in before 
+ it was started. This is used when a CPU fails to report that it has started,
+ so that it does not wake up later and run from memory that has been reused.
+
+ 	- apic_id: The APIC ID of the CPU to park.
+ */
+void lapic_park_cpu(uint8_t apic_id);
+
+/**
+ Measure the rate of the Local APIC timer against the uptime. This must be
+ called with interrupts enabled, and with the PIT running.
+
+ RETURNS:
+ 	1 if the rate of the timer is known, or 0 if the timer did not count.
+ */
+int lapic_timer_calibrate(void);
+
+/**
+ Set the Local APIC timer of the calling CPU up as its clock event device. The
+ timer fires once for each delay that it is programmed with. The timer must
+ have been successfully calibrated first.
+
+ 	- vector: The interrupt vector to deliver.
+ */
+void lapic_timer_start(uint8_t vector);
+
+#endif
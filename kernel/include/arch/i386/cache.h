@@ -0,0 +1,75 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#ifndef __VKERNEL_i386_CACHE__
+#define __VKERNEL_i386_CACHE__
+
+#include <stdint.h>
+
+#define kCACHE_OK		1
+#define kCACHE_ERROR	0
+
+// The memory types that a page can be given. The values are the indexes of the
+// types in the Page Attribute Table, as programmed by cache_prepare, and map
+// directly on to the PWT (bit 0) and PCD (bit 1) bits of a page entry.
+enum cache_mode
+{
+	cache_write_back = 0,
+	cache_write_combining = 1,
+	cache_uncached_minus = 2,
+	cache_uncached = 3,
+};
+
+/**
+ Prepare the memory type configuration of the CPU. If the CPU has a Page
+ Attribute Table, then it is programmed so that every value of enum cache_mode
+ can be selected through a page entry.
+ */
+void cache_prepare(void);
+
+/**
+ Test to see if page entries can select the write-combining memory type.
+ */
+int cache_pat_available(void);
+
+/**
+ Set a range of physical memory to be write-combining using variable range
+ MTRRs. This is the fallback for CPUs without a Page Attribute Table. The range
+ is rounded out to whole pages, and split across as many variable ranges as it
+ takes to cover it exactly, as each must be a naturally aligned power of two.
+
+	- base: The physical address of the range.
+	- length: The length of the range in bytes.
+
+ RETURNS:
+	kCACHE_OK if the range was configured.
+	kCACHE_ERROR if there is no MTRR support, or not enough free variable 
+	ranges.
+ */
+int cache_mtrr_write_combining(uintptr_t base, uint32_t length);
+
+/**
+ Write back and invalidate the contents of the CPU caches.
+ */
+void cache_flush(void);
+
+#endif
@@ -28,9 +28,45 @@
  */
 int cpu_sse_available(void);
 
+/**
+ Test to see if the CPU supports 4MiB pages.
+ */
+int cpu_pse_available(void);
+
+/**
+ Test to see if the CPU supports global pages.
+ */
+int cpu_pge_available(void);
+
+/**
+ Test to see if the CPU has a Page Attribute Table.
+ */
+int cpu_pat_available(void);
+
+/**
+ Test to see if the CPU has Memory Type Range Registers.
+ */
+int cpu_mtrr_available(void);
+
 /**
  Test to see if the CPU has MMX capabilities.
  */
 int cpu_mmx_available(void);
 
+/**
+ Test to see if the CPU has a Time Stamp Counter.
+ */
+int cpu_tsc_available(void);
+
+/**
+ Test to see if the Time Stamp Counter runs at a constant rate, regardless of
+ the power state of the CPU.
+ */
+int cpu_invariant_tsc_available(void);
+
+/**
+ Returns the number of bits in a physical address on this CPU.
+ */
+int cpu_physical_address_bits(void);
+
 #endif
\ No newline at end of file
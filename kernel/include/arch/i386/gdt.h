@@ -24,6 +24,13 @@
 #define __VKERNEL_i386_GDT__
 
 #include <stdint.h>
+#include <arch/i386/smp.h>
+#include <arch/i386/tss.h>
+
+#define kGDT_DOUBLE_FAULT	5
+#define kGDT_CPU_FIRST		6
+#define kGDT_TASK_FIRST		(kGDT_CPU_FIRST + kMAX_CPUS)
+#define kGDT_COUNT			(kGDT_TASK_FIRST + kMAX_CPUS)
 
 struct gdt_segment {
 	uint16_t limit_lo;
@@ -41,9 +48,72 @@ struct gdt_pointer {
 } __attribute__((packed));
 
 /**
- Prepare the Global Descriptor Table for the main CPU, using a flat memory 
- model.
+ Prepare the Global Descriptor Tables, using a flat memory model, and load the
+ one belonging to the main CPU. Each CPU has its own copy.
  */
 void gdt_prepare(void);
 
+/**
+ Load the Global Descriptor Table of the specified CPU on the calling CPU. This
+ is used by each CPU that is started after the bootstrap processor. The segment
+ registers are all reset to the kernel data segment, including GS.
+ */
+void gdt_reload(uint32_t cpu);
+
+/**
+ Set the per-CPU data segment descriptor for the specified CPU.
+
+ 	- cpu: The index of the CPU.
+ 	- base: The address of the per-CPU data.
+ 	- limit: The length of the per-CPU data, less one.
+
+ RETURNS:
+ 	The selector of the segment.
+ */
+uint16_t gdt_set_cpu_descriptor(uint32_t cpu, uint32_t base, uint32_t limit);
+
+/**
+ Set the task state segment descriptor for the specified CPU. The selector 
+ must be loaded in to the task register of that CPU before a double fault can
+ be handled on it.
+
+ 	- cpu: The index of the CPU.
+
+ RETURNS:
+ 	The selector of the task state segment.
+ */
+uint16_t gdt_set_cpu_task(uint32_t cpu);
+
+/**
+ Returns the task state segment of the specified CPU. The state of the CPU at
+ the time of a double fault is saved here.
+ */
+struct tss *gdt_get_cpu_task(uint32_t cpu);
+
+/**
+ Configure the task that double faults on the specified CPU are handled in. It
+ runs on its own stack, so a double fault caused by an exhausted stack can 
+ still be reported.
+
+ 	- cpu: The index of the CPU.
+ 	- entry: The function that the task starts in. It must not return.
+ 	- stack: The top of the stack of the task.
+ 	- cr3: The physical address of the page directory of the task.
+
+ RETURNS:
+ 	The selector of the task state segment, for use in a task gate.
+ */
+uint16_t gdt_set_double_fault_task(
+	uint32_t cpu, 
+	void *entry, 
+	void *stack, 
+	uint32_t cr3
+);
+
+/**
+ Returns the index of the CPU that entered the double fault task. This is only
+ meaningful from within the double fault task.
+ */
+uint32_t gdt_double_fault_cpu(void);
+
 #endif
\ No newline at end of file
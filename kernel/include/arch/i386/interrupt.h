@@ -55,7 +55,50 @@ void interrupt_handlers_prepare(struct boot_config *config);
 void interrupt_handler_add(uint8_t interrupt, interrupt_handler_t handler);
 
 /**
- Request that the current task be preempted at the next system tick.
+ Install a CPU level handler directly into the Interrupt Descriptor Table,
+ bypassing the interrupt stubs provided by CoreLoader. The handler is entered
+ as an interrupt gate, with interrupts disabled.
+
+ 	- interrupt: The interrupt number of which the handler will be for.
+ 	- entry: The address of the entry point. This must be a naked function
+ 	  that ends with iret.
+ */
+void interrupt_gate_install(uint8_t interrupt, void *entry);
+
+/**
+ Attempt to resolve a Page Fault through the virtual memory manager. If the
+ fault can not be resolved, then the system will panic.
+
+ 	- frame: The interrupt frame of the faulting context.
+ */
+void page_fault_handler(struct interrupt_frame *frame);
+
+/**
+ Handle the Local APIC timer firing on the calling CPU. It is the clock event
+ device of every CPU other than the bootstrap processor.
+
+ 	- frame: The interrupt frame of the interrupted context.
+ */
+void lapic_timer_handler(struct interrupt_frame *frame);
+
+/**
+ Handle a request from another CPU to look at the run queues of the calling
+ CPU, after a task has been queued on it.
+
+ 	- frame: The interrupt frame of the interrupted context.
+ */
+void reschedule_handler(struct interrupt_frame *frame);
+
+/**
+ Flush the TLB of the calling CPU at the request of another CPU.
+
+ 	- frame: The interrupt frame of the interrupted context.
+ */
+void tlb_shootdown_handler(struct interrupt_frame *frame);
+
+/**
+ Request that the current task on the calling CPU be preempted as soon as
+ possible, by ending its timeslice.
  */
 void request_preemption(void);
 
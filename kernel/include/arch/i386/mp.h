@@ -0,0 +1,61 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#ifndef __VKERNEL_i386_MP__
+#define __VKERNEL_i386_MP__
+
+#include <stdint.h>
+#include <arch/i386/smp.h>
+
+#define kMP_MAX_IOAPICS		4
+
+struct mp_ioapic
+{
+	uint8_t id;
+	uintptr_t address;
+};
+
+// The parts of the MP configuration table that the kernel uses.
+struct mp_configuration
+{
+	uintptr_t lapic_address;
+	uint32_t cpu_count;
+	uint8_t cpu_apic_ids[kMAX_CPUS];
+	uint8_t bsp_apic_id;
+	uint32_t ioapic_count;
+	struct mp_ioapic ioapics[kMP_MAX_IOAPICS];
+};
+
+/**
+ Search the BIOS areas for the MP floating pointer structure, and read the
+ processors and I/O APICs from the MP configuration table that it refers to.
+ Processors that are disabled are skipped, as are any beyond kMAX_CPUS.
+
+ 	- config: The structure to fill in.
+
+ RETURNS:
+ 	1 if a configuration table was found, or 0 if the system must be treated
+ 	as having a single CPU.
+ */
+int mp_prepare(struct mp_configuration *config);
+
+#endif
@@ -25,19 +25,13 @@
 
 #include <stdint.h>
 
-/**
- Configure and prepare the Programmable Interrupt Timer for use.
- */
-void pit_prepare(void);
+#define kPIT_FREQUENCY		1193182
 
 /**
- Reports the current tick count.
+ Configure the Programmable Interrupt Timer as the clock event device of the
+ bootstrap processor. It is programmed for one interval at a time, and the
+ intervals that have passed make up the fallback clock source.
  */
-uint32_t pit_get_ticks(void) __attribute__((deprecated));
-
-/**
- Reports the current subtick count.
- */
-uint32_t pit_get_subticks(void) __attribute__((deprecated));
+void pit_prepare(void);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,92 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#ifndef __VKERNEL_i386_SMP__
+#define __VKERNEL_i386_SMP__
+
+#include <stdint.h>
+
+struct boot_config;
+
+#ifndef kMAX_CPUS
+#	define kMAX_CPUS		8
+#endif
+
+// Every CPU has its own GS segment, based at its cpu structure. The first field
+// points back at the structure, so that it can be found with a single load.
+struct cpu
+{
+	struct cpu *self;
+	uint32_t index;
+	uint8_t apic_id;
+	uint8_t bsp;
+	volatile uint8_t online;
+	uint16_t selector;
+	uint16_t task;
+	uint32_t lock_depth;
+	uint32_t preempt_depth;
+	uint8_t preempt_pending;
+	volatile uint32_t tlb_generation;
+};
+
+/**
+ Returns the cpu structure of the CPU executing the caller.
+ */
+static inline struct cpu *cpu_current(void)
+{
+	struct cpu *cpu;
+	__asm__ __volatile__("movl %%gs:0, %0" : "=r"(cpu));
+	return cpu;
+}
+
+/**
+ Setup the cpu structure of the bootstrap processor and load its GS segment.
+ This must be done before anything asks for the current CPU.
+ */
+void cpu_prepare(void);
+
+/**
+ Load the GS segment of the specified CPU on the CPU executing the caller.
+ */
+void cpu_load_segment(struct cpu *cpu);
+
+/**
+ Returns the cpu structure with the specified index, or NULL if there is no
+ such CPU.
+ */
+struct cpu *cpu_get(uint32_t index);
+
+/**
+ Reports the number of CPUs that are online.
+ */
+uint32_t cpu_count(void);
+
+/**
+ Discover the other CPUs in the system through the MP configuration table, and
+ start each of them. Every CPU joins the scheduler once it has started. This
+ must only be called once multitasking has been enabled.
+
+ 	- config: A valid boot configuration structure.
+ */
+void smp_prepare(struct boot_config *config);
+
+#endif
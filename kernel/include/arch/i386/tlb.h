@@ -0,0 +1,81 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#ifndef __VKERNEL_i386_TLB__
+#define __VKERNEL_i386_TLB__
+
+#include <stdint.h>
+
+/**
+ Prepare TLB management for use. If the CPU supports global pages then they are
+ enabled, so that kernel mappings marked as global survive address space
+ switches.
+ */
+void tlb_prepare(void);
+
+/**
+ Test to see if global pages have been enabled.
+ */
+int tlb_global_pages_enabled(void);
+
+/**
+ Invalidate the TLB entry for the page containing the specified address.
+
+	- address: Any address within the page.
+ */
+void tlb_invalidate_page(uintptr_t address);
+
+/**
+ Invalidate the TLB entries for every page overlapping the specified range. If
+ the range is large, then the entire TLB is flushed instead.
+
+	- start: The first address in the range.
+	- end: The address immediately following the range.
+ */
+void tlb_invalidate_range(uintptr_t start, uintptr_t end);
+
+/**
+ Flush every non-global entry from the TLB.
+ */
+void tlb_flush(void);
+
+/**
+ Flush every entry from the TLB, including global entries.
+ */
+void tlb_flush_global(void);
+
+/**
+ Ask every other CPU to flush its entire TLB, including global entries, and 
+ wait until each of them has done so. This must be called whenever a kernel 
+ mapping is removed or changed, once the entry has been invalidated on the 
+ calling CPU, and before the frame it mapped is reused.
+ */
+void tlb_shootdown(void);
+
+/**
+ Flush the TLB of the calling CPU if a shootdown has been requested since it
+ last flushed. This is called by the shootdown interrupt, and by anything that
+ spins with interrupts disabled, so that the sender is not left waiting.
+ */
+void tlb_shootdown_poll(void);
+
+#endif
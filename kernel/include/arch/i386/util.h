@@ -30,4 +30,56 @@
  */
 extern uint32_t get_eflags(void);
 
+/**
+ Returns the current value of the CR4 register.
+ */
+extern uint32_t get_cr4(void);
+
+/**
+ Sets the value of the CR4 register.
+ */
+extern void set_cr4(uint32_t value);
+
+/**
+ Returns the current value of the CR0 register.
+ */
+extern uint32_t get_cr0(void);
+
+/**
+ Sets the value of the CR0 register.
+ */
+extern void set_cr0(uint32_t value);
+
+/**
+ Returns the current value of the CR2 register. After a page fault, this is the
+ address that caused the fault.
+ */
+extern uint32_t get_cr2(void);
+
+/**
+ Returns the current value of the CR3 register.
+ */
+extern uint32_t get_cr3(void);
+
+/**
+ Sets the value of the CR3 register. This switches to another page directory,
+ and flushes every TLB entry that is not global.
+ */
+extern void set_cr3(uint32_t value);
+
+/**
+ Reads the specified model specific register.
+ */
+extern uint64_t read_msr(uint32_t msr);
+
+/**
+ Writes a value to the specified model specific register.
+ */
+extern void write_msr(uint32_t msr, uint64_t value);
+
+/**
+ Reads the Time Stamp Counter, which counts the cycles of the CPU.
+ */
+extern uint64_t read_tsc(void);
+
 #endif
\ No newline at end of file
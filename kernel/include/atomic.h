@@ -28,27 +28,74 @@
 
 typedef uint32_t atom_t;
 
+#define kATOM_INTERRUPTS	(1 << 0)	// Interrupts were enabled on entry
+#define kATOM_LOCKED		(1 << 1)	// The kernel lock was taken on entry
+
+// The kernel lock only covers the virtual memory system (the kernel directory,
+// page tables and the list of address spaces), the physical frame allocator,
+// the process list and cache programming. Page table updates
+// have to be pushed to every address space and shot down on every CPU as one
+// step, and the frame allocator is called from inside them, so they share the
+// lock. The heap, the run queues, wait queues and timers have their own locks,
+// which are taken in the order: wait queue, run queue, then timers and the 
+// task list. The heap lock may be held while taking the kernel lock, but not
+// the other way around, so nothing allocates inside a critical section.
+
+/**
+ Enter a critical section. Interrupts are disabled on the calling CPU and, once
+ other CPUs have been started, the kernel lock is taken. The kernel lock may be
+ taken recursively by the CPU holding it.
+
+ RETURNS:
+ 	The state to be passed to atomic_leave.
+ */
+atom_t atomic_enter(void);
+
+/**
+ Leave a critical section entered with atomic_enter, restoring the state that
+ it recorded.
+ */
+void atomic_leave(atom_t atom);
+
+/**
+ Require critical sections to take the kernel lock, so that they exclude the
+ other CPUs as well as interrupts. This must be called before any other CPU is
+ started.
+ */
+void atomic_enable_kernel_lock(void);
+
+/**
+ Write the contention statistics of the kernel lock to the debug output.
+ */
+void atomic_dump_stats(void);
+
+/**
+ Keep the current task on the calling CPU, without disabling interrupts. Any
+ switch that is requested in the meantime is held back until preemption is
+ enabled again. This may be nested, but the task must not sleep while it is
+ disabled.
+ */
+void preempt_disable(void);
+
+/**
+ Undo a call to preempt_disable. Once the outermost call has been undone, a 
+ switch that was held back is requested again.
+ */
+void preempt_enable(void);
+
 #ifndef atomic_start
 #define atomic_start(__atom)	\
 	{ \
-		if (get_eflags() & 0x200) { \
-			__atom = 0x11223344; \
-			__asm__ __volatile__("cli"); \
-		} \
-		else { \
-			__atom = 0; \
-		} \
+		__atom = atomic_enter(); \
 	}
 #endif
 
 #ifndef atomic_end
 #define atomic_end(__atom)	\
 	{ \
-		if (__atom == 0x11223344) { \
-			__atom = 0; \
-			__asm__ __volatile__("sti"); \
-		} \
+		atomic_leave(__atom); \
+		__atom = 0; \
 	}
 #endif
 
-#endif
\ No newline at end of file
+#endif
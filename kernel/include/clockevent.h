@@ -0,0 +1,89 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#ifndef __VKERNEL_CLOCK_EVENT__
+#define __VKERNEL_CLOCK_EVENT__
+
+#include <stdint.h>
+
+struct interrupt_frame;
+
+// A clock event device interrupts its CPU once, after a programmed delay. Each
+// CPU has its own device, and programs it for the earliest thing that it has to
+// do next: a timer expiring, or the current task using up its timeslice. When
+// there is nothing to do the CPU can halt for as long as the device allows.
+struct clock_event
+{
+	const char *name;
+	uint64_t min_delta;		// Shortest delay that can be programmed (us)
+	uint64_t max_delta;		// Longest delay that can be programmed (us)
+	void(*program)(uint64_t delta);
+};
+
+/**
+ Use the specified device for the clock events of the calling CPU. The device
+ is programmed straight away.
+ */
+void clock_event_register(struct clock_event *device);
+
+/**
+ Program the device of the calling CPU for the earliest pending timer, or the
+ end of the current timeslice if another task is waiting to run. The device is
+ left alone if it is already due to fire before then.
+ */
+void clock_event_reprogram(void);
+
+/**
+ End the timeslice of the current task on the calling CPU, and program the 
+ device to fire as soon as possible so that the task is switched out.
+ */
+void clock_event_expire_slice(void);
+
+/**
+ Start a new timeslice for the task that the calling CPU is switching to, and
+ program the device for it.
+ */
+void clock_event_start_slice(void);
+
+/**
+ Handle an interrupt from the clock event device of the calling CPU. Expired
+ timers are fired and the device is programmed again. If the timeslice of the
+ current task is over, or a more important task is waiting, then the task is
+ switched out and this does not return.
+
+ 	- frame: The interrupt frame of the interrupted context.
+ 	- ack_pic: Whether the device interrupts through the PIC.
+ */
+void clock_event_interrupt(struct interrupt_frame *frame, int ack_pic);
+
+/**
+ Reports the number of clock event interrupts that a CPU has taken.
+ */
+uint32_t clock_event_count(uint32_t cpu);
+
+/**
+ Write the number of clock event interrupts taken by each CPU, and the rate at
+ which they have been taken, to the debug output.
+ */
+void clock_event_dump_stats(void);
+
+#endif
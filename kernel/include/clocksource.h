@@ -0,0 +1,71 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#ifndef __VKERNEL_CLOCK_SOURCE__
+#define __VKERNEL_CLOCK_SOURCE__
+
+#include <stdint.h>
+
+// A clock source is a free running counter that the uptime is read from. The
+// counter with the highest rating that has been registered is used, so that a
+// fine grained counter replaces a coarse one as soon as it is available.
+struct clock_source
+{
+	const char *name;
+	uint64_t frequency;		// Counts per second
+	uint32_t rating;
+	uint64_t(*read)(void);
+};
+
+/**
+ Offer a clock source for keeping the uptime. It replaces the current clock 
+ source if it has a higher rating, and the uptime carries on from where the
+ current clock source left it.
+ */
+void clock_source_register(struct clock_source *source);
+
+/**
+ Reports the name of the clock source that the uptime is read from.
+ */
+const char *clock_source_name(void);
+
+/**
+ Reports the time since the first clock source was registered.
+
+ RETURNS:
+ 	The uptime in nanoseconds, or 0 if there is no clock source yet.
+ */
+uint64_t clock_source_uptime(void);
+
+/**
+ Read the counter of the current clock source. The difference between two 
+ readings can be converted with cycles_to_ns, and is the cheapest way to 
+ measure a short latency.
+ */
+uint64_t get_cycles(void);
+
+/**
+ Convert a number of counts of the current clock source to nanoseconds.
+ */
+uint64_t cycles_to_ns(uint64_t cycles);
+
+#endif
@@ -24,6 +24,7 @@
 #define __VKERNEL_DEVICE__
 
 #include <stdint.h>
+#include <sema.h>
 
 typedef void *device_t;
 
@@ -82,6 +83,7 @@ enum device_options
 	DP_ATOMIC_WRITE = 1 << 3,
 	DP_WRITE_TERMINATING_NULL = 1 << 4,
 	DP_ALLOWS_ANSI = 1 << 5,
+	DP_BLOCKING_WRITE = 1 << 6,
 };
 
 enum device_error
@@ -122,6 +124,16 @@ struct device
 	struct device_pipe in;
 	struct device_pipe out;
 
+	// Writes to DP_ATOMIC_WRITE devices are serialised by the spinlock, with 
+	// interrupts disabled, so they can be made from anywhere. This is meant for
+	// devices that take a byte at a time, such as the serial port. Writes to 
+	// DP_BLOCKING_WRITE devices are serialised by the mutex instead, and can
+	// only be made by threads that are able to sleep. Slow devices, such as
+	// the VT100 console, use it so that interrupts stay enabled while they
+	// render.
+	struct spinlock write_lock;
+	struct mutex write_mutex;
+
 	// The next group of fields are a collection of optional function pointers,
 	// that allow the kernel to interface with device.
 	void(*write_byte)(struct device *, uint8_t);
@@ -26,6 +26,8 @@
 #include <stdint.h>
 #include <device/keyboard/scancode.h>
 
+struct wait_queue;
+
 /**
  Initialise all required concrete keyboard drivers (PS/2 and USB). These drivers 
  are then responsible for establishing communication back to the virtual 
@@ -57,4 +59,10 @@ struct keyevent *keyboard_wait_for_keyevent(void);
  */
 uint32_t keyboard_buffer_has_items(void);
 
+/**
+ Returns the wait queue of threads waiting for any keyboard input. Every thread
+ on it is woken when a scancode is received.
+ */
+struct wait_queue *keyboard_wait_queue(void);
+
 #endif
\ No newline at end of file
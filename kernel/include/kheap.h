@@ -27,14 +27,36 @@
 
 #define kHEAP_ALLOC_MAGIC	0xA110CA7E
 #define kHEAP_AVAIL_MAGIC	0xF7EEF7EE
+#define kHEAP_FENCE_MAGIC	0xFE4CEFE4
 
 struct kheap_block  {
 	uint32_t magic;
-	struct kheap_block *prev;
-	struct kheap_block *next;
 	size_t size;
 } __attribute__((packed));
 
+struct kheap_statistics {
+	size_t bytes_in_use;
+	size_t bytes_free;
+	size_t largest_free_block;
+	uint32_t block_count;
+	uint32_t free_block_count;
+	uint32_t allocations;
+	uint32_t frees;
+	uint32_t expansions;
+	uint32_t pages_mapped;
+	uint32_t pages_released;
+	uint32_t pages_punched;
+	uint32_t slab_pages;
+	uint32_t splits;
+	uint32_t coalesces;
+};
+
+struct kheap_sample {
+	uint32_t sequence;
+	uintptr_t caller;
+	size_t size;
+};
+
 /**
  Allocate a block of memory that is of the specified length.
 
@@ -45,6 +67,59 @@ struct kheap_block  {
  */
 void *kalloc(size_t length);
 
+/**
+ Allocate a block of memory that is of the specified length, and whose starting
+ address is a multiple of the specified alignment.
+
+ 	- length: The number of bytes to be allocated.
+ 	- align: The required alignment in bytes. Must be a power of two.
+
+ Returns:
+ 	Pointer to the start of the allocated memory. This can be released with
+ 	kfree().
+ */
+void *kalloc_aligned(size_t length, size_t align);
+
+/**
+ Allocate the specified number of whole, contiguous pages in the kernel address
+ space. These are not managed by the kernel heap and carry no header.
+
+ 	- pages: The number of pages to be allocated.
+
+ Returns:
+ 	Pointer to the start of the first page.
+ */
+void *kalloc_pages(uint32_t pages);
+
+/**
+ Free pages that were previously allocated with kalloc_pages().
+
+ 	- ptr: A pointer to the start of the first page.
+ 	- pages: The number of pages that were allocated.
+ */
+void kfree_pages(void *ptr, uint32_t pages);
+
+/**
+ Allocate a stack of the specified number of pages in the kernel address space.
+ The pages are backed by memory up front, and the page below the stack is a 
+ guard page that catches overflows.
+
+ 	- pages: The number of pages in the stack.
+
+ Returns:
+ 	Pointer to the lowest address of the stack, or NULL if the stack could not
+ 	be allocated.
+ */
+void *kalloc_stack(uint32_t pages);
+
+/**
+ Free a stack that was previously allocated with kalloc_stack().
+
+ 	- ptr: A pointer to the lowest address of the stack.
+ 	- pages: The number of pages in the stack.
+ */
+void kfree_stack(void *ptr, uint32_t pages);
+
 /**
  Free the specified allocated memory.
 
@@ -57,4 +132,38 @@ void kfree(void *ptr);
  */
 void kheap_dump_structure(void);
 
+/**
+ Take a snapshot of the kernel heap counters. These are maintained as the heap
+ is used, so this does not walk the heap.
+
+ 	- stats: The structure to be populated.
+ */
+void kheap_stats(struct kheap_statistics *stats);
+
+/**
+ Set the rate of the allocation profiler. One in every `rate` allocations will
+ have its caller and size recorded. A rate of zero disables profiling.
+
+ 	- rate: The sampling rate.
+ */
+void kheap_profile_set_rate(uint32_t rate);
+
+/**
+ Copy the most recent allocation profile samples, oldest first.
+
+ 	- samples: The array to copy the samples into.
+ 	- count: The maximum number of samples to copy.
+
+ Returns:
+ 	The number of samples that were copied.
+ */
+uint32_t kheap_profile_samples(struct kheap_sample *samples, uint32_t count);
+
+/**
+ Write the kernel heap counters and profile samples to the debug output (COM1).
+ This is done when the kernel panics because of memory, and so may be called 
+ while the heap lock is held, in which case the largest free block is left out.
+ */
+void kheap_dump_stats(void);
+
 #endif
\ No newline at end of file
@@ -38,6 +38,14 @@
  */
 void *mmx_memcpy(void *restrict dst, const void *restrict src, size_t n);
 
+/**
+ Clear a 4KiB page using non-temporal stores where the CPU supports them, so
+ that the cleared page does not evict useful data from the cache.
+
+ 	- page: The page aligned address of the page.
+ */
+void zero_page_nontemporal(void *page);
+
 /**
  Copy the specified number of dwords of memory, dword by dwords from the 
  source to the destination.
@@ -26,6 +26,16 @@
 #include <stdint.h>
 #include <boot_config.h>
 
+#define kFRAME_MAX_ORDER	10	// 4 MiB, 1024 frames
+#define kFRAME_ZONE_COUNT	3
+
+enum frame_zone
+{
+	frame_zone_low = 0,		// Below 1MiB, for real mode and legacy devices
+	frame_zone_dma = 1,		// Below 16MiB, reachable by ISA DMA
+	frame_zone_normal = 2,	// Everything else
+};
+
 /**
  Retrieve the ending address in memory of the kernel.
 
@@ -49,8 +59,8 @@ uintptr_t reserve_kernel_working_memory(size_t length);
  Setup and prepare the physical memory manager. This is an involved function and
  requires a valid boot configuration to be provided. It will search for what
  physical frames are actually available to the kernel, how many are in use and
- thus how many are still available. It will then proceed to construct a stack
- of free/available frame addresses then can be used later.
+ thus how many are still available. It will then proceed to construct the buddy
+ free lists of available frames that can be used later.
 
  	- config: A valid boot configuration structure provided by the boot loader.
 
@@ -69,9 +79,99 @@ void physical_memory_prepare(struct boot_config *config);
 uintptr_t kframe_alloc(void);
 
 /**
- Free the specified frame and return it to the free/available frame stack, for
+ Allocates a physical frame whose contents have been cleared. Frames are taken
+ from the pool of pre-zeroed frames when possible, and are only cleared on the
+ spot when the pool is empty.
+
+ RETURNS:
+ 	The address of the allocated frame.
+ */
+uintptr_t kframe_alloc_zeroed(void);
+
+/**
+ Clear one free frame and add it to the pool of pre-zeroed frames. This is
+ intended to be called when the CPU has nothing else to do.
+
+ RETURNS:
+ 	1 if a frame was added to the pool, or 0 if the pool is full or free frames
+ 	are running low.
+ */
+int kframe_zeroed_refill(void);
+
+/**
+ Reports the number of frames waiting in the pool of pre-zeroed frames.
+ */
+uint32_t kframe_zeroed_count(void);
+
+/**
+ Allocates a physically contiguous run of 2^order frames. The run is naturally
+ aligned, i.e. its address is a multiple of its size.
+
+ 	- order: The order of the run, between 0 and kFRAME_MAX_ORDER.
+
+ RETURNS:
+ 	The address of the first frame in the run, or 0 if no run of the requested
+ 	order is available.
+ */
+uintptr_t kframe_alloc_order(uint32_t order);
+
+/**
+ Allocates a physically contiguous run of 2^order frames from the specified
+ zone. If the zone is exhausted, the zones below it are tried in turn, so that
+ a normal allocation falls back to DMA memory and then low memory. Frames are
+ never taken from a zone above the one requested.
+
+ 	- order: The order of the run, between 0 and kFRAME_MAX_ORDER.
+ 	- zone: The highest zone that the run may be taken from.
+
+ RETURNS:
+ 	The address of the first frame in the run, or 0 if no run of the requested
+ 	order is available.
+ */
+uintptr_t kframe_alloc_zone(uint32_t order, enum frame_zone zone);
+
+/**
+ Reports the number of free frames in the specified zone.
+
+ RETURNS:
+ 	The number of free frames.
+ */
+uint32_t kframe_free_count(enum frame_zone zone);
+
+/**
+ Free the specified frame and return it to the free/available frames, for
  re-use.
  */
 void kframe_free(uintptr_t frame);
 
+/**
+ Free a run of frames previously allocated by kframe_alloc_order. The run is
+ merged with its free buddies. Attempting to free a run that is already free is
+ reported and ignored.
+
+ 	- frame: The address of the first frame in the run.
+ 	- order: The order that the run was allocated with.
+ */
+void kframe_free_order(uintptr_t frame, uint32_t order);
+
+/**
+ Free every frame that lies entirely within the specified range of physical
+ memory. The range is handed over in whole blocks rather than frame by frame,
+ and is counted as part of the zones that it lies in. It should not be used to
+ free frames that were taken from the allocator.
+
+ 	- start: The first address of the range.
+ 	- end: The address immediately following the range.
+ */
+void kframe_free_range(uintptr_t start, uintptr_t end);
+
+/**
+ Mark every frame that overlaps the specified range of physical memory as in
+ use, so that it will not be allocated. Frames already in use are unaffected.
+
+ 	- start: The first address of the range.
+ 	- end: The address immediately following the range.
+ */
+void kframe_reserve_range(uintptr_t start, uintptr_t end);
+
 #endif
\ No newline at end of file
@@ -25,6 +25,8 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <wait_queue.h>
+#include <sema.h>
 
 struct process;
 
@@ -59,6 +61,9 @@ struct pipe
     uint8_t *data;
     const char *name;
     bool read_lock;
+    struct spinlock lock;
+    struct wait_queue readers;
+    struct wait_queue writers;
 };
 
 enum pipe_binding
@@ -27,6 +27,8 @@
 #include <thread.h>
 #include <pipe.h>
 
+struct virtual_address_space;
+
 // The first group of defined process PID's are the internal kernel agents.
 #define KERNEL_PID		0
 #define IDLE_PID		1
@@ -43,7 +45,8 @@ enum process_launch_flags
 	// The process is a root/kernel level agent and doesn't accept user input.
 	P_ROOT = 1 << 0,
 
-	// The process should exist within user-space.
+	// The process should exist within user-space. It is given its own address
+	// space, with the kernel half shared.
 	P_USR = 1 << 1,
 
 	// The process should exist as an UI agent, accepting user input.
@@ -55,6 +58,7 @@ struct process
 	uint32_t pid;
 	const char *name;
 	uintptr_t page_dir;
+	struct virtual_address_space *address_space;
 	int allow_frontmost;
 	uint32_t switched_out;
 
@@ -65,6 +69,7 @@ struct process
 	
 	struct {
 		struct thread *main;
+		uint32_t count;
 	} threads;
 
 	struct process *next;
@@ -76,6 +81,12 @@ struct process
  */
 void process_prepare(void);
 
+/**
+ The body of every idle thread. Idle time is spent preparing zeroed frames, and
+ the CPU is halted once there is nothing left to do.
+ */
+int idle(void);
+
 /**
  Launch a new process with the specified name, starting location and 
  launch flags.
@@ -91,13 +102,20 @@ struct process *process_launch(
 /**
  Spawn a new process with the specified meta-data. A newly spawned process
  will be automatically given a new main thread. This main thread will be placed
- at the specified entry function.
+ at the specified entry function. The process shares the kernel address space.
 
  NOTE: The first spawned process will be the kernel, and will adopt all current
  kernel configurations.
  */
 struct process *process_spawn(const char *name, int(*_entry)(void));
 
+/**
+ Remove the specified process from the system, and destroy its address space.
+ Every one of its threads must already have been destroyed. Pipes are left 
+ alone, as the process at the other end may still be using them.
+ */
+void process_destroy(struct process *proc);
+
 /**
  Spawn a new thread inside the specified process.
 
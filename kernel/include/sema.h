@@ -23,26 +23,88 @@
 #ifndef __VKERNEL_SEMAPHORE__
 #define __VKERNEL_SEMAPHORE__
 
-typedef volatile int spin_lock_t[2];
+#include <stdint.h>
+#include <spinlock.h>
+#include <wait_queue.h>
+
+struct task;
+
+// Mutexes and semaphores put their waiters to sleep on a wait queue. They can 
+// only be used by threads, and never inside an atomic section or while holding
+// a spinlock. A zero filled mutex is unlocked.
+struct mutex
+{
+	struct spinlock guard;
+	int locked;
+	struct task *owner;
+	struct wait_queue waiters;
+	struct lock_statistics stats;
+};
+
+struct semaphore
+{
+	struct spinlock guard;
+	int32_t count;
+	struct wait_queue waiters;
+	struct lock_statistics stats;
+};
+
+/**
+ Initialise a new, unlocked mutex.
+ */
+void mutex_init(struct mutex *mutex);
+
+/**
+ Acquire a mutex, sleeping until it is released if another thread holds it.
+ Mutexes can not be acquired recursively.
+ */
+void mutex_lock(struct mutex *mutex);
+
+/**
+ Attempt to acquire a mutex without sleeping.
+
+ RETURNS:
+ 	1 if the mutex was acquired, or 0 if it is held.
+ */
+int mutex_try_lock(struct mutex *mutex);
+
+/**
+ Release a mutex, and wake the first thread waiting for it.
+ */
+void mutex_unlock(struct mutex *mutex);
 
 /**
- Initialise a new "spinlock" semaphore.
+ Initialise a new counting semaphore.
+
+ 	- count: The number of times that the semaphore can be taken before a 
+ 	  thread must wait.
  */
-void spin_init(spin_lock_t lock);
+void sema_init(struct semaphore *sema, int32_t count);
 
 /**
- Attempt to acquire a lock.
+ Take the semaphore, sleeping until it is available if the count is zero.
  */
-void spin_lock(spin_lock_t lock);
+void sema_down(struct semaphore *sema);
 
 /**
+ Attempt to take the semaphore without sleeping.
 
+ RETURNS:
+ 	1 if the semaphore was taken, or 0 if the count is zero.
+ */
+int sema_try_down(struct semaphore *sema);
+
+/**
+ Release the semaphore, and wake the first thread waiting for it.
  */
-void spin_unlock(spin_lock_t lock);
+void sema_up(struct semaphore *sema);
 
 /**
+ Write the contention statistics of a lock to the debug output.
 
+ 	- name: A name to identify the lock by.
+ 	- stats: The statistics of the lock.
  */
-void spin_wait(volatile int *address, volatile int *waiters);
+void lock_dump_stats(const char *name, const struct lock_statistics *stats);
 
-#endif
\ No newline at end of file
+#endif
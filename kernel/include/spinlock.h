@@ -0,0 +1,105 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#ifndef __VKERNEL_SPINLOCK__
+#define __VKERNEL_SPINLOCK__
+
+#include <stdint.h>
+
+// Contention statistics are gathered for every lock unless this is defined as
+// zero. They are only updated while the lock is held.
+#ifndef kLOCK_STATISTICS
+#	define kLOCK_STATISTICS	1
+#endif
+
+typedef uint32_t irq_flags_t;
+
+struct lock_statistics
+{
+	uint32_t acquisitions;	// Times the lock was taken
+	uint32_t contentions;	// Times the lock was already held when requested
+	uint64_t spins;			// Iterations spent spinning for the lock
+	uint64_t wait_time;		// Nanoseconds spent asleep waiting for the lock
+};
+
+// Spinlocks hand out tickets, so that CPUs take the lock in the order that they
+// asked for it. A zero filled spinlock is unlocked.
+struct spinlock
+{
+	volatile uint16_t next;
+	volatile uint16_t owner;
+	struct lock_statistics stats;
+};
+
+/**
+ Disable interrupts on the calling CPU.
+
+ RETURNS:
+ 	The previous interrupt state, to be passed to irq_restore.
+ */
+irq_flags_t irq_save(void);
+
+/**
+ Restore the interrupt state returned by irq_save.
+ */
+void irq_restore(irq_flags_t flags);
+
+/**
+ Initialise a new spinlock.
+ */
+void spin_init(struct spinlock *lock);
+
+/**
+ Acquire a spinlock, waiting for as long as it takes. Interrupts are left as
+ they are, so a lock that is also taken by an interrupt handler must be taken
+ with spin_lock_irqsave instead.
+ */
+void spin_lock(struct spinlock *lock);
+
+/**
+ Attempt to acquire a spinlock without waiting.
+
+ RETURNS:
+ 	1 if the lock was acquired, or 0 if it is held.
+ */
+int spin_try_lock(struct spinlock *lock);
+
+/**
+ Release a spinlock.
+ */
+void spin_unlock(struct spinlock *lock);
+
+/**
+ Disable interrupts on the calling CPU and then acquire a spinlock.
+
+ RETURNS:
+ 	The previous interrupt state, to be passed to spin_unlock_irqrestore.
+ */
+irq_flags_t spin_lock_irqsave(struct spinlock *lock);
+
+/**
+ Release a spinlock, and then restore the interrupt state from before it was
+ acquired.
+ */
+void spin_unlock_irqrestore(struct spinlock *lock, irq_flags_t flags);
+
+#endif
@@ -25,13 +25,36 @@
 
 #include <stdint.h>
 #include <thread.h>
+#include <timer.h>
 #include <arch/arch.h>
 
+struct wait_queue;
+
+// Runnable tasks wait in the run queue of their priority, sleeping tasks wait
+// for their sleep timer to expire, and tasks blocked on an event wait in the
+// wait queue for it. Killed tasks wait to be freed once they have been switched
+// out. Other blocked and currently executing tasks are in none of them.
+enum task_queue
+{
+	task_queue_none,
+	task_queue_run,
+	task_queue_sleep,
+	task_queue_wait,
+	task_queue_dead,
+};
+
 struct task
 {
 	struct thread *thread;
 	struct task *prev;
 	struct task *next;
+	enum task_queue queue;
+	struct task *queue_prev;
+	struct task *queue_next;
+	struct timer sleep_timer;
+	uint32_t cpu;
+	volatile uint8_t on_cpu;
+	uint8_t woken;
 };
 
 /**
@@ -53,19 +76,103 @@ void task_set_allowed(int flag);
  */
 int task_create(struct thread *thread);
 
+/**
+ Make the calling CPU available to the scheduler. The CPU becomes online and 
+ runs an idle thread on its current stack, until it has other tasks to run.
+ This must only be called once for each CPU, other than the bootstrap 
+ processor.
+ */
+__attribute__((noreturn))
+void task_cpu_enter(void);
+
+/**
+ Free every killed task that has been switched out, along with its thread. A
+ process is destroyed along with the last of its threads. This is done by the
+ idle threads, as a task can not free the stack that it is running on.
+ */
+void task_reap(void);
+
 /**
  Yield the current task. This can only be done in an interrupt frame.
+
+ 	- frame: The interrupt frame of the current task.
+ 	- ack_pic: Whether the interrupt came from the PIC, which then has to be
+ 	  acknowledged if the task is switched out.
  */
-void yield(struct interrupt_frame *frame);
+void yield(struct interrupt_frame *frame, int ack_pic);
 
 /**
- Returns the currently executing task.
+ Returns the task executing on the calling CPU.
  */
 struct task *task_get_current(void);
 
 /**
- Resume all relavent tasks that have been blocked due to the specified reason.
+ Mark the specified task as running, and place it in its run queue. The task
+ must not be in any other queue.
+ */
+void task_wake(struct task *task);
+
+/**
+ Mark the specified task as blocked on a wait queue, and request that it is
+ switched out. This is used by wait_queue_join, which links the task in to the
+ queue afterwards while still holding the lock of the queue.
+
+ RETURNS:
+ 	1 if the task was blocked, or 0 if it has been killed or is already in a
+ 	queue, in which case it must not join the wait queue.
+ */
+int task_block(struct task *task, struct wait_queue *queue);
+
+/**
+ Place the current task in the sleep queue until the specified uptime, in
+ microseconds, and request that it is switched out. The task keeps running 
+ until it is, so the caller must wait for it to be marked as running again.
+ */
+void task_sleep(uint64_t deadline);
+
+/**
+ Reports whether another task on the calling CPU is able to take a turn when
+ the timeslice of the current task ends.
+ */
+int task_timeslice_needed(void);
+
+/**
+ Reports whether the current task on the calling CPU should be switched out
+ straight away, because a task that outranks it is waiting. A task outranks
+ another if it has a higher priority, or if it is an interactive task that has
+ just woken up and the other is a batch task of the same priority. An idle
+ CPU should also switch if there is work that it could take from another CPU.
+ */
+int task_preempt_needed(void);
+
+/**
+ Reports the timeslice of the current task on the calling CPU, in microseconds.
+ */
+uint32_t task_timeslice(void);
+
+/**
+ Kill the specified task. It is taken out of any run, sleep or wait queue that
+ it is in, and is freed along with its thread once no CPU is running it.
+ */
+void task_kill(struct task *task);
+
+/**
+ Change the priority of the specified thread. The priority is clamped to the
+ range of valid priorities.
+ */
+void task_set_priority(struct thread *thread, uint8_t priority);
+
+/**
+ Change the scheduling class of the specified thread. The timeslice of the 
+ thread is reset to the default for the class.
+ */
+void task_set_class(struct thread *thread, enum thread_class sched_class);
+
+/**
+ Change the timeslice of the specified thread, in microseconds. It takes 
+ effect from the next time that the thread is switched in, and is clamped to
+ the range of valid timeslices.
  */
-void task_resume_any_for(enum thread_mode_reason reason, uint64_t info);
+void task_set_timeslice(struct thread *thread, uint32_t timeslice);
 
 #endif
\ No newline at end of file
@@ -27,6 +27,26 @@
 #include <arch/arch.h>
 #include <process.h>
 
+// Threads are scheduled strictly by priority. Higher values run first, and
+// threads of equal priority take turns.
+#define kTHREAD_PRIORITIES		32
+#define kTHREAD_PRIORITY_IDLE	0
+#define kTHREAD_PRIORITY_NORMAL	16
+
+// Timeslices are in microseconds.
+#ifndef kTHREAD_TIMESLICE_INTERACTIVE
+#	define kTHREAD_TIMESLICE_INTERACTIVE	10000
+#endif
+
+#ifndef kTHREAD_TIMESLICE_BATCH
+#	define kTHREAD_TIMESLICE_BATCH		40000
+#endif
+
+#define kTHREAD_TIMESLICE_MIN		1000
+#define kTHREAD_TIMESLICE_MAX		200000
+
+struct task;
+
 enum thread_mode
 {
 	thread_running,
@@ -35,14 +55,25 @@ enum thread_mode
 	thread_killed,
 };
 
+// Interactive threads spend most of their time waiting for something to
+// happen, and need to respond quickly when it does. When one wakes up it takes
+// the CPU from a batch thread of the same priority. Batch threads get longer
+// timeslices, and are only ever preempted by higher priorities or when their
+// timeslice ends.
+enum thread_class
+{
+	thread_class_batch,
+	thread_class_interactive,
+};
+
 enum thread_mode_reason
 {
 	reason_none,
 	reason_irq_wait,
-	reason_key_wait,
 	reason_sleep,
 	reason_process,
 	reason_exited,
+	reason_wait,
 };
 
 struct thread
@@ -50,9 +81,15 @@ struct thread
 	uint32_t tid;
 	const char *label;
 	struct process *owner;
+	struct task *task;
+	uint8_t priority;
+	enum thread_class sched_class;
+	uint32_t timeslice;
 	struct {
 		uint32_t esp;
 		uint32_t ebp;
+		void *base;
+		uint32_t pages;
 	} stack;
 	struct {
 		enum thread_mode mode;
@@ -72,6 +109,12 @@ struct thread *thread_create(const char *label, int(*start)(void));
  */
 int thread_stack_init(struct thread *thread, uint32_t size);
 
+/**
+ Free the specified thread and its stack. The thread must no longer have a 
+ task, and must not be running.
+ */
+void thread_destroy(struct thread *thread);
+
 /**
  Put the current thread to sleep for the specified period of time (milliseconds)
  */
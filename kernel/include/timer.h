@@ -0,0 +1,97 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#ifndef __VKERNEL_TIMER__
+#define __VKERNEL_TIMER__
+
+#include <stdint.h>
+
+#define kTIMER_INACTIVE		0xFFFFFFFF
+#define kTIMER_SET_ASIDE	0xFFFFFFFE
+#define kTIMER_FIRING		0xFFFFFFFD
+
+// A timer calls its function once the uptime reaches its deadline. Active
+// timers are kept in a min-heap ordered by deadline, so only the earliest one
+// is inspected on each clock event. If the heap is full, timers are set aside
+// in a list until there is room for them. The function is called from the 
+// clock event interrupt of whichever CPU notices the deadline first, and must
+// not block. It is called without the lock of the timers held, so it is free
+// to take other locks.
+struct timer
+{
+	uint64_t deadline;
+	void(*fire)(void *context);
+	void *context;
+	uint32_t slot;
+	struct timer *next;
+};
+
+/**
+ Initialise a timer with the function that it should call when it expires. The
+ timer is initially inactive.
+
+ 	- timer: The timer to initialise.
+ 	- fire: The function to call when the timer expires.
+ 	- context: A value to pass to the function.
+ */
+void timer_init(struct timer *timer, void(*fire)(void *), void *context);
+
+/**
+ Start the timer so that it expires at the specified uptime. A timer that is
+ already active is moved to the new deadline. Starting a timer always succeeds,
+ although it is slower once the heap is full.
+
+ 	- timer: An initialised timer.
+ 	- deadline: The uptime, in microseconds, at which the timer expires.
+ */
+void timer_start(struct timer *timer, uint64_t deadline);
+
+/**
+ Stop the timer without calling its function. Inactive timers are ignored. If
+ the function is being called on another CPU, this waits for it to return, so
+ the timer may be freed afterwards. It must not be called from the function of
+ the timer itself.
+ */
+void timer_cancel(struct timer *timer);
+
+/**
+ Reports whether the timer is waiting to expire.
+ */
+int timer_active(struct timer *timer);
+
+/**
+ Reports the deadline of the earliest active timer.
+
+ RETURNS:
+ 	The deadline in microseconds, or UINT64_MAX if no timer is active.
+ */
+uint64_t timer_next_deadline(void);
+
+/**
+ Call the function of every timer whose deadline has been reached. This is
+ called by clock event interrupts with interrupts disabled.
+
+ 	- now: The current uptime in microseconds.
+ */
+void timer_expire(uint64_t now);
+
+#endif
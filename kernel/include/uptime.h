@@ -25,6 +25,7 @@
 
 #include <stdint.h>
 
+uint64_t get_uptime_ns(void);
 useconds_t get_uptime_u(void);
 suseconds_t get_uptime_ms(void);
 time_t get_uptime_s(void);
@@ -25,31 +25,72 @@
 
 #include <stdint.h>
 #include <boot_config.h>
+#include <arch/arch.h>
 
 #define kPAGE_ALLOC_OK      1
 #define kPAGE_ALLOC_ERROR   0
 
-// TODO: This structure needs to be fully/correctly laid out
+#define kPAGE_ALLOCATED             1
+#define kNO_PAGE_ALLOCATED          0
+#define kNO_PAGE_TABLE_ALLOCATED    -1
+#define kPAGE_RESERVED              2
+#define kPAGE_GUARD                 3
+
 struct page {
     uint32_t present: 1;
     uint32_t readwrite: 1;
-    uint32_t unused: 10;
+    uint32_t user: 1;
+    uint32_t write_through: 1;
+    uint32_t cache_disable: 1;
+    uint32_t accessed: 1;
+    uint32_t dirty: 1;
+    uint32_t attribute: 1;
+    uint32_t global: 1;
+    uint32_t reserved: 1;   // Software: unmapped, but the address is claimed
+    uint32_t available: 1;
+    uint32_t guard: 1;      // Software: never mapped, catches overflows
     uint32_t frame: 20;
 } __attribute__((packed));
 
-// TODO: This structure needs to be fully/correctly laid out
+#define kLARGE_PAGE_SIZE    0x400000
+#define kLARGE_PAGE_PAGES   1024
+
+// A page directory entry either refers to a page table, or when size is set
+// maps a single 4MiB page directly. The dirty and global bits only apply to
+// 4MiB pages. In the directory of a process, owned marks the page tables that
+// belong to the process rather than being shared with the kernel.
 struct page_table {
     uint32_t present: 1;
     uint32_t readwrite: 1;
-    uint32_t unused: 10;
+    uint32_t user: 1;
+    uint32_t write_through: 1;
+    uint32_t cache_disable: 1;
+    uint32_t accessed: 1;
+    uint32_t dirty: 1;
+    uint32_t size: 1;
+    uint32_t global: 1;
+    uint32_t owned: 1;      // Software: the frames/page table are owned
+    uint32_t available: 2;
     uint32_t frame: 20;
 } __attribute__((packed));
 
+struct page_fault_statistics {
+    uint32_t kernel_syncs;      // Stale kernel directory entries refreshed
+    uint32_t kernel_commits;    // Reserved kernel pages backed on first touch
+    uint32_t guard_hits;        // Accesses to guard pages
+    uint32_t unresolved;        // Any other fault
+};
+
+// Every address space shares the kernel half of the kernel's page directory.
+// The kernel_generation records which revision of the kernel directory entries
+// was last copied into the address space. Page tables are not mapped into the
+// kernel, and are reached through the recursive directory entry or kmap. Every
+// address space other than the kernel's is linked into a list, so that entries
+// removed from the kernel half can be pushed to all of them at once.
 struct virtual_address_space {
     uintptr_t directory_frame;
-    uintptr_t directory_address;
-    uintptr_t next_page_table;
-    uintptr_t page_table_address[1024];
+    uint32_t kernel_generation;
+    struct virtual_address_space *next;
 };
 
 /**
@@ -60,6 +101,20 @@ struct virtual_address_space {
  */
 void virtual_memory_prepare(struct boot_config *config);
 
+/**
+ Check whether the page at the specified address is currently mapped.
+
+    - address: Any 32-bit address.
+
+ RETURNS:
+    kPAGE_ALLOCATED if the page is mapped.
+    kNO_PAGE_ALLOCATED if the page is not mapped.
+    kNO_PAGE_TABLE_ALLOCATED if there is no page table covering the address.
+    kPAGE_RESERVED if the page is not mapped, but its address has been claimed.
+    kPAGE_GUARD if the page is a guard page.
+ */
+int is_page_allocated(uintptr_t address);
+
 /**
  Reports the address of the first available page in the kernel address space.
 
@@ -70,7 +125,9 @@ uintptr_t first_available_kernel_page(void);
 
 /**
  Reports the address of the first available page in the kernel address space 
- that is followed by the specified number of contiguous available pages.
+ that is followed by the specified number of contiguous available pages. The
+ pages are reserved for the caller and will not be reported again. Each page
+ becomes available again once it has been mapped and then freed with kpage_free.
 
  RETURNS:
     An address for a page in kernel space.
@@ -78,7 +135,31 @@ uintptr_t first_available_kernel_page(void);
 uintptr_t find_available_contiguous_kernel_pages(uint32_t count);
 
 /**
- Attempt to allocate the page at the specified address.
+ Reports the address of the first available page in the kernel address space
+ that is aligned to the specified number of pages, and followed by the
+ specified number of contiguous available pages. The pages are reserved for the
+ caller in the same way as find_available_contiguous_kernel_pages.
+
+    - count: The number of pages required.
+    - align: The alignment of the first page, in pages. Must be a power of two.
+
+ RETURNS:
+    An address for a page in kernel space.
+ */
+uintptr_t find_available_aligned_kernel_pages(uint32_t count, uint32_t align);
+
+/**
+ Return a range of pages reserved by find_available_contiguous_kernel_pages that
+ were never mapped back to the available kernel address space.
+
+    - address: The address of the first page in the range.
+    - count: The number of pages in the range.
+ */
+void release_kernel_pages(uintptr_t address, uint32_t count);
+
+/**
+ Attempt to allocate the page at the specified address. Reserved pages may be
+ allocated, and stop being reserved once they are.
 
     - address: Any 32-bit address.
 
@@ -88,11 +169,205 @@ uintptr_t find_available_contiguous_kernel_pages(uint32_t count);
  */
 int kpage_alloc(uintptr_t address);
 
+/**
+ Reserve the page at the specified address without mapping it. The page is
+ backed by a zeroed frame the first time that it is touched.
+
+    - address: Any 32-bit address in the kernel address space.
+
+ RETURNS:
+    kPAGE_ALLOC_OK if the page was reserved.
+    kPAGE_ALLOC_ERROR if the page is already in use.
+ */
+int kpage_reserve(uintptr_t address);
+
+/**
+ Make the page at the specified address a guard page. It is never mapped, and
+ touching it is reported as an overflow of the region next to it.
+
+    - address: Any 32-bit address in the kernel address space.
+
+ RETURNS:
+    kPAGE_ALLOC_OK if the guard page was placed.
+    kPAGE_ALLOC_ERROR if the page is already in use.
+ */
+int kpage_guard(uintptr_t address);
+
+/**
+ Reports whether 4MiB pages are supported and enabled.
+ */
+int kpage_large_available(void);
+
+/**
+ Attempt to allocate a 4MiB page at the specified address, backed by newly
+ allocated, physically contiguous frames. There must be nothing mapped in the
+ 4MiB region.
+
+    - address: A 4MiB aligned address.
+
+ RETURNS:
+    kPAGE_ALLOC_OK if the allocation was successful.
+    kPAGE_ALLOC_ERROR if the allocation could not be completed.
+ */
+int kpage_alloc_large(uintptr_t address);
+
+/**
+ Map the 4MiB region at the specified address to the physical memory at the
+ specified frame with a single 4MiB page. If the region already has a page 
+ table, every page in it must map the same physical memory as the 4MiB page 
+ will, and the page table is freed. The frames are not owned by the mapping, 
+ and are not freed when it is.
+
+    - address: A 4MiB aligned address.
+    - frame: A 4MiB aligned physical address.
+
+ RETURNS:
+    kPAGE_ALLOC_OK if the mapping was successful.
+    kPAGE_ALLOC_ERROR if the mapping could not be completed.
+ */
+int kpage_map_large(uintptr_t address, uintptr_t frame);
+
+/**
+ Map the registers of a device into the kernel address space as uncached. The
+ frames are not owned by the mapping, and it must never be passed to kpage_free.
+
+    - frame: The physical address of the registers.
+    - length: The length of the registers in bytes.
+
+ RETURNS:
+    The kernel address at which the specified physical address can be reached.
+ */
+uintptr_t kpage_map_device(uintptr_t frame, uint32_t length);
+
+/**
+ Reports the physical address that the specified address is mapped to.
+
+    - address: Any 32-bit address.
+
+ RETURNS:
+    The physical address, or 0 if the address is not mapped.
+ */
+uintptr_t kpage_physical_address(uintptr_t address);
+
+/**
+ Set the memory type of every page overlapping the specified range. If the CPU
+ has no Page Attribute Table, write-combining is instead requested through an
+ MTRR, which requires the range to be physically contiguous.
+
+    - address: The first address of the range.
+    - length: The length of the range in bytes.
+    - mode: The memory type to use.
+
+ RETURNS:
+    kPAGE_ALLOC_OK if the memory type was set.
+    kPAGE_ALLOC_ERROR if part of the range is not mapped, or the memory type
+    could not be set.
+ */
+int kpage_set_cache_mode(uintptr_t address, uint32_t length, enum cache_mode mode);
+
 /**
  Free the page at the specified address, and return it to the VMM to reallocate.
+ The page is unmapped, its TLB entry invalidated and its frame returned to the
+ physical memory manager. Reserved and guard pages are released. Unmapped pages
+ are ignored.
 
     - address: Any 32-bit address
+ 
+ A 4MiB page is freed in its entirety when its first address is given. Other
+ addresses within a 4MiB page are ignored.
  */
 void kpage_free(uintptr_t address);
 
+/**
+ Unmap the page at the specified address and return its frame to the physical
+ memory manager, but keep the address reserved so that it is not handed out
+ again. The page can later be restored with kpage_alloc. Pages within a 4MiB
+ page are ignored.
+
+    - address: Any 32-bit address
+ */
+void kpage_decommit(uintptr_t address);
+
+/**
+ Temporarily map a physical frame into the kernel, so that it can be read or
+ written without being part of any address space. Only a small number of slots
+ exist on each CPU, and each mapping must be released with kunmap as soon as 
+ possible. Preemption is disabled until then, so the holder must not sleep.
+
+    - frame: The physical address of a frame.
+
+ RETURNS:
+    The kernel address at which the frame can be reached.
+ */
+void *kmap(uintptr_t frame);
+
+/**
+ Release a temporary mapping made by kmap.
+
+    - ptr: The address returned by kmap.
+ */
+void kunmap(void *ptr);
+
+/**
+ Attempt to resolve a page fault at the specified address in the current
+ address space. Reserved kernel pages are backed with a zeroed frame on first 
+ touch, and stale kernel directory entries are refreshed. Every fault is 
+ counted by its cause.
+
+    - address: The address that caused the fault.
+    - error: The error code pushed by the CPU for the fault.
+
+ RETURNS:
+    kPAGE_ALLOC_OK if the fault was resolved and the access can be retried.
+    kPAGE_ALLOC_ERROR if the fault is genuine.
+ */
+int kpage_fault(uintptr_t address, uint32_t error);
+
+/**
+ Copy the page fault counters into the specified structure.
+
+    - stats: The structure to populate.
+ */
+void kpage_fault_stats(struct page_fault_statistics *stats);
+
+/**
+ Write the page fault counters to the debug output (COM1).
+ */
+void kpage_dump_fault_stats(void);
+
+/**
+ Reports the address space of the kernel. Kernel processes share it.
+ */
+struct virtual_address_space *address_space_get_kernel(void);
+
+/**
+ Reports the address space that is currently in use by the CPU.
+ */
+struct virtual_address_space *address_space_get_current(void);
+
+/**
+ Create a new address space for a process. The kernel half is shared with the
+ kernel, as are the low memory mappings made by the boot loader. The rest of the
+ user half is empty.
+
+ RETURNS:
+    The new address space.
+ */
+struct virtual_address_space *address_space_create(void);
+
+/**
+ Destroy the specified address space, releasing every page in the user half and
+ the page tables. The address space must not be in use.
+
+    - space: The address space of a process.
+ */
+void address_space_destroy(struct virtual_address_space *space);
+
+/**
+ Switch the CPU to the specified address space.
+
+    - space: The address space to switch to.
+ */
+void address_space_switch(struct virtual_address_space *space);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,101 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#ifndef __VKERNEL_WAIT_QUEUE__
+#define __VKERNEL_WAIT_QUEUE__
+
+#include <stdint.h>
+#include <spinlock.h>
+
+struct task;
+
+// Threads waiting for an event are blocked off the run queues, and are linked
+// into the wait queue for the event instead. The producer of the event wakes
+// them directly. Each wait queue has its own lock, which is taken with
+// interrupts disabled as events are often produced by interrupt handlers.
+struct wait_queue
+{
+	struct spinlock lock;
+	struct task *first;
+	struct task *last;
+};
+
+/**
+ Initialise an empty wait queue. A zero filled wait queue is also empty.
+ */
+void wait_queue_init(struct wait_queue *queue);
+
+/**
+ Block the current thread and add it to the specified wait queue. The thread
+ continues to execute until it is next switched out, so wait_queue_sleep must 
+ be called afterwards. The lock of the wait queue must be held, with interrupts
+ disabled. A thread that has been killed is not added.
+ */
+void wait_queue_join(struct wait_queue *queue);
+
+/**
+ Halt until the current thread has been woken from the wait queue that it
+ joined. Returns immediately if the thread is not waiting.
+ */
+void wait_queue_sleep(void);
+
+/**
+ Remove the specified task from the wait queue that it is waiting in, without
+ waking it. This is used when a waiting task is killed. The lock of the wait
+ queue is taken, so the lock of a run queue must not be held.
+ */
+void wait_queue_remove(struct wait_queue *queue, struct task *task);
+
+/**
+ Wake the first thread in the specified wait queue.
+
+ RETURNS:
+ 	1 if a thread was woken, or 0 if the queue was empty.
+ */
+int wake_one(struct wait_queue *queue);
+
+/**
+ Wake every thread in the specified wait queue.
+
+ RETURNS:
+ 	The number of threads that were woken.
+ */
+uint32_t wake_all(struct wait_queue *queue);
+
+/**
+ Block the current thread on the specified wait queue until the condition is
+ true. The condition is checked again under the lock of the wait queue before
+ blocking. A producer makes the condition true before it wakes the queue, which
+ takes the same lock, so the wake up can not be missed.
+ */
+#define wait_event(__queue, __condition) \
+	do { \
+		while (!(__condition)) { \
+			irq_flags_t __wait_flags = spin_lock_irqsave(&(__queue)->lock); \
+			if (!(__condition)) \
+				wait_queue_join(__queue); \
+			spin_unlock_irqrestore(&(__queue)->lock, __wait_flags); \
+			wait_queue_sleep(); \
+		} \
+	} while (0)
+
+#endif
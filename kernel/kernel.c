@@ -78,6 +78,7 @@ __attribute__((noreturn)) void kmain(
 	// Attempt to install each of the integral device drivers.
 	keyboard_driver_prepare();
 	pit_prepare();
+	tsc_prepare();
 
 	// Prepare the VESA drawing layer if required
 	if (config->vesa_mode == vesa_mode_text) {
@@ -90,6 +91,9 @@ __attribute__((noreturn)) void kmain(
 
 	// Establish multitasking and processes
 	process_prepare();
+
+	// Bring up any other CPUs. Each joins the scheduler as soon as it starts.
+	smp_prepare(config);
 	
 	kwork();
 }
\ No newline at end of file
@@ -31,36 +31,192 @@
 
 #define kPAGE_SIZE	0x1000
 
-#define kHEAP_COLLECT_FAIL	0
-#define kHEAP_COLLECT_OK 	1
+#define kHEAP_GRANULE		16
+#define kHEAP_BIN_COUNT		32
+#define kHEAP_ARENA_MAGIC	0xA7E4A7E4
 
 #define kHEAP_SPLIT_FAIL	0
 #define kHEAP_SPLIT_OK 		1
 
+#define kSLAB_SPACE_BASE	0xC0000000
+#define kSLAB_SPACE_PAGES	((0 - kSLAB_SPACE_BASE) / kPAGE_SIZE)
+// Slabs are a single page with their header at the start, and objects are
+// aligned to their size. A 2048 byte class would only fit one object after the
+// header, wasting half of every page, so larger sizes use the free lists.
+#define kSLAB_MIN_SHIFT		4	// 16 bytes
+#define kSLAB_MAX_SHIFT		10	// 1024 bytes
+#define kSLAB_CLASS_COUNT	(kSLAB_MAX_SHIFT - kSLAB_MIN_SHIFT + 1)
+#define kSLAB_MAX_SIZE		(1 << kSLAB_MAX_SHIFT)
+
+#ifndef kHEAP_PROFILE_RATE
+#	define kHEAP_PROFILE_RATE	0	// Disabled by default
+#endif
+
+#define kHEAP_PROFILE_SLOTS	64
+
+#ifndef kHEAP_TRIM_THRESHOLD
+#	define kHEAP_TRIM_THRESHOLD	(64 * 1024)	// Free bytes kept before trimming
+#endif
+
+#define kHEAP_MAX_CPUS		kMAX_CPUS
+#define kMAGAZINE_ROUNDS	14
+#define kDEPOT_MAX_FULL		8
+
 ////////////////////////////////////////////////////////////////////////////////
 
+// Every heap block is followed immediately by a boundary tag that mirrors its
+// header. This allows the physically preceding block of any block to be found
+// in constant time when coalescing.
+struct kheap_tag {
+	uint32_t magic;
+	size_t size;
+} __attribute__((packed));
+
+// Free blocks store their free list linkage at the start of their payload. The
+// minimum block size guarantees there is always space for this.
+struct kheap_links {
+	struct kheap_block *prev;
+	struct kheap_block *next;
+};
+
+// An arena is a contiguous run of pages that has been given to the heap. The
+// arena header ends with a fence tag, and the final bytes of the arena hold a
+// fence header. These stop coalescing from walking off either end.
+struct kheap_arena {
+	uint32_t magic;
+	struct kheap_arena *next;
+	size_t size;
+	uint32_t reserved;
+	struct kheap_tag fence;
+} __attribute__((packed));
+
+// A slab is a single page that has been carved into equally sized objects of a
+// single size class. The header lives at the start of the page, which allows
+// the owning slab of any object to be found by masking the object address.
+// Which kernel pages are slabs is recorded separately in slab_page_map, as
+// nothing stored in the page itself can be told apart from the contents of a
+// heap block that happens to start there.
+struct kslab {
+	struct kslab_cache *cache;
+	struct kslab *prev;
+	struct kslab *next;
+	void *free;
+	uint32_t in_use;
+	uint32_t capacity;
+};
+
+// Each size class keeps a list of the slabs that still have free objects in
+// them. Full slabs are removed from the list and reinserted once an object is
+// returned to them.
+struct kslab_cache {
+	size_t object_size;
+	struct kslab *partial;
+};
+
+// A magazine is a small stack of free objects belonging to a single size class.
+// Each CPU holds a loaded and a previous magazine per class, and only goes to
+// the shared depot once both are exhausted (or both are full).
+struct kmagazine {
+	struct kmagazine *next;
+	uint32_t rounds;
+	void *objects[kMAGAZINE_ROUNDS];
+};
+
+struct kmagazine_cache {
+	struct kmagazine *loaded;
+	struct kmagazine *previous;
+};
+
+// The depot is the shared store of full and empty magazines for a size class.
+// Its lock also covers the slabs of the class, so CPUs working on different
+// classes never contend with each other.
+struct kmagazine_depot {
+	struct spinlock lock;
+	struct kmagazine *full;
+	struct kmagazine *empty;
+	uint32_t full_count;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uintptr_t kheap_map_pages(uint32_t pages);
+static uintptr_t kheap_reserve_pages(uint32_t pages);
+static uintptr_t kheap_reserve_pages(uint32_t pages)
+{
+	// The pages are only claimed here, and are backed by the page fault 
+	// handler when they are first touched.
+	uintptr_t first_page = find_available_contiguous_kernel_pages(pages);
+	for (uint32_t n = 0; n < pages; ++n) {
+		if (kpage_reserve(first_page + (kPAGE_SIZE * n)) == kPAGE_ALLOC_ERROR) {
+			struct panic_info info = (struct panic_info) {
+				panic_memory,
+				"UNABLE TO EXPAND KERNEL HEAP",
+				"The kernel heap could not be expanded correctly."
+			};
+			panic(&info, NULL);
+		}
+	}
+
+	return first_page;
+}
+
+static uintptr_t kheap_map_large_pages(uint32_t pages);
 static struct kheap_block *kheap_expand(size_t size);
 static struct kheap_block *kheap_expand_pages(uint32_t pages);
 static struct kheap_block *kheap_make_block(
-	uintptr_t raw_address, 
-	size_t raw_size
+	uintptr_t address, 
+	size_t size,
+	uint32_t magic
 );
 static void kheap_describe_block(struct kheap_block *block);
 static void kheap_describe_structure(void);
-static int kheap_collect_block(
-	struct kheap_block *dst, 
-	struct kheap_block *src
-);
+static struct kheap_block *kheap_collect_block(struct kheap_block *block);
 static int kheap_split_block(
 	struct kheap_block *block, 
 	size_t real_size
 );
 static struct kheap_block *kheap_allocate_block(size_t size);
+static struct kheap_block *kheap_allocate_aligned_block(
+	size_t size,
+	size_t align
+);
+static struct kheap_block *kheap_trim_block(struct kheap_block *block);
+static void kheap_bin_insert(struct kheap_block *block);
+static void kheap_bin_remove(struct kheap_block *block);
+static struct kheap_block *kheap_bin_find(size_t size);
+static inline struct kheap_links *kheap_block_links(struct kheap_block *block);
+static uint32_t kslab_class_for_size(size_t size);
+static void *kslab_alloc(uint32_t class);
+static struct kslab *kslab_owner(void *ptr);
+static void kslab_free(struct kslab *slab, void *ptr);
+static void *kmagazine_alloc(uint32_t class);
+static void kmagazine_free(uint32_t class, void *ptr);
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static struct kheap_block *heap_first = NULL;
-static struct kheap_block *heap_last = NULL;
+static struct kheap_arena *heap_first = NULL;
+static struct kheap_arena *heap_last = NULL;
+static struct kheap_block *heap_bins[kHEAP_BIN_COUNT] = { NULL };
+static uint32_t heap_bin_map = 0;
+static struct spinlock heap_lock = { 0 };
+static struct kslab_cache slab_caches[kSLAB_CLASS_COUNT] = {
+	{ 16, NULL },
+	{ 32, NULL },
+	{ 64, NULL },
+	{ 128, NULL },
+	{ 256, NULL },
+	{ 512, NULL },
+	{ 1024, NULL },
+};
+static uint32_t slab_page_map[kSLAB_SPACE_PAGES / 32] = { 0 };
+static struct kmagazine_cache magazine_caches[kHEAP_MAX_CPUS][kSLAB_CLASS_COUNT];
+static struct kmagazine_depot magazine_depots[kSLAB_CLASS_COUNT];
+
+static struct kheap_statistics heap_stats = { 0 };
+static uint32_t profile_rate = kHEAP_PROFILE_RATE;
+static volatile uint32_t profile_countdown = kHEAP_PROFILE_RATE;
+static volatile uint32_t profile_next = 0;
+static struct kheap_sample profile_ring[kHEAP_PROFILE_SLOTS] = { { 0 } };
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -71,8 +227,167 @@ void kheap_dump_structure(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static inline uint32_t kheap_fetch_add(volatile uint32_t *x, uint32_t v)
+{
+	__asm__ __volatile__(
+		"lock;"
+		"xaddl %0, %1"
+		: "+r"(v), "+m"(*x)
+		:
+		: "memory"
+	);
+	return v;
+}
+
+static inline void kheap_fetch_or(volatile uint32_t *x, uint32_t v)
+{
+	__asm__ __volatile__(
+		"lock;"
+		"orl %1, %0"
+		: "+m"(*x)
+		: "r"(v)
+		: "memory"
+	);
+}
+
+static void kheap_record_alloc(size_t size, uintptr_t caller)
+{
+	// The slab path records allocations without holding the heap lock, so the
+	// shared counters are updated with locked instructions.
+	kheap_fetch_add((volatile uint32_t *)&heap_stats.bytes_in_use, size);
+	uint32_t sequence = kheap_fetch_add(&heap_stats.allocations, 1) + 1;
+
+	// Sample one in every profile_rate allocations into the profiling ring.
+	if (profile_rate == 0 || kheap_fetch_add(&profile_countdown, -1) != 1)
+		return;
+	profile_countdown = profile_rate;
+
+	uint32_t slot = kheap_fetch_add(&profile_next, 1) % kHEAP_PROFILE_SLOTS;
+	struct kheap_sample *sample = &profile_ring[slot];
+	sample->caller = caller;
+	sample->size = size;
+	sample->sequence = sequence;
+}
+
+static void kheap_record_free(size_t size)
+{
+	kheap_fetch_add((volatile uint32_t *)&heap_stats.bytes_in_use, -size);
+	kheap_fetch_add(&heap_stats.frees, 1);
+}
+
+static void kheap_collect_stats(struct kheap_statistics *stats)
+{
+	*stats = heap_stats;
+
+	// The largest free block is always in the highest non-empty bin, so only
+	// that bin ever needs to be looked at.
+	stats->largest_free_block = 0;
+	if (heap_bin_map) {
+		uint32_t bin;
+		__asm__("bsrl %1, %0" : "=r"(bin) : "rm"(heap_bin_map));
+		struct kheap_block *block = heap_bins[bin];
+		while (block) {
+			if (block->size > stats->largest_free_block)
+				stats->largest_free_block = block->size;
+			block = kheap_block_links(block)->next;
+		}
+	}
+}
+
+void kheap_stats(struct kheap_statistics *stats)
+{
+	if (!stats)
+		return;
+
+	irq_flags_t flags = spin_lock_irqsave(&heap_lock);
+	kheap_collect_stats(stats);
+	spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+void kheap_profile_set_rate(uint32_t rate)
+{
+	profile_rate = rate;
+	profile_countdown = rate;
+}
+
+uint32_t kheap_profile_samples(struct kheap_sample *samples, uint32_t count)
+{
+	// Copy out the most recent samples, oldest first.
+	uint32_t available = profile_next < kHEAP_PROFILE_SLOTS 
+					   ? profile_next 
+					   : kHEAP_PROFILE_SLOTS;
+	if (count > available)
+		count = available;
+
+	for (uint32_t n = 0; n < count; ++n) {
+		uint32_t slot = (profile_next - count + n) % kHEAP_PROFILE_SLOTS;
+		samples[n] = profile_ring[slot];
+	}
+
+	return count;
+}
+
+void kheap_dump_stats(void)
+{
+	// A panic may have been raised by the heap itself, with the lock held.
+	struct kheap_statistics stats;
+	irq_flags_t flags = irq_save();
+	if (spin_try_lock(&heap_lock)) {
+		kheap_collect_stats(&stats);
+		spin_unlock(&heap_lock);
+	}
+	else {
+		stats = heap_stats;
+		stats.largest_free_block = 0;
+	}
+	irq_restore(flags);
+
+	fprintf(dbgout, "=== Kernel Heap Statistics ===\n");
+	fprintf(dbgout, "  in use: %d bytes, free: %d bytes (largest %d bytes)\n",
+		stats.bytes_in_use, stats.bytes_free, stats.largest_free_block);
+	fprintf(dbgout, "  blocks: %d allocated, %d free\n",
+		stats.block_count, stats.free_block_count);
+	fprintf(dbgout, "  allocations: %d, frees: %d\n",
+		stats.allocations, stats.frees);
+	fprintf(dbgout, "  expansions: %d (%d pages), slab pages: %d\n",
+		stats.expansions, stats.pages_mapped, stats.slab_pages);
+	fprintf(dbgout, "  released: %d pages (%d from punched holes)\n",
+		stats.pages_released, stats.pages_punched);
+	fprintf(dbgout, "  splits: %d, coalesces: %d\n",
+		stats.splits, stats.coalesces);
+
+	if (profile_rate == 0)
+		return;
+
+	struct kheap_sample samples[kHEAP_PROFILE_SLOTS];
+	uint32_t count = kheap_profile_samples(samples, kHEAP_PROFILE_SLOTS);
+	fprintf(dbgout, "  profile (1 in %d allocations):\n", profile_rate);
+	for (uint32_t n = 0; n < count; ++n) {
+		fprintf(dbgout, "    #%d: %d bytes from %p\n", 
+			samples[n].sequence, samples[n].size, samples[n].caller);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 void *kalloc(size_t size)
 {
+	// Small allocations are served from the magazine and slab caches, which
+	// avoids having to walk the free lists entirely.
+	uintptr_t caller = (uintptr_t)__builtin_return_address(0);
+	if (size <= kSLAB_MAX_SIZE) {
+		uint32_t class = kslab_class_for_size(size);
+		kheap_record_alloc(slab_caches[class].object_size, caller);
+		return kmagazine_alloc(class);
+	}
+
+	// Round the size up to the heap granularity. This keeps every header in
+	// the heap at the same alignment.
+	size = (size + kHEAP_GRANULE - 1) & ~(kHEAP_GRANULE - 1);
+
+	// The free lists are shared by every CPU.
+	irq_flags_t flags = spin_lock_irqsave(&heap_lock);
+
 	struct kheap_block *block = kheap_allocate_block(size);
 	if (!block) {
 		struct panic_info info = (struct panic_info) {
@@ -86,15 +401,117 @@ void *kalloc(size_t size)
 
 	// Calculate the absolute start of the allocated memory.
 	uintptr_t address = (uintptr_t)block + sizeof(*block);
+	kheap_record_alloc(block->size, caller);
+	heap_stats.block_count++;
+	spin_unlock_irqrestore(&heap_lock, flags);
 	// fprintf(dbgout, "Allocated memory (%d bytes) at %p\n", size, address);
 
 	return (void *)address;
 }
 
+void *kalloc_aligned(size_t size, size_t align)
+{
+	// The alignment must be a power of two. Anything at or below the natural
+	// heap alignment can be treated as a regular allocation.
+	if (align == 0 || (align & (align - 1)) != 0) {
+		struct panic_info info = (struct panic_info) {
+			panic_memory,
+			"INVALID ALLOCATION ALIGNMENT",
+			"The kernel requested memory with an alignment that is not a power "
+			"of two.\n"
+		};
+		panic(&info, NULL);
+	}
+	else if (align <= kHEAP_GRANULE) {
+		return kalloc(size);
+	}
+
+	// Slab objects are naturally aligned to their size class, so requesting
+	// an object of at least the alignment is sufficient.
+	uintptr_t caller = (uintptr_t)__builtin_return_address(0);
+	if (size <= kSLAB_MAX_SIZE && align <= kSLAB_MAX_SIZE) {
+		uint32_t class = kslab_class_for_size(size > align ? size : align);
+		kheap_record_alloc(slab_caches[class].object_size, caller);
+		return kmagazine_alloc(class);
+	}
+
+	size = (size + kHEAP_GRANULE - 1) & ~(kHEAP_GRANULE - 1);
+
+	irq_flags_t flags = spin_lock_irqsave(&heap_lock);
+
+	struct kheap_block *block = kheap_allocate_aligned_block(size, align);
+	if (!block) {
+		struct panic_info info = (struct panic_info) {
+			panic_memory,
+			"UNABLE TO ALLOCATE MEMORY",
+			"The kernel was unable to allocate the requested amount of aligned "
+			"memory on the kernel heap.\n"
+		};
+		panic(&info, NULL);
+	}
+
+	kheap_record_alloc(block->size, caller);
+	heap_stats.block_count++;
+	spin_unlock_irqrestore(&heap_lock, flags);
+	return (void *)((uintptr_t)block + sizeof(*block));
+}
+
+void *kalloc_pages(uint32_t pages)
+{
+	// Page allocations bypass the heap entirely and carry no header. The
+	// caller is responsible for remembering how many pages were requested.
+	if (pages >= kLARGE_PAGE_PAGES && kpage_large_available())
+		return (void *)kheap_map_large_pages(pages);
+	return (void *)kheap_map_pages(pages);
+}
+
+void kfree_pages(void *ptr, uint32_t pages)
+{
+	uintptr_t address = (uintptr_t)ptr;
+	for (uint32_t n = 0; n < pages; ++n)
+		kpage_free(address + (n * kPAGE_SIZE));
+}
+
+void *kalloc_stack(uint32_t pages)
+{
+	// Stacks grow downwards, so the guard page goes below the stack. The stack
+	// itself is backed up front, as the CPU can not push the frame of a page
+	// fault onto a stack page that is not there. Only the guard page faults.
+	uintptr_t guard = find_available_contiguous_kernel_pages(pages + 1);
+	if (kpage_guard(guard) == kPAGE_ALLOC_ERROR) {
+		fprintf(dbgout, "WARNING: Unable to place the guard page of a stack.\n");
+		return NULL;
+	}
+
+	for (uint32_t n = 1; n <= pages; ++n) {
+		if (kpage_alloc(guard + (kPAGE_SIZE * n)) == kPAGE_ALLOC_ERROR) {
+			fprintf(dbgout, "WARNING: Unable to back the pages of a stack.\n");
+			kfree_pages((void *)guard, n);
+			return NULL;
+		}
+	}
+
+	return (void *)(guard + kPAGE_SIZE);
+}
+
+void kfree_stack(void *ptr, uint32_t pages)
+{
+	kfree_pages((void *)((uintptr_t)ptr - kPAGE_SIZE), pages + 1);
+}
+
 void kfree(void *ptr)
 {
 	// fprintf(dbgout, "Attempting to free memory at pointer: %p\n", ptr);
 
+	// Check if the pointer belongs to a slab first. If it does then it is
+	// returned to the magazine layer and there is nothing further to do.
+	struct kslab *slab = kslab_owner(ptr);
+	if (slab) {
+		kheap_record_free(slab->cache->object_size);
+		kmagazine_free(slab->cache - slab_caches, ptr);
+		return;
+	}
+
 	// Make sure we're attempting to free a valid memory pointer. Warn if we're
 	// not.
 	uintptr_t address = (uintptr_t)ptr - sizeof(struct kheap_block);
@@ -105,28 +522,127 @@ void kfree(void *ptr)
 		return;
 	}
 
-	// Mark the region as free, and then attempt to collect it with the previous
-	// region and next region.
-	block->magic = kHEAP_AVAIL_MAGIC;
-	void *prev = block->prev;
-	void *next = block->next;
+	// Mark the region as free, collect it with its physical neighbours and
+	// then place the result in to the appropriate free list.
+	irq_flags_t flags = spin_lock_irqsave(&heap_lock);
+
+	kheap_record_free(block->size);
+	heap_stats.block_count--;
+	block = kheap_make_block(address, block->size, kHEAP_AVAIL_MAGIC);
+	block = kheap_trim_block(kheap_collect_block(block));
+	if (block)
+		kheap_bin_insert(block);
+
+	spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline struct kheap_tag *kheap_block_tag(struct kheap_block *block)
+{
+	return (void *)((uintptr_t)block + sizeof(*block) + block->size);
+}
+
+static inline struct kheap_block *kheap_block_next(struct kheap_block *block)
+{
+	return (void *)((uintptr_t)kheap_block_tag(block) + sizeof(struct kheap_tag));
+}
+
+static inline struct kheap_block *kheap_block_prev(struct kheap_block *block)
+{
+	struct kheap_tag *tag = (void *)((uintptr_t)block - sizeof(*tag));
+	return (void *)((uintptr_t)tag - tag->size - sizeof(*block));
+}
+
+static inline struct kheap_links *kheap_block_links(struct kheap_block *block)
+{
+	return (void *)((uintptr_t)block + sizeof(*block));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline uint32_t kheap_bin_for_size(size_t size)
+{
+	// Bins are bucketed by powers of two, so bin n holds every free block
+	// whose size is in the range [2^n, 2^(n+1)).
+	uint32_t bin;
+	__asm__("bsrl %1, %0" : "=r"(bin) : "rm"(size));
+	return bin;
+}
+
+static void kheap_bin_insert(struct kheap_block *block)
+{
+	uint32_t bin = kheap_bin_for_size(block->size);
+	struct kheap_links *links = kheap_block_links(block);
+
+	links->prev = NULL;
+	links->next = heap_bins[bin];
+	if (heap_bins[bin])
+		kheap_block_links(heap_bins[bin])->prev = block;
+	heap_bins[bin] = block;
+
+	heap_bin_map |= (1U << bin);
+	heap_stats.bytes_free += block->size;
+	heap_stats.free_block_count++;
+}
+
+static void kheap_bin_remove(struct kheap_block *block)
+{
+	uint32_t bin = kheap_bin_for_size(block->size);
+	struct kheap_links *links = kheap_block_links(block);
+
+	if (links->prev)
+		kheap_block_links(links->prev)->next = links->next;
+	else
+		heap_bins[bin] = links->next;
+
+	if (links->next)
+		kheap_block_links(links->next)->prev = links->prev;
+
+	if (!heap_bins[bin])
+		heap_bin_map &= ~(1U << bin);
+	heap_stats.bytes_free -= block->size;
+	heap_stats.free_block_count--;
+}
+
+static struct kheap_block *kheap_bin_find(size_t size)
+{
+	// The bin matching the size may contain blocks that are too small, so it
+	// is the only one that needs searching.
+	uint32_t bin = kheap_bin_for_size(size);
+	struct kheap_block *block = heap_bins[bin];
+	while (block) {
+		if (block->size >= size)
+			return block;
+		block = kheap_block_links(block)->next;
+	}
+
+	// Every block in a higher bin is large enough. Take the smallest non-empty
+	// bin above the requested one.
+	uint32_t larger = (bin + 1 < kHEAP_BIN_COUNT) 
+					? heap_bin_map & ~((2U << bin) - 1)
+					: 0;
+	if (!larger)
+		return NULL;
 
-	kheap_collect_block(prev, block);
-	kheap_collect_block(prev ?: block, next);
+	__asm__("bsfl %1, %0" : "=r"(bin) : "rm"(larger));
+	return heap_bins[bin];
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 static struct kheap_block *kheap_expand(size_t size)
 {
-	uint32_t pages = ((size + kPAGE_SIZE) & ~(kPAGE_SIZE - 1)) >> 12;
+	// Account for the block header and tag, as well as the arena header and
+	// fence in case the expansion can not be merged with the previous arena.
+	size += sizeof(struct kheap_block) + sizeof(struct kheap_tag)
+		  + sizeof(struct kheap_arena) + sizeof(struct kheap_block);
+	uint32_t pages = (size + kPAGE_SIZE - 1) / kPAGE_SIZE;
 	return kheap_expand_pages(pages);
 }
 
-static struct kheap_block *kheap_expand_pages(uint32_t pages)
+static uintptr_t kheap_map_pages(uint32_t pages)
 {
-	// fprintf(dbgout, "Expanding kernel heap by %d page(s).\n", pages);
-
 	uintptr_t first_page = find_available_contiguous_kernel_pages(pages);
 	// fprintf(dbgout, "	* Starting at page address %p\n", first_page);
 
@@ -145,67 +661,118 @@ static struct kheap_block *kheap_expand_pages(uint32_t pages)
 		}
 	}
 
-	// Configure the newly allocated pages correctly.
-	// fprintf(dbgout, "   * Configuring newly allocated pages for heap use.\n");
+	return first_page;
+}
 
-	uintptr_t raw_address = first_page;
-	size_t raw_size = pages * kPAGE_SIZE;
-	// fprintf(dbgout, "      Raw address: %p, Raw size: %d bytes\n",
-	// 	raw_address, raw_size);
+static uintptr_t kheap_map_large_pages(uint32_t pages)
+{
+	// Map as much of the range as possible with 4MiB pages, falling back to
+	// 4KiB pages for the remainder, or if contiguous frames run out.
+	uintptr_t first_page = find_available_aligned_kernel_pages(
+		pages, kLARGE_PAGE_PAGES
+	);
 
-	struct kheap_block *block = kheap_make_block(raw_address, raw_size);
+	uint32_t n = 0;
+	while (n < pages) {
+		uintptr_t address = first_page + (kPAGE_SIZE * n);
+		if (pages - n >= kLARGE_PAGE_PAGES 
+			&& kpage_alloc_large(address) == kPAGE_ALLOC_OK
+		) {
+			n += kLARGE_PAGE_PAGES;
+			continue;
+		}
 
-	// Add the newly constructed block into the heap chain. If this is the first
-	// block, then mark it as such.
-	if (!heap_first) {
-		// fprintf(dbgout, "   * No first block in kernel heap. Setting it.\n");
-		heap_first = heap_last = block;
+		if (kpage_alloc(address) == kPAGE_ALLOC_ERROR) {
+			struct panic_info info = (struct panic_info) {
+				panic_memory,
+				"UNABLE TO MAP KERNEL PAGES",
+				"The kernel was unable to map the requested pages."
+			};
+			panic(&info, NULL);
+		}
+		n++;
 	}
 
-	// Attempt to collect the block into the current last block. If the 
-	// operation is successful, the report it and finish.
-	else if (kheap_collect_block(heap_last, block) == kHEAP_COLLECT_OK) {
-		// fprintf(dbgout, "   * Collecting block into previous last block.\n");
-		block = heap_last;
+	return first_page;
+}
+
+static struct kheap_block *kheap_expand_pages(uint32_t pages)
+{
+	// fprintf(dbgout, "Expanding kernel heap by %d page(s).\n", pages);
+	// Only the pages holding the arena and block headers are touched here.
+	// The rest of the expansion is backed as the allocations use it.
+	uintptr_t first_page = kheap_reserve_pages(pages);
+	size_t raw_size = pages * kPAGE_SIZE;
+	heap_stats.expansions++;
+	heap_stats.pages_mapped += pages;
+	struct kheap_block *block = NULL;
+
+	// If the new pages directly follow the last arena, then the arena can be
+	// extended. The old fence header becomes the header of the new block.
+	if (heap_last && first_page == (uintptr_t)heap_last + heap_last->size) {
+		uintptr_t address = first_page - sizeof(struct kheap_block);
+		block = kheap_make_block(
+			address,
+			raw_size - sizeof(struct kheap_tag) - sizeof(struct kheap_block),
+			kHEAP_AVAIL_MAGIC
+		);
+		heap_last->size += raw_size;
 	}
 
-	// If we hit this point, then we have a new last block in the heap chain.
-	// Update accordingly.
+	// Otherwise the pages form a brand new arena. 
 	else {
-		// The previous block link should be to the current last block in the
-		// chain, and the next should be NULL.
-		block->prev = heap_last;
-		block->next = NULL;
+		struct kheap_arena *arena = (void *)first_page;
+		arena->magic = kHEAP_ARENA_MAGIC;
+		arena->next = NULL;
+		arena->size = raw_size;
+		arena->reserved = 0;
+		arena->fence.magic = kHEAP_FENCE_MAGIC;
+		arena->fence.size = 0;
+
+		block = kheap_make_block(
+			first_page + sizeof(*arena),
+			raw_size - sizeof(*arena) - sizeof(struct kheap_block)
+					 - sizeof(struct kheap_tag) - sizeof(struct kheap_block),
+			kHEAP_AVAIL_MAGIC
+		);
 
-		// If there is a current last block in the chain, then update its next
-		// link to this new block.
 		if (heap_last)
-			heap_last->next = block;
-
-		// Mark the current last block as the new block.
-		heap_last = block;
+			heap_last->next = arena;
+		else
+			heap_first = arena;
+		heap_last = arena;
 	}
-	
-	// Return the block to the caller.
-	// fprintf(dbgout, "***\n");
-	return block;
+
+	// Place the fence header at the very end of the arena.
+	struct kheap_block *fence = kheap_block_next(block);
+	fence->magic = kHEAP_FENCE_MAGIC;
+	fence->size = 0;
+
+	// Attempt to collect the block into the previous block, in case it was
+	// free at the end of an extended arena.
+	return kheap_collect_block(block);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 static void kheap_describe_block(struct kheap_block *block)
 {
-	printf("HEAP-BLOCK:: %08X | %p <- %p -> %p | %d bytes\n",
-		block->magic, block->prev, block, block->next, block->size);
+	printf("HEAP-BLOCK:: %08X | %p | %d bytes\n",
+		block->magic, block, block->size);
 }
 
 static void kheap_describe_structure(void)
 {
 	fprintf(dbgout, "===============\n");
-	struct kheap_block *block = heap_first;
-	while (block) {
-		kheap_describe_block(block);
-		block = block->next;
+	struct kheap_arena *arena = heap_first;
+	while (arena) {
+		printf("HEAP-ARENA:: %p | %d bytes\n", arena, arena->size);
+		struct kheap_block *block = (void *)((uintptr_t)arena + sizeof(*arena));
+		while (block->magic != kHEAP_FENCE_MAGIC) {
+			kheap_describe_block(block);
+			block = kheap_block_next(block);
+		}
+		arena = arena->next;
 	}
 	fprintf(dbgout, "===============\n");
 }
@@ -213,165 +780,556 @@ static void kheap_describe_structure(void)
 ////////////////////////////////////////////////////////////////////////////////
 
 static struct kheap_block *kheap_make_block(
-	uintptr_t raw_address, 
-	size_t raw_size
+	uintptr_t address, 
+	size_t size,
+	uint32_t magic
 ) {
-	struct kheap_block *block = (void *)raw_address;
-	size_t block_header_size = sizeof(*block);
-	size_t block_real_size = raw_size - block_header_size;
+	struct kheap_block *block = (void *)address;
+	block->magic = magic;
+	block->size = size;
+
+	struct kheap_tag *tag = kheap_block_tag(block);
+	tag->magic = magic;
+	tag->size = size;
+
+	return block;
+}
 
-	// fprintf(dbgout, "Making kernel heap block [header-size: %d bytes]\n",
-	// 	block_header_size);
-	// fprintf(dbgout, "   * Raw size: %d bytes, Real size: %d\n",
-	// 	raw_size, block_real_size);
+////////////////////////////////////////////////////////////////////////////////
 
-	block->magic = kHEAP_AVAIL_MAGIC;
-	block->prev = NULL;
-	block->next = NULL;
-	block->size = block_real_size;
+static struct kheap_block *kheap_collect_block(struct kheap_block *block)
+{
+	// The block being collected must be free, and must not currently be in a
+	// free list.
+	if (!block || block->magic != kHEAP_AVAIL_MAGIC)
+		return block;
+
+	// Merge the physically following block if it is free. The fence at the end
+	// of the arena is never free so this can not run off the end.
+	struct kheap_block *next = kheap_block_next(block);
+	if (next->magic == kHEAP_AVAIL_MAGIC) {
+		kheap_bin_remove(next);
+		heap_stats.coalesces++;
+		block = kheap_make_block(
+			(uintptr_t)block,
+			block->size + next->size + sizeof(*next) + sizeof(struct kheap_tag),
+			kHEAP_AVAIL_MAGIC
+		);
+	}
 
-	// fprintf(dbgout, "   * Block constructed\n");
+	// Merge into the physically preceding block if it is free. Its boundary
+	// tag sits directly in front of this block's header.
+	struct kheap_tag *tag = (void *)((uintptr_t)block - sizeof(*tag));
+	if (tag->magic == kHEAP_AVAIL_MAGIC) {
+		struct kheap_block *prev = kheap_block_prev(block);
+		kheap_bin_remove(prev);
+		heap_stats.coalesces++;
+		block = kheap_make_block(
+			(uintptr_t)prev,
+			prev->size + block->size + sizeof(*block) + sizeof(*tag),
+			kHEAP_AVAIL_MAGIC
+		);
+	}
 
 	return block;
 }
 
+static int kheap_split_block(
+	struct kheap_block *block, 
+	size_t real_size
+) {
+	// Perform checks to ensure that the specified block is large enough to be
+	// split. The remainder must be able to hold a header, a tag and the
+	// smallest possible payload.
+	size_t overhead = sizeof(*block) + sizeof(struct kheap_tag);
+	if (!block)
+		return kHEAP_SPLIT_FAIL;
+	else if (block->size < real_size + overhead + kHEAP_GRANULE)
+		return kHEAP_SPLIT_FAIL;
+
+	// Shrink the existing block to the requested size and construct a new free
+	// block in the space that remains. It is then collected with any free block
+	// that follows it, and placed into the free lists.
+	size_t remaining = block->size - real_size - overhead;
+	block = kheap_make_block((uintptr_t)block, real_size, block->magic);
+
+	struct kheap_block *new_block = kheap_make_block(
+		(uintptr_t)kheap_block_next(block), 
+		remaining,
+		kHEAP_AVAIL_MAGIC
+	);
+	kheap_bin_insert(kheap_collect_block(new_block));
+	heap_stats.splits++;
+
+	return kHEAP_SPLIT_OK;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
-static int kheap_collect_block(
-	struct kheap_block *dst, 
-	struct kheap_block *src
-) {
-	// We absolutely must have both the destination and source blocks in order
-	// to attempt collection.
-	if (!dst || !src)
-		return kHEAP_COLLECT_FAIL;
+static struct kheap_block *kheap_allocate_block(size_t size)
+{
+	// Look for the smallest suitable free block. Only free blocks are ever
+	// visited by this search.
+	struct kheap_block *block = kheap_bin_find(size);
+	if (block) {
+		kheap_bin_remove(block);
+	}
+	else {
+		// Failed to find a suitable block in the heap. Attempt to expand the
+		// heap in order to get one.
+		block = kheap_expand(size);
+
+		// Perform a sanity check to ensure the block is actually suitable.
+		if (block->magic != kHEAP_AVAIL_MAGIC || block->size < size)
+			return NULL;
+	}
 
-	// Both block must be marked as "free".
-	else if (dst->magic != kHEAP_AVAIL_MAGIC || src->magic != kHEAP_AVAIL_MAGIC)
-		return kHEAP_COLLECT_FAIL;
+	// Any pages punched out of the block while it was free are still reserved
+	// and are backed again when touched, so nothing needs mapping up front.
+	// The block reference needs to be marked as allocated and returned the 
+	// caller. If the block is far larger than needed then it is split so that
+	// the remainder can be used by other allocations.
+	block = kheap_make_block((uintptr_t)block, block->size, kHEAP_ALLOC_MAGIC);
+	kheap_split_block(block, size);
 
-	// Ensure the destination and source blocks are in the correct order. We
-	// can just fail if they are not.
-	else if (dst >= src)
-		return kHEAP_COLLECT_FAIL;
+	return block;
+}
+static struct kheap_block *kheap_allocate_aligned_block(
+	size_t size,
+	size_t align
+) {
+	// Allocate enough space that an aligned payload, preceded by a minimal
+	// free block, is guaranteed to fit somewhere inside it.
+	size_t overhead = sizeof(struct kheap_block) + sizeof(struct kheap_tag);
+	struct kheap_block *block = kheap_allocate_block(
+		size + align + overhead + kHEAP_GRANULE
+	);
+	if (!block)
+		return NULL;
 
-	// We can now calculate the distance between the end of the destination 
-	// block and the start of the source block. If they are physcially adjacent
-	// in memory, then we can merge them together.
-	uintptr_t end_of_dst = (uintptr_t)dst + dst->size + sizeof(*dst);
-	uintptr_t start_of_src = (uintptr_t)src;
-	int32_t distance = start_of_src - end_of_dst;
+	// If the payload happens to be aligned already, then just trim the end.
+	uintptr_t payload = (uintptr_t)block + sizeof(*block);
+	if ((payload & (align - 1)) == 0) {
+		kheap_split_block(block, size);
+		return block;
+	}
 
-	if (distance != 0)
-		return kHEAP_COLLECT_FAIL;
+	// Find the first aligned payload address that leaves enough room in front
+	// of it for a free block. The leading space is given back to the heap.
+	uintptr_t aligned = (payload + overhead + kHEAP_GRANULE + align - 1) 
+					  & ~(align - 1);
+	size_t lead = aligned - payload;
+	size_t total = block->size;
+
+	struct kheap_block *leading = kheap_make_block(
+		(uintptr_t)block,
+		lead - overhead,
+		kHEAP_AVAIL_MAGIC
+	);
+	block = kheap_make_block(
+		aligned - sizeof(*block),
+		total - lead,
+		kHEAP_ALLOC_MAGIC
+	);
+	kheap_bin_insert(kheap_collect_block(leading));
 
-	// At this point we know it is possible to collect the blocks. Clear the
-	// meta data of the source block, and increase the allocation size of the
-	// destination block.
-	dst->size += src->size + sizeof(*src);
+	kheap_split_block(block, size);
+	return block;
+}
 
-	dst->next = src->next;
-	if (src->next)
-		src->next->prev = dst;
-	if (src == heap_last)
-		heap_last = dst;
+////////////////////////////////////////////////////////////////////////////////
 
-	memset(src, 0, sizeof(*src));
+static void kheap_punch_pages(uintptr_t start, uintptr_t end)
+{
+	// Release the frames but keep the addresses reserved for the heap. The
+	// page fault handler backs them again if the block is reused.
+	for (uintptr_t address = start; address < end; address += kPAGE_SIZE) {
+		if (is_page_allocated(address) != kPAGE_ALLOCATED)
+			continue;
+		kpage_decommit(address);
+		heap_stats.pages_released++;
+		heap_stats.pages_punched++;
+	}
+}
 
-	return kHEAP_COLLECT_OK;
+static void kheap_release_pages(uintptr_t start, uintptr_t end)
+{
+	// Release the pages along with the address range. Pages that were never
+	// touched, or were punched out, only give back their reservation.
+	for (uintptr_t address = start; address < end; address += kPAGE_SIZE) {
+		if (is_page_allocated(address) == kPAGE_ALLOCATED)
+			heap_stats.pages_released++;
+		kpage_free(address);
+	}
 }
 
-static int kheap_split_block(
-	struct kheap_block *block, 
-	size_t real_size
+static struct kheap_arena *kheap_arena_for_block(
+	struct kheap_block *block,
+	struct kheap_arena **prev
 ) {
-	// Perform checks to ensure that the specified block is real, free and large
-	// enough to be split. The size of the block must be at least real_size +
-	// twice the block_header_size.
-	if (!block)
-		return kHEAP_SPLIT_FAIL;
-	else if (block->magic != kHEAP_AVAIL_MAGIC)
-		return kHEAP_SPLIT_FAIL;
-	else if (block->size < (sizeof(*block) * 2) + real_size)
-		return kHEAP_SPLIT_FAIL;
+	*prev = NULL;
+	struct kheap_arena *arena = heap_first;
+	while (arena) {
+		uintptr_t start = (uintptr_t)arena;
+		if ((uintptr_t)block > start && (uintptr_t)block < start + arena->size)
+			return arena;
+		*prev = arena;
+		arena = arena->next;
+	}
+	return NULL;
+}
 
-	// Splitting the block is relatively straight forwards. The existing block
-	// needs to be shrunk to the specified real size, and then immediately
-	// following it a new block header constructed. This new block will occupy
-	// the remaining space of the old block.
-	uintptr_t new_block_raw_address = (uintptr_t)block + real_size 
-									+ sizeof(*block);
-	size_t new_block_raw_size = block->size - real_size;
-	
-	struct kheap_block *new_block = kheap_make_block(
-		new_block_raw_address, 
-		new_block_raw_size
+static struct kheap_block *kheap_trim_arena_tail(
+	struct kheap_arena *arena,
+	struct kheap_block *block
+) {
+	// Keep just enough of the block for a minimal free block followed by the
+	// fence, and give every page after that back.
+	uintptr_t arena_end = (uintptr_t)arena + arena->size;
+	uintptr_t new_end = (uintptr_t)block + sizeof(*block) + kHEAP_GRANULE
+					  + sizeof(struct kheap_tag) + sizeof(struct kheap_block);
+	new_end = (new_end + kPAGE_SIZE - 1) & ~(kPAGE_SIZE - 1);
+	if (new_end >= arena_end)
+		return block;
+
+	block = kheap_make_block(
+		(uintptr_t)block,
+		new_end - (uintptr_t)block - sizeof(*block) 
+				- sizeof(struct kheap_tag) - sizeof(struct kheap_block),
+		kHEAP_AVAIL_MAGIC
 	);
+	struct kheap_block *fence = kheap_block_next(block);
+	fence->magic = kHEAP_FENCE_MAGIC;
+	fence->size = 0;
 
-	block->size = real_size;
+	kheap_release_pages(new_end, arena_end);
+	arena->size = new_end - (uintptr_t)arena;
+	return block;
+}
 
-	// Updating the previous heap chain is the most tricky aspect. This needs
-	// to insert a new block between the old one and the current "next" block.
-	struct kheap_block *next_block = block->next;
+static struct kheap_block *kheap_trim_block(struct kheap_block *block)
+{
+	// Memory is only given back once the heap is holding more free memory than
+	// the high-water threshold, so that bursty workloads do not thrash the
+	// frame allocator.
+	if (!block)
+		return NULL;
+	else if (heap_stats.bytes_free + block->size < kHEAP_TRIM_THRESHOLD)
+		return block;
+
+	struct kheap_arena *prev_arena = NULL;
+	struct kheap_arena *arena = kheap_arena_for_block(block, &prev_arena);
+	if (!arena)
+		return block;
+
+	struct kheap_tag *tag = (void *)((uintptr_t)block - sizeof(*tag));
+	struct kheap_block *next = kheap_block_next(block);
+
+	// A block that fills an entire arena means the arena is completely unused,
+	// and it can be released outright.
+	if (tag->magic == kHEAP_FENCE_MAGIC && next->magic == kHEAP_FENCE_MAGIC) {
+		if (prev_arena)
+			prev_arena->next = arena->next;
+		else
+			heap_first = arena->next;
+		if (heap_last == arena)
+			heap_last = prev_arena;
+
+		kheap_release_pages((uintptr_t)arena, (uintptr_t)arena + arena->size);
+		return NULL;
+	}
 
-	new_block->prev = block;
-	new_block->next = next_block;
-	block->next = new_block;
+	// Anything else smaller than a page can not release anything.
+	else if (block->size < kPAGE_SIZE) {
+		return block;
+	}
 
-	if (next_block)
-		next_block->prev = new_block;
+	// A block at the end of an arena allows the arena to be shrunk.
+	else if (next->magic == kHEAP_FENCE_MAGIC) {
+		return kheap_trim_arena_tail(arena, block);
+	}
 
-	// The old block was the previous last block in the chain, then update the
-	// last block reference to be the new last block.
-	if (block == heap_last)
-		heap_last = new_block;
+	// Otherwise punch out the pages that lie entirely within the block. The
+	// header, free list links and tag are left mapped.
+	uintptr_t start = (uintptr_t)block + sizeof(*block) 
+					+ sizeof(struct kheap_links);
+	start = (start + kPAGE_SIZE - 1) & ~(kPAGE_SIZE - 1);
+	uintptr_t end = (uintptr_t)kheap_block_tag(block) & ~(kPAGE_SIZE - 1);
+	if (start < end)
+		kheap_punch_pages(start, end);
 
-	return kHEAP_SPLIT_OK;
+	return block;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static struct kheap_block *kheap_allocate_block(size_t size)
+static uint32_t kslab_class_for_size(size_t size)
 {
-	size_t required_split_size = size + (sizeof(struct kheap_block) * 2);
-	// fprintf(dbgout, "Finding heap block for allocation of %d bytes.\n", size);
+	// Find the smallest size class that is able to hold the requested size.
+	uint32_t class = 0;
+	while ((1U << (class + kSLAB_MIN_SHIFT)) < size)
+		++class;
+	return class;
+}
 
-	// The first step is to search all current blocks for the first available
-	// block that is large enough to accomodate the requested allocation, and
-	// is not already in use.
-	struct kheap_block *block = heap_first;
-	while (block) {
-		if (block->magic == kHEAP_AVAIL_MAGIC && block->size >= size)
-			goto BLOCK_FOUND;
-		block = block->next;
+static struct kslab *kslab_create(struct kslab_cache *cache)
+{
+	// Slabs are always exactly one page in size, and are taken directly from
+	// the kernel address space rather than the heap block chain.
+	// Slabs of other classes are created under other locks, and may share a 
+	// word of the page map with this one.
+	struct kslab *slab = (void *)kheap_map_pages(1);
+	kheap_fetch_add(&heap_stats.slab_pages, 1);
+	uint32_t page = ((uintptr_t)slab - kSLAB_SPACE_BASE) / kPAGE_SIZE;
+	kheap_fetch_or(&slab_page_map[page / 32], 1U << (page % 32));
+	slab->cache = cache;
+	slab->prev = NULL;
+	slab->next = NULL;
+	slab->free = NULL;
+	slab->in_use = 0;
+
+	// The first object starts at the first object size boundary after the
+	// header. Objects are therefore naturally aligned to their size class
+	// (capped at the page size).
+	uintptr_t first = ((uintptr_t)slab + sizeof(*slab) + cache->object_size - 1)
+					& ~(cache->object_size - 1);
+	uintptr_t end = (uintptr_t)slab + kPAGE_SIZE;
+	slab->capacity = (end - first) / cache->object_size;
+
+	// Thread each of the objects onto the free list. They are pushed in reverse
+	// so that allocations proceed upwards through the page.
+	for (uint32_t n = slab->capacity; n > 0; --n) {
+		void **object = (void *)(first + ((n - 1) * cache->object_size));
+		*object = slab->free;
+		slab->free = object;
 	}
 
-	// Failed to find a suitable block in the heap. Attempt to expand the heap
-	// in order to get one.
-	// fprintf(dbgout, "Failed to find suitable heap block. Expanding heap.\n");
-	block = kheap_expand(size + sizeof(*block));
+	return slab;
+}
+
+static void kslab_link(struct kslab_cache *cache, struct kslab *slab)
+{
+	slab->prev = NULL;
+	slab->next = cache->partial;
+	if (cache->partial)
+		cache->partial->prev = slab;
+	cache->partial = slab;
+}
+
+static void kslab_unlink(struct kslab_cache *cache, struct kslab *slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		cache->partial = slab->next;
+
+	if (slab->next)
+		slab->next->prev = slab->prev;
+
+	slab->prev = slab->next = NULL;
+}
+
+static void *kslab_alloc(uint32_t class)
+{
+	struct kslab_cache *cache = &slab_caches[class];
+
+	// If there are no slabs with free objects in this class, then construct a
+	// new one.
+	if (!cache->partial)
+		kslab_link(cache, kslab_create(cache));
+
+	// Take the first free object from the first partial slab. If that empties
+	// the slab then it is removed from the partial list until something is
+	// returned to it.
+	struct kslab *slab = cache->partial;
+	void **object = slab->free;
+	slab->free = *object;
+
+	if (++slab->in_use == slab->capacity)
+		kslab_unlink(cache, slab);
+
+	return object;
+}
+
+static struct kslab *kslab_owner(void *ptr)
+{
+	// Determine if the page owning the pointer is a slab. Slab pages are never
+	// returned, so once a page is marked in the map it stays a slab.
+	uintptr_t address = (uintptr_t)ptr;
+	if (address < kSLAB_SPACE_BASE)
+		return NULL;
 
-	// Perform a sanity check to ensure the reported block is actually suitable.
-	if (block->magic != kHEAP_AVAIL_MAGIC || block->size < size) {
-		// fprintf(dbgout, "   * Serious error. Failed to make suitable block!\n");
+	uint32_t page = (address - kSLAB_SPACE_BASE) / kPAGE_SIZE;
+	if (!(slab_page_map[page / 32] & (1U << (page % 32))))
 		return NULL;
+	return (void *)(address & ~(kPAGE_SIZE - 1));
+}
+
+static void kslab_free(struct kslab *slab, void *ptr)
+{
+	// Return the object to the slab. If the slab was full, then it needs to be
+	// placed back on to the partial list of its cache.
+	void **object = ptr;
+	*object = slab->free;
+	slab->free = object;
+
+	if (slab->in_use-- == slab->capacity)
+		kslab_link(slab->cache, slab);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline uint32_t kheap_cpu(void)
+{
+	// Each CPU has its own magazines, so that the common case never has to
+	// contend with another CPU.
+	return cpu_current()->index;
+}
+
+static struct kmagazine *kmagazine_create(void)
+{
+	// Magazines are taken directly from the slabs, so that constructing one
+	// never has to recurse back into the magazine layer. They have a class of
+	// their own, so the lock of any other class must not be held here.
+	uint32_t class = kslab_class_for_size(sizeof(struct kmagazine));
+	spin_lock(&magazine_depots[class].lock);
+	struct kmagazine *magazine = kslab_alloc(class);
+	spin_unlock(&magazine_depots[class].lock);
+
+	magazine->next = NULL;
+	magazine->rounds = 0;
+	return magazine;
+}
+
+static void kmagazine_depot_push_full(
+	struct kmagazine_depot *depot,
+	struct kmagazine *magazine
+) {
+	// If the depot already holds enough full magazines, then flush this one 
+	// back to the slabs in a single batch and keep it as an empty magazine.
+	if (depot->full_count >= kDEPOT_MAX_FULL) {
+		while (magazine->rounds) {
+			void *object = magazine->objects[--magazine->rounds];
+			kslab_free(kslab_owner(object), object);
+		}
+		magazine->next = depot->empty;
+		depot->empty = magazine;
+		return;
 	}
 
-BLOCK_FOUND:
-	// If the block is far larger than needed then we need to split it, so that
-	// we do not waste too much space.
-	if (block->size > required_split_size) {
-		// fprintf(dbgout, "   * Block too large (%d>%d). Attempting to split.\n",
-		// 	block->size, required_split_size);
-		if (kheap_split_block(block, size) != kHEAP_SPLIT_OK) {
-			// fprintf(dbgout, "   * Failed to split heap block. Leaving.\n");
+	magazine->next = depot->full;
+	depot->full = magazine;
+	depot->full_count++;
+}
+
+static void kmagazine_reload(struct kmagazine_cache *cache, uint32_t class)
+{
+	// The depot and the slabs are shared between CPUs, under the lock of the
+	// class. Interrupts are already disabled.
+	struct kmagazine_depot *depot = &magazine_depots[class];
+	spin_lock(&depot->lock);
+
+	// Exchange the empty previous magazine for a full one from the depot, if 
+	// the depot has one available.
+	if (depot->full) {
+		struct kmagazine *full = depot->full;
+		depot->full = full->next;
+		depot->full_count--;
+
+		if (cache->previous) {
+			cache->previous->next = depot->empty;
+			depot->empty = cache->previous;
 		}
+		cache->previous = cache->loaded;
+		cache->loaded = full;
+		spin_unlock(&depot->lock);
+		return;
 	}
 
-	// The block reference is now of the requested size and needs to be marked
-	// as allocated and returned the caller.
-	block->magic = kHEAP_ALLOC_MAGIC;
-	// fprintf(dbgout, "***\n");
+	// Otherwise fill the loaded magazine from the slabs in a single batch. The
+	// magazine belongs to this CPU, so it is created without the lock.
+	if (!cache->loaded) {
+		spin_unlock(&depot->lock);
+		cache->loaded = kmagazine_create();
+		spin_lock(&depot->lock);
+	}
 
-	return block;
+	struct kmagazine *magazine = cache->loaded;
+	while (magazine->rounds < kMAGAZINE_ROUNDS)
+		magazine->objects[magazine->rounds++] = kslab_alloc(class);
+
+	spin_unlock(&depot->lock);
+}
+
+static void kmagazine_exchange(struct kmagazine_cache *cache, uint32_t class)
+{
+	struct kmagazine_depot *depot = &magazine_depots[class];
+	spin_lock(&depot->lock);
+
+	// Both magazines are full. Hand the previous one to the depot and replace
+	// it with an empty magazine.
+	if (cache->previous)
+		kmagazine_depot_push_full(depot, cache->previous);
+	cache->previous = cache->loaded;
+
+	struct kmagazine *empty = depot->empty;
+	if (empty)
+		depot->empty = empty->next;
+
+	spin_unlock(&depot->lock);
+	cache->loaded = empty ?: kmagazine_create();
+}
+
+static void *kmagazine_alloc(uint32_t class)
+{
+	// The magazines are per-CPU, so the fast path does not need any lock.
+	// Interrupts still have to be off rather than just preemption: the
+	// scheduler frees dead tasks from its interrupt path, and an interrupt
+	// arriving part way through moving a round would corrupt the magazine.
+	// With interrupts off this task also cannot be moved to another CPU.
+	irq_flags_t flags = irq_save();
+
+	struct kmagazine_cache *cache = &magazine_caches[kheap_cpu()][class];
+	void *object = NULL;
+
+	while (!object) {
+		if (cache->loaded && cache->loaded->rounds) {
+			object = cache->loaded->objects[--cache->loaded->rounds];
+		}
+		else if (cache->previous && cache->previous->rounds) {
+			struct kmagazine *loaded = cache->loaded;
+			cache->loaded = cache->previous;
+			cache->previous = loaded;
+		}
+		else {
+			kmagazine_reload(cache, class);
+		}
+	}
+
+	irq_restore(flags);
+	return object;
+}
+
+static void kmagazine_free(uint32_t class, void *ptr)
+{
+	irq_flags_t flags = irq_save();
+
+	struct kmagazine_cache *cache = &magazine_caches[kheap_cpu()][class];
+
+	while (ptr) {
+		if (cache->loaded && cache->loaded->rounds < kMAGAZINE_ROUNDS) {
+			cache->loaded->objects[cache->loaded->rounds++] = ptr;
+			ptr = NULL;
+		}
+		else if (cache->previous && cache->previous->rounds < kMAGAZINE_ROUNDS) {
+			struct kmagazine *loaded = cache->loaded;
+			cache->loaded = cache->previous;
+			cache->previous = loaded;
+		}
+		else {
+			kmagazine_exchange(cache, class);
+		}
+	}
+
+	irq_restore(flags);
 }
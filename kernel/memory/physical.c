@@ -21,10 +21,14 @@
 */
 
 #include <physical.h>
+#include <virtual.h>
+#include <memory.h>
+#include <atomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <panic.h>
+#include <string.h>
 
 extern uintptr_t *kernel_end;
 extern uintptr_t *kernel_start;
@@ -32,10 +36,58 @@ static uintptr_t kernel_end_addr = (uintptr_t)&kernel_end;
 
 static uintptr_t working_memory = 0;
 
+#define kFRAME_NONE		0xFFFFFFFF
+
+#ifndef kFRAME_ZEROED_POOL
+#	define kFRAME_ZEROED_POOL	64
+#endif
+
+// Every physical frame has a descriptor, indexed by frame number. Free blocks
+// are tracked by the descriptor of their first frame, which records the order
+// of the block and links it into the free list for that order.
+struct frame_descriptor
+{
+	uint32_t prev;
+	uint32_t next;
+	uint8_t order;
+	uint8_t free;
+	uint16_t reserved;
+};
+
+struct frame_free_area
+{
+	uint32_t first;
+	uint32_t count;
+};
+
+// Physical memory is split into zones, each with its own buddy free lists.
+// Blocks never merge across a zone boundary, so memory that is only usable by
+// some devices is not handed out unless the other zones have been exhausted.
+struct frame_zone_info
+{
+	const char *name;
+	uint32_t first_frame;
+	uint32_t end_frame;
+	uint32_t total_count;
+	uint32_t free_count;
+	uint32_t free_area_map;
+	struct frame_free_area free_areas[kFRAME_MAX_ORDER + 1];
+};
+
 static const size_t frame_size = 0x1000; // 4 KiB Frames
 static uint32_t frame_total = 0;
-static uint32_t free_frame_count = 0;
-static uint32_t *free_frame_stack = NULL;
+static struct frame_descriptor *frame_descriptors = NULL;
+static uint32_t *frame_bitmap = NULL;
+static struct frame_zone_info frame_zones[kFRAME_ZONE_COUNT] = {
+	[frame_zone_low] = { "low", 0x00000, 0x00100 },		// 0 - 1MiB
+	[frame_zone_dma] = { "dma", 0x00100, 0x01000 },		// 1 - 16MiB
+	[frame_zone_normal] = { "normal", 0x01000, 0x100000 },	// 16MiB - 4GiB
+};
+
+// Frames that have already been cleared by the idle process, ready to be handed
+// out without clearing them on the allocation path.
+static uintptr_t zeroed_frames[kFRAME_ZEROED_POOL];
+static uint32_t zeroed_count = 0;
 
 enum mmap_entry_type
 {
@@ -83,33 +135,177 @@ uintptr_t reserve_kernel_working_memory(size_t length)
 	return address;
 }
 
-static void frame_stack_prepare(struct boot_config *config)
+static void frame_descriptors_prepare(struct boot_config *config)
 {
-	fprintf(dbgout, "Setting up stack for free/available frames (");
+	fprintf(dbgout, "Setting up descriptors for physical frames (");
 	fprintf(dbgout, "%dKiB, ", config->upper_memory);
 
-	frame_total = config->upper_memory / 4;
+	// Upper memory starts at 1MiB, so the frames below it need descriptors as
+	// well in order to index descriptors directly by frame number.
+	frame_total = (config->upper_memory + 1024) / 4;
 	fprintf(dbgout, "%d)\n", frame_total);
 
-	free_frame_stack = (uint32_t *)reserve_kernel_working_memory(frame_total);
-	free_frame_stack += frame_total;
-	fprintf(dbgout, "free_frame_stack stack bottom: %p\n", free_frame_stack);
+	size_t length = frame_total * sizeof(*frame_descriptors);
+	frame_descriptors = (void *)reserve_kernel_working_memory(length);
+	memset(frame_descriptors, 0, length);
+
+	// The bitmap has a bit set for every frame that is in use. Every frame
+	// starts out in use until it is found to be available.
+	length = ((frame_total + 31) / 32) * sizeof(*frame_bitmap);
+	frame_bitmap = (void *)reserve_kernel_working_memory(length);
+	memset(frame_bitmap, 0xFF, length);
+
+	for (uint32_t zone = 0; zone < kFRAME_ZONE_COUNT; ++zone) {
+		for (uint32_t order = 0; order <= kFRAME_MAX_ORDER; ++order) {
+			frame_zones[zone].free_areas[order].first = kFRAME_NONE;
+			frame_zones[zone].free_areas[order].count = 0;
+		}
+	}
+	fprintf(dbgout, "frame descriptors: %p\n", frame_descriptors);
+}
+
+static inline uint32_t frame_is_used(uint32_t frame)
+{
+	return (frame_bitmap[frame >> 5] >> (frame & 31)) & 1;
+}
+
+static uint32_t frame_run_is_used(uint32_t frame, uint32_t count)
+{
+	// Check individual bits up to a word boundary, then whole words at a time.
+	for (; count && (frame & 31); ++frame, --count) {
+		if (!frame_is_used(frame))
+			return 0;
+	}
+
+	for (; count >= 32; frame += 32, count -= 32) {
+		if (frame_bitmap[frame >> 5] != 0xFFFFFFFF)
+			return 0;
+	}
+
+	for (; count; ++frame, --count) {
+		if (!frame_is_used(frame))
+			return 0;
+	}
+	return 1;
+}
+
+static void frame_bitmap_mark(uint32_t frame, uint32_t count, uint32_t used)
+{
+	// Mark individual bits up to a word boundary, then whole words at a time.
+	for (; count && (frame & 31); ++frame, --count) {
+		if (used)
+			frame_bitmap[frame >> 5] |= (1U << (frame & 31));
+		else
+			frame_bitmap[frame >> 5] &= ~(1U << (frame & 31));
+	}
+
+	for (; count >= 32; frame += 32, count -= 32)
+		frame_bitmap[frame >> 5] = used ? 0xFFFFFFFF : 0;
+
+	for (; count; ++frame, --count) {
+		if (used)
+			frame_bitmap[frame >> 5] |= (1U << (frame & 31));
+		else
+			frame_bitmap[frame >> 5] &= ~(1U << (frame & 31));
+	}
 }
 
-static void push_free_frame(uint32_t frame __attribute__((unused)))
+static struct frame_zone_info *zone_for_frame(uint32_t frame)
 {
-	*free_frame_stack-- = frame;
-	free_frame_count++;
+	if (frame < frame_zones[frame_zone_low].end_frame)
+		return &frame_zones[frame_zone_low];
+	else if (frame < frame_zones[frame_zone_dma].end_frame)
+		return &frame_zones[frame_zone_dma];
+	else
+		return &frame_zones[frame_zone_normal];
+}
+
+static void free_area_insert(
+	struct frame_zone_info *zone, 
+	uint32_t frame, 
+	uint32_t order
+) {
+	struct frame_descriptor *descriptor = &frame_descriptors[frame];
+	struct frame_free_area *area = &zone->free_areas[order];
+
+	descriptor->order = order;
+	descriptor->free = 1;
+	descriptor->prev = kFRAME_NONE;
+	descriptor->next = area->first;
+	if (area->first != kFRAME_NONE)
+		frame_descriptors[area->first].prev = frame;
+	area->first = frame;
+	area->count++;
+
+	zone->free_area_map |= (1U << order);
+}
+
+static void free_area_remove(struct frame_zone_info *zone, uint32_t frame)
+{
+	struct frame_descriptor *descriptor = &frame_descriptors[frame];
+	struct frame_free_area *area = &zone->free_areas[descriptor->order];
+
+	if (descriptor->prev != kFRAME_NONE)
+		frame_descriptors[descriptor->prev].next = descriptor->next;
+	else
+		area->first = descriptor->next;
+
+	if (descriptor->next != kFRAME_NONE)
+		frame_descriptors[descriptor->next].prev = descriptor->prev;
+
+	if (--area->count == 0)
+		zone->free_area_map &= ~(1U << descriptor->order);
+	descriptor->free = 0;
+}
+
+static void free_frame_range(uint32_t frame, uint32_t end)
+{
+	// Hand the range over in the largest naturally aligned blocks that fit,
+	// without letting a block straddle a zone boundary.
+	while (frame < end) {
+		struct frame_zone_info *zone = zone_for_frame(frame);
+		uint32_t zone_end = end < zone->end_frame ? end : zone->end_frame;
+
+		uint32_t order = 0;
+		while (order < kFRAME_MAX_ORDER
+			&& (frame & ((2U << order) - 1)) == 0
+			&& frame + (2U << order) <= zone_end
+		) {
+			order++;
+		}
+
+		kframe_free_order(frame * frame_size, order);
+		frame += (1U << order);
+	}
+}
+
+static void hand_over_frame_range(uint32_t frame, uint32_t end)
+{
+	// The frames become part of the zones that they lie in, and then are free
+	// to be allocated.
+	for (uint32_t n = 0; n < kFRAME_ZONE_COUNT; ++n) {
+		struct frame_zone_info *zone = &frame_zones[n];
+		uint32_t zone_first = frame > zone->first_frame ? frame : zone->first_frame;
+		uint32_t zone_end = end < zone->end_frame ? end : zone->end_frame;
+		if (zone_first < zone_end)
+			zone->total_count += zone_end - zone_first;
+	}
+
+	free_frame_range(frame, end);
 }
 
 static void push_free_frames(uint32_t first, uint32_t last)
 {
 	fprintf(dbgout, "\tpush_free_frames(%08x, %08x)\n", first, last);
-	for (uint32_t n = first; n < last; n += frame_size)
-		push_free_frame(n);
 
-	fprintf(dbgout, "\tfree_frame_stack is now: %p\n", free_frame_stack);
-	fprintf(dbgout, "\tfree_frame_count is %d\n", free_frame_count);
+	uint32_t frame = (first + frame_size - 1) / frame_size;
+	uint32_t end = last / frame_size;
+	if (end > frame_total)
+		end = frame_total;
+	if (frame >= end)
+		return;
+
+	hand_over_frame_range(frame, end);
 }
 
 static void search_physical_frames(struct boot_config *config)
@@ -155,8 +351,10 @@ static void search_physical_frames(struct boot_config *config)
 		push_free_frames(first_free_frame, last_frame);
 	}
 
-	fprintf(dbgout, "Total number of free/available frames: %d\n", 
-		free_frame_count);
+	for (uint32_t zone = 0; zone < kFRAME_ZONE_COUNT; ++zone) {
+		fprintf(dbgout, "Free/available frames in %s zone: %d\n", 
+			frame_zones[zone].name, frame_zones[zone].free_count);
+	}
 }
 
 void physical_memory_prepare(struct boot_config *config)
@@ -167,13 +365,25 @@ void physical_memory_prepare(struct boot_config *config)
 	fprintf(dbgout, "End of kernel is located at: %p\n", kernel_end_addr);
 	fprintf(dbgout, "Working memory is located at: %p\n", working_memory);
 
-	frame_stack_prepare(config);
+	frame_descriptors_prepare(config);
 	search_physical_frames(config);
 }
 
+static uintptr_t zeroed_frame_take(void)
+{
+	atom_t atom;
+	atomic_start(atom);
+	uintptr_t frame = zeroed_count ? zeroed_frames[--zeroed_count] : 0;
+	atomic_end(atom);
+	return frame;
+}
+
 uintptr_t kframe_alloc(void)
 {
-	if (free_frame_count == 0) {
+	uintptr_t frame = kframe_alloc_order(0);
+	if (frame == 0)
+		frame = zeroed_frame_take();
+	if (frame == 0) {
 		struct panic_info info = (struct panic_info) {
 			panic_memory,
 			"PHYSICAL MEMORY EXHAUSTED",
@@ -183,14 +393,231 @@ uintptr_t kframe_alloc(void)
 		panic(&info, NULL);
 	}
 
-	free_frame_stack++;
-	free_frame_count--;
+	return frame;
+}
 
-	return *free_frame_stack;
+uintptr_t kframe_alloc_zeroed(void)
+{
+	uintptr_t frame = zeroed_frame_take();
+	if (frame)
+		return frame;
+
+	// The pool is empty, so the frame has to be cleared by the caller.
+	frame = kframe_alloc();
+	void *contents = kmap(frame);
+	memset(contents, 0, frame_size);
+	kunmap(contents);
+	return frame;
+}
+
+int kframe_zeroed_refill(void)
+{
+	// Leave enough free frames behind that the pool never causes an allocation
+	// to fail. The pool is drained by kframe_alloc before it gives up.
+	if (zeroed_count >= kFRAME_ZEROED_POOL)
+		return 0;
+	else if (frame_zones[frame_zone_normal].free_count < kFRAME_ZEROED_POOL * 2)
+		return 0;
+
+	uintptr_t frame = kframe_alloc_order(0);
+	if (frame == 0)
+		return 0;
+
+	void *contents = kmap(frame);
+	zero_page_nontemporal(contents);
+	kunmap(contents);
+
+	// The pool may have been filled by someone else in the meantime.
+	atom_t atom;
+	atomic_start(atom);
+	int added = (zeroed_count < kFRAME_ZEROED_POOL);
+	if (added)
+		zeroed_frames[zeroed_count++] = frame;
+	atomic_end(atom);
+
+	if (!added)
+		kframe_free(frame);
+	return added;
+}
+
+uint32_t kframe_zeroed_count(void)
+{
+	return zeroed_count;
+}
+
+static uintptr_t zone_alloc_order(struct frame_zone_info *zone, uint32_t order)
+{
+	// Find the smallest free block that is at least the requested order.
+	uint32_t available = zone->free_area_map & ~((1U << order) - 1);
+	if (!available)
+		return 0;
+
+	uint32_t block_order;
+	__asm__("bsfl %1, %0" : "=r"(block_order) : "rm"(available));
+	uint32_t frame = zone->free_areas[block_order].first;
+	free_area_remove(zone, frame);
+
+	// Split the block in half until it is the requested order. The upper half
+	// of each split is the buddy of the lower half, and is returned to the free
+	// lists.
+	while (block_order > order) {
+		block_order--;
+		free_area_insert(zone, frame + (1U << block_order), block_order);
+	}
+
+	frame_descriptors[frame].order = order;
+	frame_bitmap_mark(frame, 1U << order, 1);
+	zone->free_count -= (1U << order);
+	return frame * frame_size;
+}
+
+uintptr_t kframe_alloc_order(uint32_t order)
+{
+	return kframe_alloc_zone(order, frame_zone_normal);
+}
+
+uintptr_t kframe_alloc_zone(uint32_t order, enum frame_zone zone)
+{
+	if (order > kFRAME_MAX_ORDER || zone >= kFRAME_ZONE_COUNT)
+		return 0;
+
+	// Start with the requested zone and fall back towards the scarcer zones
+	// below it. Memory is never taken from a zone above the requested one.
+	// The zones are shared by every CPU.
+	atom_t atom;
+	atomic_start(atom);
+
+	uintptr_t frame = 0;
+	for (int n = zone; n >= 0 && !frame; --n)
+		frame = zone_alloc_order(&frame_zones[n], order);
+
+	atomic_end(atom);
+	return frame;
+}
+
+uint32_t kframe_free_count(enum frame_zone zone)
+{
+	return zone < kFRAME_ZONE_COUNT ? frame_zones[zone].free_count : 0;
 }
 
 void kframe_free(uintptr_t frame)
 {
-	// TODO: There should really be some verification about frame validity here.
-	push_free_frame(frame);
+	kframe_free_order(frame, 0);
+}
+
+void kframe_free_order(uintptr_t address, uint32_t order)
+{
+	// Make sure the run being freed is valid, and that it is not already free.
+	// Freeing a run twice would corrupt the free lists, so warn and ignore it.
+	uint32_t frame = address / frame_size;
+	if (order > kFRAME_MAX_ORDER 
+		|| (address & (frame_size - 1)) != 0
+		|| (frame & ((1U << order) - 1)) != 0
+		|| frame + (1U << order) > frame_total
+	) {
+		fprintf(dbgout, "WARNING: Attempting to free an invalid frame %p.\n", 
+			address);
+		return;
+	}
+
+	atom_t atom;
+	atomic_start(atom);
+
+	// Every frame of the run has to be in use. Only checking the head would 
+	// miss a run that overlaps a block that is already free.
+	if (!frame_run_is_used(frame, 1U << order)) {
+		atomic_end(atom);
+		fprintf(dbgout, "WARNING: Attempting to free frame %p twice.\n", 
+			address);
+		return;
+	}
+
+	struct frame_zone_info *zone = zone_for_frame(frame);
+	zone->free_count += (1U << order);
+	frame_bitmap_mark(frame, 1U << order, 0);
+
+	// Merge the block with its buddy for as long as the buddy is free and of
+	// the same order. The buddy of a block differs only in the bit matching
+	// the order of the block. Buddies in another zone are never merged.
+	while (order < kFRAME_MAX_ORDER) {
+		uint32_t buddy = frame ^ (1U << order);
+		if (buddy >= frame_total)
+			break;
+		else if (buddy < zone->first_frame || buddy >= zone->end_frame)
+			break;
+
+		struct frame_descriptor *descriptor = &frame_descriptors[buddy];
+		if (!descriptor->free || descriptor->order != order)
+			break;
+
+		free_area_remove(zone, buddy);
+		frame &= ~(1U << order);
+		order++;
+	}
+
+	free_area_insert(zone, frame, order);
+	atomic_end(atom);
+}
+
+void kframe_free_range(uintptr_t start, uintptr_t end)
+{
+	uint32_t frame = (start + frame_size - 1) / frame_size;
+	uint32_t end_frame = end / frame_size;
+	if (end_frame > frame_total)
+		end_frame = frame_total;
+	if (frame >= end_frame)
+		return;
+
+	hand_over_frame_range(frame, end_frame);
+}
+
+void kframe_reserve_range(uintptr_t start, uintptr_t end)
+{
+	uint32_t first = start / frame_size;
+	uint32_t last = (end + frame_size - 1) / frame_size;
+	if (last > frame_total)
+		last = frame_total;
+
+	for (uint32_t frame = first; frame < last;) {
+		// Frames that are already in use can be skipped a word at a time.
+		if ((frame & 31) == 0 && frame_bitmap[frame >> 5] == 0xFFFFFFFF) {
+			frame += 32;
+			continue;
+		}
+		else if (frame_is_used(frame)) {
+			frame++;
+			continue;
+		}
+
+		// Find the free block that contains the frame. Its head is the only
+		// frame in the block with a descriptor marked as free.
+		uint32_t order = 0;
+		uint32_t head = frame;
+		for (; order <= kFRAME_MAX_ORDER; ++order) {
+			head = frame & ~((1U << order) - 1);
+			if (frame_descriptors[head].free 
+				&& frame_descriptors[head].order == order)
+				break;
+		}
+
+		if (order > kFRAME_MAX_ORDER) {
+			frame++;
+			continue;
+		}
+
+		// Take the whole block, and then give back the parts of it that lie
+		// outside of the range being reserved.
+		struct frame_zone_info *zone = zone_for_frame(head);
+		uint32_t block_end = head + (1U << order);
+		free_area_remove(zone, head);
+		zone->free_count -= (1U << order);
+		frame_bitmap_mark(head, 1U << order, 1);
+
+		if (head < first)
+			free_frame_range(head, first);
+		if (block_end > last)
+			free_frame_range(last, block_end);
+
+		frame = block_end;
+	}
 }
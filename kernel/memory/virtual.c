@@ -28,21 +28,63 @@
 #include <macro.h>
 #include <panic.h>
 #include <memory.h>
+#include <kheap.h>
+#include <atomic.h>
+#include <sema.h>
+#include <arch/arch.h>
 
 #define PAGE_MAX_ENTRIES 	1024
 
-#define kPAGE_ALLOCATED 			1
-#define kNO_PAGE_ALLOCATED 			0
-#define kNO_PAGE_TABLE_ALLOCATED 	-1
+#ifndef VIRTUAL_RANGE_NODES
+#	define VIRTUAL_RANGE_NODES	1024
+#endif
+
+#ifndef KMAP_SLOTS
+#	define KMAP_SLOTS			8
+#endif
+
+#define kKERNEL_BASE			0xC0000000
+#define kCR4_PSE				(1 << 4)
+
+// The last directory entry of every page directory refers back to the directory
+// itself. The page tables of the current address space then appear in the last
+// 4MiB of the address space, with the directory as the final page.
+#define kRECURSIVE_ENTRY		1023
+#define kPAGE_TABLE_WINDOW		0xFFC00000
+#define kPAGE_DIRECTORY_WINDOW	0xFFFFF000
+#define kLAST_KERNEL_ADDRESS	kPAGE_TABLE_WINDOW
+
+// Free kernel address space is tracked as a list of page aligned ranges, 
+// sorted by address. Adjacent ranges are always merged, so the list only grows
+// with fragmentation of the address space. Nodes come from a fixed pool in the
+// kernel working memory.
+struct virtual_range {
+	uintptr_t start;
+	uintptr_t end;
+	struct virtual_range *next;
+};
 
 static struct virtual_address_space *kernel_address_space = NULL;
+static struct virtual_address_space *address_spaces = NULL;
+static struct virtual_address_space *current_address_spaces[kMAX_CPUS] = { 0 };
+static uint32_t kernel_directory_generation = 0;
 static uintptr_t first_available_kernel_address = 0;
 static uintptr_t first_kernel_address = 0;
 static uint32_t page_size = 0x1000;
 
-static uintptr_t first_page_table_address = 0;
-static uintptr_t last_page_table_address = 0;
-static uint32_t total_page_tables = 1024;
+static struct page_table *kernel_directory = NULL;
+static uintptr_t kmap_base = 0;
+static uint32_t kmap_used[kMAX_CPUS] = { 0 };
+
+static struct virtual_range *free_ranges = NULL;
+static struct virtual_range *spare_ranges = NULL;
+
+static int large_pages = 0;
+
+static struct page_fault_statistics fault_stats = { 0 };
+
+// Every CPU has its own current address space.
+#define current_address_space	(current_address_spaces[cpu_current()->index])
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -57,50 +99,246 @@ static uint32_t page_for_address(uintptr_t address)
 	return (address >> 12) & 0x3FF;
 }
 
+static struct page *page_table_window(uint32_t table)
+{
+	// Kernel page tables are the same in every address space, so they can 
+	// always be reached through the window. Tables in the lower half are those
+	// of the current address space.
+	return (struct page *)(kPAGE_TABLE_WINDOW + (table * page_size));
+}
+
+static struct page *window_page(uintptr_t address)
+{
+	return &page_table_window(page_table_for_address(address))[
+		page_for_address(address)
+	];
+}
+
 int is_page_allocated(uintptr_t address)
 {
 	uint32_t table = page_table_for_address(address);
 	uint32_t page = page_for_address(address);
 
 	// Check to see if the required page table exists.
-	struct page_table *directory = (void *)(
-		kernel_address_space->directory_address
-	);
-
-	if (directory[table].present == 0)
+	if (kernel_directory[table].present == 0)
 		return kNO_PAGE_TABLE_ALLOCATED;
+	else if (kernel_directory[table].size)
+		return kPAGE_ALLOCATED;
 
-	// Check to see if the required page is present. For this we need to find
-	// the linear address of the page table.
-	struct page *page_table = (void *)(
-		kernel_address_space->page_table_address[table]
-	);
+	// Check to see if the required page is present. The page table is found
+	// through the page table window.
+	struct page *page_table = page_table_window(table);
 
-	if (page_table[page].present == 0)
-		return kNO_PAGE_ALLOCATED;
+	if (page_table[page].present == 0 && page_table[page].guard)
+		return kPAGE_GUARD;
+	else if (page_table[page].present == 0)
+		return page_table[page].reserved ? kPAGE_RESERVED : kNO_PAGE_ALLOCATED;
 
 	// At this point we can assume that the page is allocated.
 	return kPAGE_ALLOCATED;
 }
 
-uintptr_t first_available_kernel_page(void)
+static struct virtual_range *virtual_range_node(
+	uintptr_t start, 
+	uintptr_t end,
+	struct virtual_range *next
+) {
+	struct virtual_range *range = spare_ranges;
+	if (!range) {
+		struct panic_info info = (struct panic_info) {
+			panic_memory,
+			"KERNEL ADDRESS SPACE TOO FRAGMENTED",
+			"The kernel has run out of nodes to track the free ranges of its "
+			"address space."
+		};
+		panic(&info, NULL);
+	}
+	spare_ranges = range->next;
+
+	range->start = start;
+	range->end = end;
+	range->next = next;
+	return range;
+}
+
+static void virtual_range_release_node(struct virtual_range *range)
 {
-	// Step through kernel pages to try and find the first available one.
-	for (
-		uintptr_t address = first_available_kernel_address;
-		address < 0xFFFFFFFF;
-		address += page_size
+	range->next = spare_ranges;
+	spare_ranges = range;
+}
+
+static void virtual_range_insert(uintptr_t start, uintptr_t end)
+{
+	// The free ranges are shared by every CPU.
+	atom_t atom;
+	atomic_start(atom);
+
+	// Find the ranges either side of the new one.
+	struct virtual_range *prev = NULL;
+	struct virtual_range *next = free_ranges;
+	while (next && next->start < start) {
+		prev = next;
+		next = next->next;
+	}
+
+	// Space that is already free must not be given back again. Merging it in
+	// would hand the same addresses out twice.
+	if (start >= end 
+		|| (prev && prev->end > start) 
+		|| (next && next->start < end)
 	) {
-		switch (is_page_allocated(address)) {
-		case kPAGE_ALLOCATED:
+		struct panic_info info = (struct panic_info) {
+			panic_memory,
+			"KERNEL ADDRESS SPACE RELEASED TWICE",
+			"The kernel attempted to release a range of its address space that "
+			"was already free."
+		};
+		panic(&info, NULL);
+	}
+
+	// Merge with the surrounding ranges where they touch, otherwise add a new
+	// node between them.
+	if (prev && prev->end == start) {
+		prev->end = end;
+		if (next && next->start == end) {
+			prev->end = next->end;
+			prev->next = next->next;
+			virtual_range_release_node(next);
+		}
+	}
+	else if (next && next->start == end) {
+		next->start = start;
+	}
+	else if (prev) {
+		prev->next = virtual_range_node(start, end, next);
+	}
+	else {
+		free_ranges = virtual_range_node(start, end, next);
+	}
+
+	atomic_end(atom);
+}
+
+static void virtual_range_remove(uintptr_t start, uintptr_t end)
+{
+	atom_t atom;
+	atomic_start(atom);
+
+	struct virtual_range *prev = NULL;
+	struct virtual_range *range = free_ranges;
+	while (range && range->start < end) {
+		struct virtual_range *next = range->next;
+
+		if (range->end <= start) {
+			prev = range;
+		}
+		else if (range->start >= start && range->end <= end) {
+			// The range is covered entirely, so it is removed.
+			if (prev)
+				prev->next = next;
+			else
+				free_ranges = next;
+			virtual_range_release_node(range);
+		}
+		else if (range->start < start && range->end > end) {
+			// The range is split in two around the removed space.
+			range->next = virtual_range_node(end, range->end, next);
+			range->end = start;
+			break;
+		}
+		else if (range->start < start) {
+			range->end = start;
+			prev = range;
+		}
+		else {
+			range->start = end;
+			prev = range;
+		}
+
+		range = next;
+	}
+
+	atomic_end(atom);
+}
+
+static uintptr_t virtual_range_take(uint32_t count, uint32_t align)
+{
+	// Take the space from the front of the first range that is large enough.
+	// This keeps allocations packed towards the start of the address space.
+	size_t length = count * page_size;
+	uintptr_t mask = (align * page_size) - 1;
+	uintptr_t result = 0;
+
+	atom_t atom;
+	atomic_start(atom);
+
+	struct virtual_range *range = free_ranges;
+	while (range) {
+		uintptr_t address = (range->start + mask) & ~mask;
+		if (address >= range->start 
+			&& address < range->end 
+			&& range->end - address >= length
+		) {
+			virtual_range_remove(address, address + length);
+			result = address;
 			break;
+		}
+
+		range = range->next;
+	}
 
-		case kNO_PAGE_TABLE_ALLOCATED:
-		case kNO_PAGE_ALLOCATED:
-			return address;
+	atomic_end(atom);
+	return result;
+}
+
+static void virtual_range_prepare(void)
+{
+	// Give every node in the pool to the spare list.
+	struct virtual_range *pool = (void *)reserve_kernel_working_memory(
+		VIRTUAL_RANGE_NODES * sizeof(*pool)
+	);
+	for (uint32_t n = 0; n < VIRTUAL_RANGE_NODES; ++n) 
+		virtual_range_release_node(&pool[n]);
+
+	// Walk the kernel address space once to find what is already in use. Page
+	// tables that are not present can be skipped over entirely.
+	uintptr_t run_start = 0;
+	uintptr_t address = first_available_kernel_address;
+	while (address < kLAST_KERNEL_ADDRESS) {
+		int result = is_page_allocated(address);
+		uintptr_t next = address + page_size;
+		if (result == kNO_PAGE_TABLE_ALLOCATED)
+			next = (address + (page_size * PAGE_MAX_ENTRIES)) 
+				 & ~((page_size * PAGE_MAX_ENTRIES) - 1);
+		if (next == 0 || next > kLAST_KERNEL_ADDRESS)
+			next = kLAST_KERNEL_ADDRESS;
+
+		if (result == kPAGE_ALLOCATED 
+			|| result == kPAGE_RESERVED 
+			|| result == kPAGE_GUARD
+		) {
+			if (run_start)
+				virtual_range_insert(run_start, address);
+			run_start = 0;
 		}
+		else if (run_start == 0) {
+			run_start = address;
+		}
+
+		address = next;
 	}
 
+	if (run_start)
+		virtual_range_insert(run_start, kLAST_KERNEL_ADDRESS);
+}
+
+uintptr_t first_available_kernel_page(void)
+{
+	// The free ranges are sorted, so the first available page is the start of
+	// the first range.
+	if (free_ranges)
+		return free_ranges->start;
+
 	// At this point we can safely assume that there are _no_ available kernel
 	// space addresses left.
 	struct panic_info info = (struct panic_info) {
@@ -117,31 +355,14 @@ uintptr_t first_available_kernel_page(void)
 
 uintptr_t find_available_contiguous_kernel_pages(uint32_t count)
 {
-	uintptr_t start_page_address = 0;
-	uint32_t available_page_count = 0;
-
-	for (
-		uintptr_t address = first_available_kernel_address;
-		address < 0xFFFFFFFF;
-		address += page_size
-	) {
-		switch (is_page_allocated(address)) {
-			case kPAGE_ALLOCATED: {
-				start_page_address = 0;
-				available_page_count = 0;
-				break;
-			}
-
-			case kNO_PAGE_TABLE_ALLOCATED:
-			case kNO_PAGE_ALLOCATED: {
-				if (start_page_address == 0) 
-					start_page_address = address;
+	return find_available_aligned_kernel_pages(count, 1);
+}
 
-				if (++available_page_count >= count)
-					return start_page_address;
-			}
-		}
-	}
+uintptr_t find_available_aligned_kernel_pages(uint32_t count, uint32_t align)
+{
+	uintptr_t address = virtual_range_take(count, align);
+	if (address)
+		return address;
 
 	// At this point we can safely assume that there are not _enough_ available 
 	// kernel space addresses left.
@@ -157,120 +378,701 @@ uintptr_t find_available_contiguous_kernel_pages(uint32_t count)
 	return 0;
 }
 
+void release_kernel_pages(uintptr_t address, uint32_t count)
+{
+	virtual_range_insert(address, address + (count * page_size));
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void kernel_directory_changed(void);
+static void kernel_directory_removed(void);
+
 void kpage_table_alloc(uintptr_t address)
 {
-	// Make sure that there is no page table already allocated!
-	if (is_page_allocated(address) != kNO_PAGE_TABLE_ALLOCATED)
+	// Make sure that there is no page table already allocated! Another CPU
+	// may be installing the same page table.
+	atom_t atom;
+	atomic_start(atom);
+	if (is_page_allocated(address) != kNO_PAGE_TABLE_ALLOCATED) {
+		atomic_end(atom);
 		return;
+	}
 
 	uint32_t page_table = page_table_for_address(address);
 
-	struct virtual_address_space *address_space = kernel_address_space;
+	// We need to request a physical frame for the page table. It must be clear
+	// so that the MMU doesn't become corrupted with garbage data. Until the
+	// kmap slots exist, it can only be cleared once it is in the window.
+	int zeroed = (kmap_base != 0);
+	uintptr_t pt_frame = zeroed ? kframe_alloc_zeroed() : kframe_alloc();
 
-	// We need to take a chunk of the reserved space and claim it as the new
-	// page table linear address.
-	if (address_space->next_page_table > last_page_table_address) {
-		struct panic_info info = (struct panic_info) {
-			panic_memory,
-			"UNABLE TO ALLOCATE PAGE TABLE FOR VIRTUAL ADDRESS SPACE",
-			"The specified address space has exhausted all memory reserved for "
-			"page table allocation."
-		};
-		panic(&info, NULL);
+	// Install the page table. The directory entry was not present before, and
+	// the CPU does not cache entries that are not present, so there is nothing
+	// to flush. The page being mapped is invalidated by kpage_alloc.
+	// fprintf(dbgout, "Installing page table %d with frame %p\n", 
+	// 	page_table, pt_frame);
+	kernel_directory[page_table].frame = pt_frame >> 12;
+	kernel_directory[page_table].present = 1;
+	kernel_directory[page_table].readwrite = 1;
+	// fprintf(dbgout, "Page table %d is now installed!\n", page_table);
+
+	if (address >= kKERNEL_BASE)
+		kernel_directory_changed();
+
+	// The page table is now visible in the window, which may have held an
+	// older page table.
+	struct page *table = page_table_window(page_table);
+	tlb_invalidate_page((uintptr_t)table);
+	if (!zeroed)
+		memset(table, 0, page_size);
+
+	atomic_end(atom);
+}
+
+static int kpage_alloc_frame(uintptr_t address, int zeroed)
+{
+	// Check to see if the page is already allocated in some capacity
+	atom_t atom;
+	atomic_start(atom);
+	int result = is_page_allocated(address);
+	if (result == kPAGE_ALLOCATED || result == kPAGE_GUARD) {
+		atomic_end(atom);
+		return kPAGE_ALLOC_ERROR;
+	}
+
+	// Check to see if we need to allocate the appropriate page table for the
+	// address.
+	if (result == kNO_PAGE_TABLE_ALLOCATED)
+		kpage_table_alloc(address);
+
+	// The page may still be in the free address space if it has been chosen
+	// by the caller directly.
+	if (result != kPAGE_RESERVED)
+		virtual_range_remove(address, address + page_size);
+
+	// At this point we can safely allocate a frame to the page. 
+	uintptr_t frame_address = zeroed ? kframe_alloc_zeroed() : kframe_alloc();
+
+	struct page *page = window_page(address);
+	page->frame = frame_address >> 12;
+	page->reserved = 0;
+	page->global = (address >= kKERNEL_BASE && tlb_global_pages_enabled());
+	page->present = 1;
+	page->readwrite = 1;
+
+	// Finally invalidate the page in the TLB.
+	tlb_invalidate_page(address);
+
+	atomic_end(atom);
+	return kPAGE_ALLOC_OK;
+}
+
+int kpage_alloc(uintptr_t address)
+{
+	return kpage_alloc_frame(address, 0);
+}
+
+static void kpage_unmap(uintptr_t address, uint32_t reserve)
+{
+	struct page *page = window_page(address);
+	uintptr_t frame_address = page->frame << 12;
+
+	// Remove the mapping and invalidate the page in the TLB before the frame
+	// is returned, so that nothing can reach the frame through a stale entry.
+	page->frame = 0;
+	page->readwrite = 0;
+	page->present = 0;
+	page->global = 0;
+	page->reserved = reserve;
+	tlb_invalidate_page(address);
+	tlb_shootdown();
+
+	kframe_free(frame_address);
+}
+
+static int kpage_claim(uintptr_t address, uint32_t guard)
+{
+	int result = is_page_allocated(address);
+	if (result == kNO_PAGE_TABLE_ALLOCATED)
+		kpage_table_alloc(address);
+	else if (result != kNO_PAGE_ALLOCATED)
+		return kPAGE_ALLOC_ERROR;
+
+	virtual_range_remove(address, address + page_size);
+
+	window_page(address)->reserved = 1;
+	window_page(address)->guard = guard;
+	return kPAGE_ALLOC_OK;
+}
+
+int kpage_reserve(uintptr_t address)
+{
+	return kpage_claim(address, 0);
+}
+
+int kpage_guard(uintptr_t address)
+{
+	return kpage_claim(address, 1);
+}
+
+int kpage_large_available(void)
+{
+	return large_pages;
+}
+
+static int kpage_large_slot_matches(uintptr_t address, uintptr_t frame)
+{
+	// Make sure that installing a 4MiB page over the region would not change
+	// any existing mapping in it. When no frame is specified, nothing may be
+	// mapped or reserved in the region at all. When a frame is specified, 
+	// every page in the region must already map it, so that the 4MiB page does
+	// not make anything reachable that was not before.
+	uint32_t table_index = page_table_for_address(address);
+	if (!kernel_directory[table_index].present)
+		return 1;
+	else if (kernel_directory[table_index].size)
+		return 0;
+
+	struct page *table = page_table_window(table_index);
+	for (uint32_t page = 0; page < PAGE_MAX_ENTRIES; ++page) {
+		if (table[page].reserved || table[page].guard)
+			return 0;
+		else if (!table[page].present && !frame)
+			continue;
+		else if (!table[page].present || !frame)
+			return 0;
+		else if (table[page].frame != (frame >> 12) + page)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void kpage_install_large(uintptr_t address, uintptr_t frame, int owned)
+{
+	uint32_t table_index = page_table_for_address(address);
+	struct page_table *entry = &kernel_directory[table_index];
+
+	// A page table that was in the region is no longer referenced once the
+	// 4MiB page replaces it. Its entries have already been checked to map the
+	// same memory, or nothing at all.
+	uintptr_t table_frame = (entry->present && !entry->size) 
+						  ? (entry->frame << 12) : 0;
+
+	entry->frame = frame >> 12;
+	entry->owned = owned;
+	entry->global = (address >= kKERNEL_BASE && tlb_global_pages_enabled());
+	entry->size = 1;
+	entry->readwrite = 1;
+	entry->present = 1;
+	if (address >= kKERNEL_BASE && table_frame)
+		kernel_directory_removed();
+	else if (address >= kKERNEL_BASE)
+		kernel_directory_changed();
+
+	// Any 4KiB pages that were mapped in the region may still be cached.
+	virtual_range_remove(address, address + kLARGE_PAGE_SIZE);
+	tlb_invalidate_range(address, address + kLARGE_PAGE_SIZE);
+
+	// Every CPU has to stop walking the old page table before it is reused.
+	// No address space refers to it any more, but its entries may still be
+	// cached.
+	if (table_frame) {
+		tlb_invalidate_page((uintptr_t)page_table_window(table_index));
+		tlb_shootdown();
+		kframe_free(table_frame);
 	}
+}
 
-	uintptr_t pt_linear = address_space->next_page_table;
-	address_space->next_page_table += page_size;
+int kpage_alloc_large(uintptr_t address)
+{
+	if (!large_pages || (address & (kLARGE_PAGE_SIZE - 1)))
+		return kPAGE_ALLOC_ERROR;
 
-	if (is_page_allocated(pt_linear) == kNO_PAGE_TABLE_ALLOCATED) {
+	atom_t atom;
+	atomic_start(atom);
+	if (!kpage_large_slot_matches(address, 0)) {
+		atomic_end(atom);
+		return kPAGE_ALLOC_ERROR;
+	}
+
+	uintptr_t frame = kframe_alloc_order(kFRAME_MAX_ORDER);
+	if (!frame) {
+		atomic_end(atom);
+		return kPAGE_ALLOC_ERROR;
+	}
+
+	kpage_install_large(address, frame, 1);
+	atomic_end(atom);
+	return kPAGE_ALLOC_OK;
+}
+
+int kpage_map_large(uintptr_t address, uintptr_t frame)
+{
+	if (!large_pages || (address & (kLARGE_PAGE_SIZE - 1)))
+		return kPAGE_ALLOC_ERROR;
+	else if ((frame & (kLARGE_PAGE_SIZE - 1)) || !frame)
+		return kPAGE_ALLOC_ERROR;
+
+	atom_t atom;
+	atomic_start(atom);
+	if (!kpage_large_slot_matches(address, frame)) {
+		atomic_end(atom);
+		return kPAGE_ALLOC_ERROR;
+	}
+
+	kpage_install_large(address, frame, 0);
+	atomic_end(atom);
+	return kPAGE_ALLOC_OK;
+}
+
+uintptr_t kpage_map_device(uintptr_t frame, uint32_t length)
+{
+	// Device registers must never be cached, and the mapping is the same in
+	// every address space so it can be global.
+	uintptr_t base = frame & ~(page_size - 1);
+	uint32_t count = (frame + length - base + page_size - 1) / page_size;
+	uintptr_t address = find_available_contiguous_kernel_pages(count);
+
+	atom_t atom;
+	atomic_start(atom);
+	for (uint32_t n = 0; n < count; ++n) {
+		uintptr_t page_address = address + (n * page_size);
+		if (is_page_allocated(page_address) == kNO_PAGE_TABLE_ALLOCATED)
+			kpage_table_alloc(page_address);
+
+		struct page *page = window_page(page_address);
+		page->frame = (base + (n * page_size)) >> 12;
+		page->reserved = 0;
+		page->global = tlb_global_pages_enabled();
+		page->write_through = (cache_uncached & 1);
+		page->cache_disable = (cache_uncached >> 1) & 1;
+		page->attribute = 0;
+		page->present = 1;
+		page->readwrite = 1;
+		tlb_invalidate_page(page_address);
+	}
+	atomic_end(atom);
+
+	return address + (frame - base);
+}
+
+static int kpage_free_large(uintptr_t address)
+{
+	atom_t atom;
+	atomic_start(atom);
+
+	struct page_table *entry = &kernel_directory[page_table_for_address(address)];
+	if (!entry->present || !entry->size) {
+		atomic_end(atom);
+		return 0;
+	}
+	else if (address & (kLARGE_PAGE_SIZE - 1)) {
+		atomic_end(atom);
+		return 1;
+	}
+
+	uintptr_t frame = entry->frame << 12;
+	int owned = entry->owned;
+	*(uint32_t *)entry = 0;
+	if (address >= kKERNEL_BASE)
+		kernel_directory_removed();
+	tlb_invalidate_range(address, address + kLARGE_PAGE_SIZE);
+	tlb_shootdown();
+
+	if (owned)
+		kframe_free_order(frame, kFRAME_MAX_ORDER);
+	virtual_range_insert(address, address + kLARGE_PAGE_SIZE);
+
+	atomic_end(atom);
+	return 1;
+}
+
+uintptr_t kpage_physical_address(uintptr_t address)
+{
+	struct page_table *entry = &kernel_directory[page_table_for_address(address)];
+	if (!entry->present)
+		return 0;
+	else if (entry->size)
+		return (entry->frame << 12) + (address & (kLARGE_PAGE_SIZE - 1));
+
+	struct page *page = window_page(address);
+	if (!page->present)
+		return 0;
+	return (page->frame << 12) + (address & (page_size - 1));
+}
+
+static int kpage_mtrr_write_combining(uintptr_t address, uint32_t length)
+{
+	// MTRRs work on physical memory, so the range needs to be physically
+	// contiguous for a single MTRR to cover it.
+	uintptr_t base = kpage_physical_address(address);
+	for (uint32_t offset = 0; offset < length; offset += page_size) {
+		if (kpage_physical_address(address + offset) != base + offset)
+			return kPAGE_ALLOC_ERROR;
+	}
+
+	return cache_mtrr_write_combining(base, length) == kCACHE_OK
+		 ? kPAGE_ALLOC_OK
+		 : kPAGE_ALLOC_ERROR;
+}
+
+int kpage_set_cache_mode(uintptr_t address, uint32_t length, enum cache_mode mode)
+{
+	// Without a Page Attribute Table the only way to get write-combining is
+	// through an MTRR. The page entries are left as write-back so that the
+	// MTRR type takes effect.
+	if (mode == cache_write_combining && !cache_pat_available())
+		return kpage_mtrr_write_combining(address, length);
+
+	uintptr_t start = address & ~(page_size - 1);
+	uintptr_t end = address + length;
+
+	for (uintptr_t page = start; page < end; page += page_size) {
+		struct page_table *entry = &kernel_directory[
+			page_table_for_address(page)
+		];
+		if (!entry->present)
+			return kPAGE_ALLOC_ERROR;
+		
+		// A 4MiB page has its memory type in the directory entry.
+		if (entry->size) {
+			entry->write_through = (mode & 1);
+			entry->cache_disable = (mode >> 1) & 1;
+			if (page >= kKERNEL_BASE)
+				kernel_directory_changed();
+			continue;
+		}
+
+		struct page *pte = window_page(page);
+		if (!pte->present)
+			return kPAGE_ALLOC_ERROR;
+
+		pte->write_through = (mode & 1);
+		pte->cache_disable = (mode >> 1) & 1;
+		pte->attribute = 0;
+	}
+
+	// Stale translations, and cache lines of the old type, must not survive.
+	tlb_invalidate_range(start, end);
+	tlb_shootdown();
+	cache_flush();
+	return kPAGE_ALLOC_OK;
+}
+
+void kpage_free(uintptr_t address)
+{
+	if (kpage_free_large(address))
+		return;
+
+	switch (is_page_allocated(address)) {
+		case kPAGE_ALLOCATED: {
+			kpage_unmap(address, 0);
+			virtual_range_insert(address, address + page_size);
+			break;
+		}
+
+		case kPAGE_GUARD:
+		case kPAGE_RESERVED: {
+			// There is no frame to give back, only the reservation.
+			window_page(address)->reserved = 0;
+			window_page(address)->guard = 0;
+			virtual_range_insert(address, address + page_size);
+			break;
+		}
+	}
+}
+
+void kpage_decommit(uintptr_t address)
+{
+	if (kernel_directory[page_table_for_address(address)].size)
+		return;
+	else if (is_page_allocated(address) != kPAGE_ALLOCATED)
+		return;
+	kpage_unmap(address, 1);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline uintptr_t kmap_slot_address(uint32_t cpu, uint32_t slot)
+{
+	return kmap_base + (((cpu * KMAP_SLOTS) + slot) * page_size);
+}
+
+void *kmap(uintptr_t frame)
+{
+	// Each CPU has its own slots, and the task holding one is kept on the CPU
+	// until it is released. Only the holders on this CPU can be using them, 
+	// and they are all still running, so running out of slots means that a 
+	// mapping has not been released.
+	preempt_disable();
+	irq_flags_t flags = irq_save();
+	uint32_t cpu = cpu_current()->index;
+
+	uint32_t available = ~kmap_used[cpu] & ((1U << KMAP_SLOTS) - 1);
+	if (!available) {
 		struct panic_info info = (struct panic_info) {
 			panic_memory,
-			"SYNCHRONISATION ISSUE IN VIRTUAL ADDRESS SPACE",
-			"Unable to allocate a new page table due to bad management of the "
-			"address space."
+			"TEMPORARY KERNEL MAPPINGS EXHAUSTED",
+			"Every kmap slot is in use. A mapping has not been released with "
+			"kunmap."
 		};
 		panic(&info, NULL);
 	}
 
-	// We also need to request a physical frame for the page table.
-	uintptr_t pt_frame = kframe_alloc();
+	uint32_t slot;
+	__asm__("bsfl %1, %0" : "=r"(slot) : "rm"(available));
+	kmap_used[cpu] |= (1U << slot);
 
-	// Setup the page table mapping so that we can find the association of the
-	// linear address and frame in the future.
-	address_space->page_table_address[page_table] = pt_linear;
+	irq_restore(flags);
 
-	// Add add it to the appropriate page table.
-	uint32_t pt_page_table = page_table_for_address(pt_linear);
-	uint32_t pt_page = page_for_address(pt_linear);
-	struct page_table *directory = (void *)(address_space->directory_address);
-	struct page *table = (void *)(
-		address_space->page_table_address[pt_page_table]
-	);
-	table[pt_page].frame = pt_frame >> 12;
-	table[pt_page].present = 1;
-	table[pt_page].readwrite = 1;
+	// No other CPU touches the slot, so only the local TLB entry needs to be
+	// invalidated.
+	uintptr_t address = kmap_slot_address(cpu, slot);
+	struct page *page = window_page(address);
+	page->frame = frame >> 12;
+	page->readwrite = 1;
+	page->present = 1;
+	tlb_invalidate_page(address);
+	return (void *)address;
+}
 
-	// Invalidate the page so that we can write to it.
-	__asm__ __volatile__("invlpg (%0)" :: "r"(pt_linear) : "memory");
+void kunmap(void *ptr)
+{
+	uintptr_t address = (uintptr_t)ptr & ~(page_size - 1);
+	uint32_t cpu = cpu_current()->index;
+	if (address < kmap_slot_address(cpu, 0) 
+		|| address >= kmap_slot_address(cpu, KMAP_SLOTS)
+	) {
+		return;
+	}
 
-	// Clear the page so that the MMU doesn't become corrupted with garbage data
-	memset((void *)pt_linear, 0, page_size);
+	struct page *page = window_page(address);
+	page->frame = 0;
+	page->readwrite = 0;
+	page->present = 0;
+	tlb_invalidate_page(address);
 
-	// Install the page table and then flush the entire TLB.
-	// fprintf(dbgout, "Installing page table %d with frame %p\n", 
-	// 	page_table, pt_frame);
-	directory[page_table].frame = pt_frame >> 12;
-	directory[page_table].present = 1;
-	directory[page_table].readwrite = 1;
-
-	__asm__ __volatile__(
-		"movl %%cr3, %%eax\n"
-		"movl %%eax, %%cr3"
-		::: "%eax"
-	);
-	// fprintf(dbgout, "Page table %d is now installed!\n", page_table);
+	uint32_t slot = (address - kmap_slot_address(cpu, 0)) / page_size;
+	irq_flags_t flags = irq_save();
+	kmap_used[cpu] &= ~(1U << slot);
+	irq_restore(flags);
+	preempt_enable();
 }
 
-int kpage_alloc(uintptr_t address)
+////////////////////////////////////////////////////////////////////////////////
+
+static void address_space_sync_kernel(struct virtual_address_space *space)
 {
-	// Check to see if the page is already allocated in some capacity
-	int result = is_page_allocated(address);
-	if (result == kPAGE_ALLOCATED)
+	// The recursive entry is the only entry of the kernel half that belongs to
+	// the address space itself.
+	struct page_table *directory = kmap(space->directory_frame);
+	for (uint32_t n = page_table_for_address(kKERNEL_BASE); 
+		n < kRECURSIVE_ENTRY; ++n
+	) {
+		directory[n] = kernel_directory[n];
+	}
+	kunmap(directory);
+	space->kernel_generation = kernel_directory_generation;
+}
+
+static void kernel_directory_changed(void)
+{
+	// Entries have only been added. Other address spaces pick them up when
+	// they are next switched to, or fault on the new region, but the current
+	// one must see them immediately.
+	kernel_directory_generation++;
+	if (current_address_space && current_address_space != kernel_address_space)
+		address_space_sync_kernel(current_address_space);
+}
+
+static void kernel_directory_removed(void)
+{
+	// An entry has been removed or replaced, and whatever it referred to is 
+	// about to be released. No address space can be left holding the old 
+	// entry, as it may be in use on another CPU, or be switched to before it
+	// is next synchronised. The caller must still shoot down the TLBs of the
+	// other CPUs before releasing the frames. The kernel lock must be held.
+	kernel_directory_generation++;
+	for (struct virtual_address_space *space = address_spaces; 
+		space; space = space->next
+	) {
+		address_space_sync_kernel(space);
+	}
+}
+
+static struct page *address_space_table(
+	struct page_table *directory,
+	uint32_t page_table
+) {
+	// Only the page tables owned by the process are its own. Anything else is
+	// shared with the kernel. The page table is returned mapped with kmap.
+	struct page_table *entry = &directory[page_table];
+	if (page_table >= page_table_for_address(kKERNEL_BASE))
+		return NULL;
+	else if (!entry->present || !entry->owned || entry->size)
+		return NULL;
+	return kmap(entry->frame << 12);
+}
+
+int kpage_fault(uintptr_t address, uint32_t error __attribute__((unused)))
+{
+	struct virtual_address_space *space = current_address_space;
+
+	// Nothing in the user half of an address space is backed lazily.
+	if (address < kKERNEL_BASE) {
+		fault_stats.unresolved++;
 		return kPAGE_ALLOC_ERROR;
+	}
 
-	// Check to see if we need to allocate the appropriate page table for the
-	// address.
-	if (result == kNO_PAGE_TABLE_ALLOCATED)
-		kpage_table_alloc(address);
+	// The kernel directory may have gained entries since the address space 
+	// was last synchronised with it.
+	if (space != kernel_address_space 
+		&& space->kernel_generation != kernel_directory_generation
+	) {
+		address_space_sync_kernel(space);
+		fault_stats.kernel_syncs++;
+		return kPAGE_ALLOC_OK;
+	}
 
-	// At this point we can safely allocate a frame to the page. 
-	uintptr_t frame_address = kframe_alloc();
+	switch (is_page_allocated(address)) {
+		case kPAGE_RESERVED: {
+			// Reserved kernel regions, such as heap arenas and thread stacks,
+			// are only backed as they are used.
+			uintptr_t base = address & ~(page_size - 1);
+			if (kpage_alloc_frame(base, 1) == kPAGE_ALLOC_ERROR)
+				break;
+			fault_stats.kernel_commits++;
+			return kPAGE_ALLOC_OK;
+		}
 
-	uint32_t page_table = page_table_for_address(address);
-	uint32_t page = page_for_address(address);
+		case kPAGE_GUARD: {
+			fault_stats.guard_hits++;
+			return kPAGE_ALLOC_ERROR;
+		}
+	}
 
-	struct virtual_address_space *address_space = kernel_address_space;
-	struct page *table = (void *)(
-		address_space->page_table_address[page_table]
-	);
-	table[page].frame = frame_address >> 12;
-	table[page].present = 1;
-	table[page].readwrite = 1;
+	fault_stats.unresolved++;
+	return kPAGE_ALLOC_ERROR;
+}
 
-	// Finally invalidate the page in the TLB.
-	__asm__ __volatile__("invlpg (%0)" :: "r"(address) : "memory");
+void kpage_fault_stats(struct page_fault_statistics *stats)
+{
+	*stats = fault_stats;
+}
 
-	return kPAGE_ALLOC_OK;
+void kpage_dump_fault_stats(void)
+{
+	struct page_fault_statistics stats;
+	kpage_fault_stats(&stats);
+
+	fprintf(dbgout, "=== Page Fault Statistics ===\n");
+	fprintf(dbgout, "  kernel: %d committed, %d directory syncs\n",
+		stats.kernel_commits, stats.kernel_syncs);
+	fprintf(dbgout, "  guard pages: %d, unresolved: %d\n",
+		stats.guard_hits, stats.unresolved);
 }
 
-void kpage_free(uintptr_t address)
+struct virtual_address_space *address_space_get_kernel(void)
+{
+	return kernel_address_space;
+}
+
+struct virtual_address_space *address_space_get_current(void)
 {
-	fprintf(dbgout, "Freeing page for linear address %p\n", address);
+	return current_address_space;
 }
 
+struct virtual_address_space *address_space_create(void)
+{
+	struct virtual_address_space *space = kalloc(sizeof(*space));
+	memset(space, 0, sizeof(*space));
+	space->directory_frame = kframe_alloc_zeroed();
+
+	// The low memory mappings made by the boot loader hold structures that the
+	// CPU needs in every address space, such as the IDT. They are shared, and
+	// remain inaccessible from user mode.
+	struct page_table *directory = kmap(space->directory_frame);
+	for (uint32_t n = 0; n < page_table_for_address(kKERNEL_BASE); ++n) {
+		if (!kernel_directory[n].present)
+			continue;
+		directory[n] = kernel_directory[n];
+		directory[n].owned = 0;
+	}
+
+	// The last entry maps the directory onto itself, so that the page tables
+	// can be reached while the address space is current.
+	directory[kRECURSIVE_ENTRY].frame = space->directory_frame >> 12;
+	directory[kRECURSIVE_ENTRY].readwrite = 1;
+	directory[kRECURSIVE_ENTRY].present = 1;
+	kunmap(directory);
+
+	// The address space has to be on the list before the kernel directory can
+	// change again, or it could miss an entry being removed.
+	atom_t atom;
+	atomic_start(atom);
+	address_space_sync_kernel(space);
+	space->next = address_spaces;
+	address_spaces = space;
+	atomic_end(atom);
+
+	return space;
+}
+
+void address_space_destroy(struct virtual_address_space *space)
+{
+	if (!space || space == kernel_address_space) 
+		return;
+	else if (space == current_address_space) {
+		fprintf(dbgout, "WARNING: Attempting to destroy the current address "
+			"space.\n");
+		return;
+	}
+
+	atom_t atom;
+	atomic_start(atom);
+	struct virtual_address_space **link = &address_spaces;
+	while (*link && *link != space)
+		link = &(*link)->next;
+	if (*link)
+		*link = space->next;
+	atomic_end(atom);
+
+	struct page_table *directory = kmap(space->directory_frame);
+	for (uint32_t n = 0; n < page_table_for_address(kKERNEL_BASE); ++n) {
+		struct page *table = address_space_table(directory, n);
+		if (!table)
+			continue;
+
+		for (uint32_t page = 0; page < PAGE_MAX_ENTRIES; ++page) {
+			if (table[page].present)
+				kframe_free(table[page].frame << 12);
+		}
+		kunmap(table);
+		kframe_free(directory[n].frame << 12);
+	}
+	kunmap(directory);
+
+	kframe_free(space->directory_frame);
+	kfree(space);
+}
+
+void address_space_switch(struct virtual_address_space *space)
+{
+	if (!space || space == current_address_space)
+		return;
+	else if (space != kernel_address_space 
+		&& space->kernel_generation != kernel_directory_generation
+	) {
+		address_space_sync_kernel(space);
+	}
+
+	current_address_space = space;
+	set_cr3(space->directory_frame);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -302,50 +1104,65 @@ void prepare_kernel_address_space(void)
 	memset(kernel_address_space, 0, sizeof(*kernel_address_space));
 
 	kernel_address_space->directory_frame = REGISTER(cr3) & ~0xFFF;
-	kernel_address_space->directory_address = REGISTER(cr3) & ~0xFFF;
+	kernel_directory = (void *)(kernel_address_space->directory_frame);
 
-	struct page_table *directory = (void *)(
-		kernel_address_space->directory_address
+	// Map the page directory onto itself through its last entry. Every page
+	// table then appears in the last 4MiB of the address space, and the 
+	// directory in the last page of it.
+	if (kernel_directory[kRECURSIVE_ENTRY].present) {
+		struct panic_info info = (struct panic_info) {
+			panic_memory,
+			"INVALID KERNEL ADDRESS SPACE",
+			"The last 4MiB of the address space are already mapped, and can "
+			"not be used to reach the page tables."
+		};
+		panic(&info, NULL);
+	}
+	kernel_directory[kRECURSIVE_ENTRY].frame = (
+		kernel_address_space->directory_frame >> 12
 	);
-	for (uint32_t n = 0; n < PAGE_MAX_ENTRIES; ++n) {
-		if (!directory[n].present)
-			continue;
+	kernel_directory[kRECURSIVE_ENTRY].readwrite = 1;
+	kernel_directory[kRECURSIVE_ENTRY].present = 1;
+
+	// Mark the existing kernel mappings as global so that they are kept in 
+	// the TLB across address space switches.
+	if (tlb_global_pages_enabled()) {
+		for (uint32_t n = page_table_for_address(kKERNEL_BASE); 
+			n < kRECURSIVE_ENTRY; ++n
+		) {
+			if (!kernel_directory[n].present || kernel_directory[n].size)
+				continue;
 
-		kernel_address_space->page_table_address[n] = directory[n].frame << 12;
-		fprintf(dbgout, "  Page table %d has an address of %p\n", 
-			n, kernel_address_space->page_table_address[n]);
+			struct page *table = page_table_window(n);
+			for (uint32_t page = 0; page < PAGE_MAX_ENTRIES; ++page) {
+				if (table[page].present)
+					table[page].global = 1;
+			}
+		}
+		tlb_flush_global();
 	}
 
-	// Determine what the first page-aligned address is after the kernel. This
-	// is where we'll allocate pages for the page tables.
+	// Determine what the first page-aligned address is after the kernel.
 	first_available_kernel_address = first_kernel_address = (
 		(kernel_end_address() + page_size) & ~(page_size - 1)
 	);
 	fprintf(dbgout, "First available kernel space address is %p\n", 
 		first_available_kernel_address);
 
-	// The next job is to reserve enough space for the page tables to be 
-	// allocated. This is a range of memory that will be used by each address
-	// space to house their own page tables. Shared memory will be mapped 
-	// between each.
-	first_page_table_address = first_available_kernel_address;
-	kernel_address_space->next_page_table = first_page_table_address;
-	first_available_kernel_address += page_size * total_page_tables;
-	last_page_table_address = first_available_kernel_address - page_size;
-	fprintf(dbgout, "Reserved 4MiB for virtual address space page tables\n");
-	fprintf(dbgout, "Revised first available kernel space address is %p\n", 
-		first_available_kernel_address);
+	// Build the list of free ranges in the kernel address space.
+	virtual_range_prepare();
 
-	// Check to see if we need to allocate any page tables for reserved memory.
-	for (uint32_t n = 0; n < total_page_tables; ++n) {
-		uintptr_t address = (
-			(n * page_size) + kernel_address_space->next_page_table
-		);
-		if (is_page_allocated(address) == kNO_PAGE_TABLE_ALLOCATED) {
+	// Finally claim the slots through which frames that are not mapped in the
+	// kernel can be reached, such as the page tables of other address spaces.
+	kmap_base = find_available_contiguous_kernel_pages(KMAP_SLOTS * kMAX_CPUS);
+	for (uint32_t n = 0; n < KMAP_SLOTS * kMAX_CPUS; ++n) {
+		uintptr_t address = kmap_base + (n * page_size);
+		if (is_page_allocated(address) == kNO_PAGE_TABLE_ALLOCATED)
 			kpage_table_alloc(address);
-		}
 	}
 
+	current_address_space = kernel_address_space;
+
 	fprintf(dbgout, "Kernel virtual address space is now ready for use.\n");
 }
 
@@ -355,5 +1172,13 @@ void prepare_kernel_address_space(void)
 void virtual_memory_prepare(struct boot_config *config)
 {
 	validate_kernel_address_space(config);
+
+	// Enable 4MiB pages if the CPU supports them.
+	if (cpu_pse_available()) {
+		set_cr4(get_cr4() | kCR4_PSE);
+		large_pages = 1;
+		fprintf(dbgout, "4MiB pages have been enabled\n");
+	}
+
 	prepare_kernel_address_space();
 }
@@ -0,0 +1,71 @@
+; Copyright (c) 2017-2018 Tom Hancocks
+; 
+; Permission is hereby granted, free of charge, to any person obtaining a copy
+; of this software and associated documentation files (the "Software"), to deal
+; in the Software without restriction, including without limitation the rights
+; to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+; copies of the Software, and to permit persons to whom the Software is
+; furnished to do so, subject to the following conditions:
+; 
+; The above copyright notice and this permission notice shall be included in all
+; copies or substantial portions of the Software.
+; 
+; THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+; IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+; FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+; AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+; LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+; OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+; SOFTWARE.
+
+
+	[bits 	32]
+
+
+	global zero_page_nontemporal
+
+;;
+;; Clear a 4KiB page without pulling it into the cache. The page is written
+;; with non-temporal stores when SSE2 is available, and with rep stosd
+;; otherwise.
+;;
+;; 	void zero_page_nontemporal(void *page)
+;;
+zero_page_nontemporal:
+	.prologue:
+		push ebp
+		mov ebp, esp
+		push edi
+		push ebx
+	.check_sse2:
+		mov eax, 1
+		cpuid
+		mov edi, [ebp + 8]
+		xor eax, eax
+		test edx, 1 << 26					; Check for SSE2 capabilities
+		jz .no_sse2
+	.sse2:
+		mov ecx, 0x1000 / 0x20
+	.sse2_loop:
+		movnti [edi + 0x00], eax
+		movnti [edi + 0x04], eax
+		movnti [edi + 0x08], eax
+		movnti [edi + 0x0C], eax
+		movnti [edi + 0x10], eax
+		movnti [edi + 0x14], eax
+		movnti [edi + 0x18], eax
+		movnti [edi + 0x1C], eax
+		add edi, 0x20
+		dec ecx
+		jnz .sse2_loop
+		sfence								; Order the stores before the page
+		jmp .epilogue						; is handed out.
+	.no_sse2:
+		mov ecx, 0x1000 / 4
+		rep stosd
+	.epilogue:
+		pop ebx
+		pop edi
+		mov esp, ebp
+		pop ebp
+		ret
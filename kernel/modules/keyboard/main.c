@@ -49,15 +49,12 @@ int keyboard_main(void)
 	}
 
 	// Get the actual pipe.
-	atom_t key_event_atom;
 	struct pipe *pipe = input_pipes[0];
 
 	// Enter an infinite loop and keep checking for input.
 	while (1) {
 		// Wait for input, and then process it.
-		while (!pipe_has_unread(pipe, NULL)) {
-			key_wait();
-		}
+		wait_event(&pipe->readers, pipe_has_unread(pipe, NULL));
 
 		bool is_empty = false;
 		uint8_t scancode = 0;
@@ -65,14 +62,14 @@ int keyboard_main(void)
 			continue;
 		}
 
-		atomic_start(key_event_atom);
+		// Only this thread translates scancodes, and the pipes that it reads 
+		// from and writes to are locked, so nothing else needs to be held.
 		fprintf(dbgout, "[KBD] Received scancode: %02x\n", scancode);
 
 		struct keyevent *event = keyevent_make(scancode);
 		if (event->pressed) {
 			free(event);
 			fprintf(dbgout, "[KBD] Ignoring\n");
-			atomic_end(key_event_atom);
 			continue;
 		}
 
@@ -91,7 +88,5 @@ int keyboard_main(void)
 		struct pipe *stdin = pipe_get_best(key, p_recv);
 		fprintf(dbgout, "[KBD] Using pipe <%p>\n", stdin);
 		pipe_write_byte(stdin, c);
-
-		atomic_end(key_event_atom);
 	}
 }
@@ -27,7 +27,6 @@
 #include <stdio.h>
 #include <process.h>
 #include <pipe.h>
-#include <atomic.h>
 #include <device/keyboard/keyboard.h>
 #include <device/device.h>
 
@@ -46,10 +45,9 @@ void terminal_receive_pipes(void)
 	for (uint32_t i = 0; i < pipe_count; ++i) {
 		struct pipe *pipe = input_pipes[i];
 		ssize_t unread_len = 0;
-		
-		atom_t pipe_read;
-		atomic_start(pipe_read);
 
+		// The terminal is the only reader of its pipes, so the unread bytes can
+		// be inspected without holding anything. Writers only ever append.
 		if (pipe_has_unread(pipe, &unread_len) && unread_len > 0) {
 			while (unread_len) {
 				// Try and locate where the end of the "string" is.
@@ -79,8 +77,6 @@ void terminal_receive_pipes(void)
 				free(str);
 			}
 		}
-
-		atomic_end(pipe_read);
 	}
 }
 
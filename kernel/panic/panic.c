@@ -26,6 +26,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <macro.h>
+#include <kheap.h>
 #include <boot_config.h>
 
 static const char *exception_name[] = {
@@ -140,7 +141,11 @@ __attribute__((noreturn)) void panic(
 		render_register("EIP", frame->eip, 2 + (18 * 0), y+9);
 		render_register("EFLAGS", frame->eflags, 2 + (18 * 1), y+9);
 	}
-	
+
+	// Running out of memory is easier to diagnose knowing what the heap was
+	// doing at the time.
+	if (info && info->type == panic_memory)
+		kheap_dump_stats();
 
 	// Make sure we don't return or process anything further.
 	while (1)
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <pipe.h>
 #include <process.h>
+#include <kheap.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -34,6 +35,10 @@
 #   define KERNEL_PIPE_SIZE     1024
 #endif
 
+#ifndef KERNEL_PIPE_ALIGN
+#   define KERNEL_PIPE_ALIGN    64
+#endif
+
 #ifndef KERNEL_MAX_PIPE_COUNT
 #   define KERNEL_MAX_PIPE_COUNT     8 * 1024
 #endif
@@ -53,7 +58,8 @@ struct pipe *pipe(enum pipe_purpose mask)
 
     struct pipe *new_pipe = calloc(1, sizeof(*new_pipe));
     new_pipe->size = KERNEL_PIPE_SIZE;
-    new_pipe->data = calloc(new_pipe->size, sizeof(*new_pipe->data));
+    new_pipe->data = kalloc_aligned(new_pipe->size, KERNEL_PIPE_ALIGN);
+    memset(new_pipe->data, 0, new_pipe->size);
     new_pipe->purpose = mask;
 
 
@@ -193,7 +199,16 @@ uint8_t pipe_read_byte(struct pipe *pipe, bool *empty)
         return '\0';
     }
     if (empty) *empty = false;
-    return pipe->data[pipe->read_ptr++ % pipe->size];
+
+    // The writer may be an interrupt handler on this CPU or a thread on any
+    // other, so the pointers are only moved under the lock of the pipe.
+    irq_flags_t flags = spin_lock_irqsave(&pipe->lock);
+    uint8_t byte = pipe->data[pipe->read_ptr++ % pipe->size];
+    spin_unlock_irqrestore(&pipe->lock, flags);
+
+    // There is now room for any writer waiting on a full pipe.
+    wake_all(&pipe->writers);
+    return byte;
 }
 
 uint8_t pipe_peek_byte(struct pipe *pipe, int32_t offset)
@@ -210,21 +225,30 @@ bool pipe_can_accept_write(struct pipe *pipe)
 
 void pipe_write_byte(struct pipe *pipe, uint8_t byte)
 {
-    if (!pipe_can_accept_write(pipe)) {
-        fprintf(dbgout, "Writing beyond pipe <%p> buffer!\n", pipe);
-        pipe->read_ptr++;
-    }
+    irq_flags_t flags = spin_lock_irqsave(&pipe->lock);
+    bool overflow = !pipe_can_accept_write(pipe);
+    if (overflow) pipe->read_ptr++;
     pipe->data[pipe->write_ptr++ % pipe->size] = byte;
+    spin_unlock_irqrestore(&pipe->lock, flags);
+
+    if (overflow)
+        fprintf(dbgout, "Writing beyond pipe <%p> buffer!\n", pipe);
+
+    // wake_all takes the lock of the wait queue, and a reader checks for data
+    // and joins the queue while holding it in wait_event, so a reader about 
+    // to sleep is never missed.
+    if (!pipe->read_lock) wake_all(&pipe->readers);
 }
 
 void pipe_write(struct pipe *pipe, uint8_t *bytes, size_t len)
 {
     pipe->read_lock = true;
     for (uint32_t i = 0; i < len; ++i) {
-        while (!pipe_can_accept_write(pipe)) {
-            __asm__ __volatile__("hlt");
-        }
+        wait_event(&pipe->writers, pipe_can_accept_write(pipe));
         pipe_write_byte(pipe, bytes[i]);
     }
     pipe->read_lock = false;
+
+    // Readers can only see the data once the whole write has completed.
+    wake_all(&pipe->readers);
 }
\ No newline at end of file
@@ -31,6 +31,8 @@
 #include <memory.h>
 #include <task.h>
 #include <atomic.h>
+#include <virtual.h>
+#include <physical.h>
 #include <drawing/base.h>
 #include <driver/vesa/console.h>
 #include <modules/terminal.h>
@@ -48,12 +50,22 @@ static struct process *key_process = NULL;
 static uint32_t process_count = 0;
 static uint32_t next_pid = 0;
 
+static struct process *process_create(
+	const char *name, 
+	int(*_entry)(void),
+	struct virtual_address_space *space
+);
+
 ////////////////////////////////////////////////////////////////////////////////
 
 int idle(void)
 {
+	// Spend idle time freeing killed tasks and clearing frames ahead of time,
+	// and only halt once the pool of pre-zeroed frames is full.
 	while (1) {
-		__asm__ __volatile__("hlt");
+		task_reap();
+		if (!kframe_zeroed_refill())
+			__asm__ __volatile__("hlt");
 	}
 }
 
@@ -95,6 +107,9 @@ void process_prepare(void)
 		panic(&info, NULL);
 	}
 
+	// The idle process only runs when nothing else is able to.
+	task_set_priority(idle_proc->threads.main, kTHREAD_PRIORITY_IDLE);
+
 	// Spawn the display process
 	struct process *display_proc = process_launch("display", display, P_ROOT);
 	display_proc->pid = DISPLAY_PID;
@@ -142,6 +157,12 @@ void process_prepare(void)
 		panic(&info, NULL);
 	}
 
+	// The display, terminal and keyboard spend their time waiting for input
+	// or their next frame, and need to respond as soon as it arrives.
+	task_set_class(display_proc->threads.main, thread_class_interactive);
+	task_set_class(terminal_proc->threads.main, thread_class_interactive);
+	task_set_class(keyboard_proc->threads.main, thread_class_interactive);
+
 	// MAke sure the next available PID is the starting PID.
 	next_pid = STARTING_PID;
 
@@ -166,59 +187,65 @@ struct process *process_launch(
 	if (!_entry && first_process)
 		return NULL;
 
-	atom_t atom;
-	atomic_start(atom);
-
-	struct process *proc = process_spawn(name ?: "(unnamed)", _entry);
-	if (!proc) 
-		return NULL;
-
+	struct virtual_address_space *space;
 	if (flags & P_USR) {
 		// Setup a new page directory for the user-mode process.
-		proc->page_dir = REGISTER(cr3);
+		space = address_space_create();
 	} 
 	else {
 		// Adopt the kernel page directory.
-		proc->page_dir = REGISTER(cr3);
+		space = address_space_get_kernel();
 	}
 
+	struct process *proc = process_create(name ?: "(unnamed)", _entry, space);
+	if (!proc) 
+		return NULL;
+
 	if ((proc->allow_frontmost = (flags & P_UI) ? 1 : 0) == 1) {
+		atom_t atom;
+		atomic_start(atom);
 		if (!frontmost_process) {
 			frontmost_process = proc;
 		}
+		atomic_end(atom);
 	}
 
-
 	fprintf(dbgout, "Process %d (%s) established with page directory: %p\n",
 		proc->pid, proc->name, proc->page_dir);
 
-	atomic_end(atom);
-
 	return proc;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-struct process *process_spawn(const char *name, int(*_entry)(void))
-{
+static struct process *process_create(
+	const char *name, 
+	int(*_entry)(void),
+	struct virtual_address_space *space
+) {
 	fprintf(dbgout, "Spawning new process: %s\n", name);
 
 	// Create a new blank process and prepare to populate it with the 
-	// appropriate information.
+	// appropriate information. The address space is assigned before the main
+	// thread is created, as the thread may start running straight away.
 	struct process *proc = kalloc(sizeof(*proc));
 	memset(proc, 0, sizeof(*proc));
 
 	// Basic metadata
 	proc->name = name;	// TODO: Copy the name string into the process.
-	proc->pid = next_pid++;
-	fprintf(dbgout, "   * assigning pid: %d\n", proc->pid);
+	proc->address_space = space;
+	proc->page_dir = space->directory_frame;
 
 	// TODO: Setup standard pipes here...
 
-	// Main thread
-	proc->threads.main = process_spawn_thread(proc, "Main Thread", _entry);
+	// Insert the process into the process chain/list. The process list is 
+	// still covered by the kernel lock, but allocating memory and creating
+	// the main thread are not done under it.
+	atom_t atom;
+	atomic_start(atom);
+
+	proc->pid = next_pid++;
 
-	// Insert the process into the process chain/list.
 	if (!first_process) {
 		first_process = proc;
 	}
@@ -231,9 +258,54 @@ struct process *process_spawn(const char *name, int(*_entry)(void))
 
 	++process_count;
 
+	atomic_end(atom);
+	fprintf(dbgout, "   * assigning pid: %d\n", proc->pid);
+
+	// Main thread
+	proc->threads.main = process_spawn_thread(proc, "Main Thread", _entry);
+
 	return proc;
 }
 
+struct process *process_spawn(const char *name, int(*_entry)(void))
+{
+	return process_create(name, _entry, address_space_get_kernel());
+}
+
+void process_destroy(struct process *proc)
+{
+	if (!proc || proc->pid == KERNEL_PID)
+		return;
+
+	fprintf(dbgout, "Destroying process %d (%s)\n", proc->pid, proc->name);
+
+	atom_t atom;
+	atomic_start(atom);
+
+	if (proc->prev)
+		proc->prev->next = proc->next;
+	else
+		first_process = proc->next;
+
+	if (proc->next)
+		proc->next->prev = proc->prev;
+	else
+		last_process = proc->prev;
+
+	if (frontmost_process == proc)
+		frontmost_process = NULL;
+	if (key_process == proc)
+		key_process = NULL;
+	--process_count;
+
+	atomic_end(atom);
+
+	// Nothing is running in the address space any more, as every one of its
+	// threads has been switched out for good.
+	address_space_destroy(proc->address_space);
+	kfree(proc);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 struct thread *process_spawn_thread(
@@ -257,6 +329,12 @@ struct thread *process_spawn_thread(
 	struct thread *thread = thread_create(label, start);
 	thread->owner = owner;
 
+	// The process lives for as long as any of its threads do.
+	atom_t atom;
+	atomic_start(atom);
+	owner->threads.count++;
+	atomic_end(atom);
+
 	// If their is a specified starting point (almost all threads) then we need
 	// to create a new stack for the thread.
 	if (start) {
@@ -21,81 +21,324 @@
 */
 
 #include <sema.h>
+#include <atomic.h>
 #include <thread.h>
+#include <task.h>
+#include <uptime.h>
+#include <stdio.h>
+#include <stddef.h>
 #include <arch/arch.h>
 
-static inline int atomic_swap(volatile int *x, int v)
+#define kEFLAGS_IF	0x200
+
+static struct spinlock kernel_lock = { 0 };
+static int kernel_lock_enabled = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline uint16_t atomic_fetch_inc16(volatile uint16_t *x)
 {
+	uint16_t v = 1;
 	__asm__ __volatile__(
-		"xchg %0, %1"
-		: "=r"(v), "=m"(*x)
-		: "0"(v)
+		"lock;"
+		"xaddw %0, %1"
+		: "+r"(v), "+m"(*x)
+		:
 		: "memory"
 	);
 	return v;
 }
 
-static inline void atomic_store(volatile int *p, int x)
+static inline void lock_stats_acquired(
+	struct lock_statistics *stats, 
+	uint32_t spins
+) {
+#if kLOCK_STATISTICS
+	stats->acquisitions++;
+	if (spins) {
+		stats->contentions++;
+		stats->spins += spins;
+	}
+#else
+	(void)stats;
+	(void)spins;
+#endif
+}
+
+static inline void lock_stats_waited(
+	struct lock_statistics *stats, 
+	uint64_t start
+) {
+#if kLOCK_STATISTICS
+	stats->contentions++;
+	stats->wait_time += get_uptime_ns() - start;
+#else
+	(void)stats;
+	(void)start;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+irq_flags_t irq_save(void)
 {
-	__asm__ __volatile__(
-		"movl %1, %0"
-		: "=m"(*p)
-		: "r"(x)
-		: "memory"
-	);
+	irq_flags_t flags = get_eflags() & kEFLAGS_IF;
+	__asm__ __volatile__("cli" ::: "memory");
+	return flags;
 }
 
-static inline void atomic_inc(volatile int *x)
+void irq_restore(irq_flags_t flags)
 {
-	__asm__ __volatile__(
-		"lock;"
-		"incl %0"
-		: "=m"(*x)
-		: "m"(*x)
-		: "memory"
-	);
+	if (flags & kEFLAGS_IF)
+		__asm__ __volatile__("sti" ::: "memory");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void spin_init(struct spinlock *lock)
+{
+	lock->next = 0;
+	lock->owner = 0;
+	lock->stats = (struct lock_statistics) { 0 };
+}
+
+void spin_lock(struct spinlock *lock)
+{
+	// Take a ticket, and wait for it to be served. The holder may be waiting
+	// for this CPU to flush its TLB, which it can not do through an interrupt
+	// if they are disabled.
+	uint16_t ticket = atomic_fetch_inc16(&lock->next);
+	uint32_t spins = 0;
+	while (lock->owner != ticket) {
+		tlb_shootdown_poll();
+		__asm__ __volatile__("pause" ::: "memory");
+		++spins;
+	}
+	lock_stats_acquired(&lock->stats, spins);
 }
 
-static inline void atomic_dec(volatile int *x)
+int spin_try_lock(struct spinlock *lock)
 {
+	// The lock is free when the next ticket is the one being served. Claiming 
+	// that ticket has to be done in one step, so that nobody else can take it
+	// in the meantime.
+	uint16_t owner = lock->owner;
+	uint16_t expected = owner;
+	uint16_t desired = owner + 1;
 	__asm__ __volatile__(
 		"lock;"
-		"decl %0"
-		: "=m"(*x)
-		: "m"(*x)
+		"cmpxchgw %2, %1"
+		: "+a"(expected), "+m"(lock->next)
+		: "r"(desired)
 		: "memory"
 	);
+	if (expected != owner)
+		return 0;
+
+	lock_stats_acquired(&lock->stats, 0);
+	return 1;
 }
 
-void spin_wait(volatile int *address, volatile int *waiters)
+void spin_unlock(struct spinlock *lock)
 {
-	if (waiters)
-		atomic_inc(waiters);
+	// Only the holder of the lock writes the owner, so a plain store is enough
+	// on x86 once the compiler has been told not to reorder around it.
+	__asm__ __volatile__("" ::: "memory");
+	lock->owner = lock->owner + 1;
+}
 
-	while (*address)
-		request_preemption();
+irq_flags_t spin_lock_irqsave(struct spinlock *lock)
+{
+	irq_flags_t flags = irq_save();
+	spin_lock(lock);
+	return flags;
+}
+
+void spin_unlock_irqrestore(struct spinlock *lock, irq_flags_t flags)
+{
+	spin_unlock(lock);
+	irq_restore(flags);
+}
 
-	if (waiters)
-		atomic_dec(waiters);
+////////////////////////////////////////////////////////////////////////////////
+
+void mutex_init(struct mutex *mutex)
+{
+	spin_init(&mutex->guard);
+	mutex->locked = 0;
+	mutex->owner = NULL;
+	wait_queue_init(&mutex->waiters);
+	mutex->stats = (struct lock_statistics) { 0 };
 }
 
-void spin_lock(spin_lock_t lock)
+void mutex_lock(struct mutex *mutex)
 {
-	while (atomic_swap(lock, 1))
-		spin_wait(lock, lock+1);
+	irq_flags_t flags = spin_lock_irqsave(&mutex->guard);
+
+	// Sleep until the mutex is free. The guard is held while joining the wait
+	// queue, so a release can not be missed. Woken threads compete for the 
+	// mutex again with any thread that arrived in the meantime.
+	if (mutex->locked) {
+		uint64_t start = get_uptime_ns();
+		while (mutex->locked) {
+			spin_lock(&mutex->waiters.lock);
+			wait_queue_join(&mutex->waiters);
+			spin_unlock(&mutex->waiters.lock);
+			spin_unlock_irqrestore(&mutex->guard, flags);
+			wait_queue_sleep();
+			flags = spin_lock_irqsave(&mutex->guard);
+		}
+		lock_stats_waited(&mutex->stats, start);
+	}
+
+	mutex->locked = 1;
+	mutex->owner = task_get_current();
+	lock_stats_acquired(&mutex->stats, 0);
+
+	spin_unlock_irqrestore(&mutex->guard, flags);
 }
 
-void spin_unlock(spin_lock_t lock)
+int mutex_try_lock(struct mutex *mutex)
 {
-	if (lock[0]) {
-		atomic_store(lock, 0);
-		if (lock[1])
-			request_preemption();
+	irq_flags_t flags = spin_lock_irqsave(&mutex->guard);
+	int acquired = !mutex->locked;
+	if (acquired) {
+		mutex->locked = 1;
+		mutex->owner = task_get_current();
+		lock_stats_acquired(&mutex->stats, 0);
 	}
+	spin_unlock_irqrestore(&mutex->guard, flags);
+	return acquired;
 }
 
-void spin_init(spin_lock_t lock)
+void mutex_unlock(struct mutex *mutex)
 {
-	lock[0] = 0;
-	lock[1] = 0;
-}
\ No newline at end of file
+	irq_flags_t flags = spin_lock_irqsave(&mutex->guard);
+	mutex->locked = 0;
+	mutex->owner = NULL;
+	wake_one(&mutex->waiters);
+	spin_unlock_irqrestore(&mutex->guard, flags);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void sema_init(struct semaphore *sema, int32_t count)
+{
+	spin_init(&sema->guard);
+	sema->count = count;
+	wait_queue_init(&sema->waiters);
+	sema->stats = (struct lock_statistics) { 0 };
+}
+
+void sema_down(struct semaphore *sema)
+{
+	irq_flags_t flags = spin_lock_irqsave(&sema->guard);
+
+	if (sema->count <= 0) {
+		uint64_t start = get_uptime_ns();
+		while (sema->count <= 0) {
+			spin_lock(&sema->waiters.lock);
+			wait_queue_join(&sema->waiters);
+			spin_unlock(&sema->waiters.lock);
+			spin_unlock_irqrestore(&sema->guard, flags);
+			wait_queue_sleep();
+			flags = spin_lock_irqsave(&sema->guard);
+		}
+		lock_stats_waited(&sema->stats, start);
+	}
+
+	sema->count--;
+	lock_stats_acquired(&sema->stats, 0);
+
+	spin_unlock_irqrestore(&sema->guard, flags);
+}
+
+int sema_try_down(struct semaphore *sema)
+{
+	irq_flags_t flags = spin_lock_irqsave(&sema->guard);
+	int taken = (sema->count > 0);
+	if (taken) {
+		sema->count--;
+		lock_stats_acquired(&sema->stats, 0);
+	}
+	spin_unlock_irqrestore(&sema->guard, flags);
+	return taken;
+}
+
+void sema_up(struct semaphore *sema)
+{
+	irq_flags_t flags = spin_lock_irqsave(&sema->guard);
+	sema->count++;
+	wake_one(&sema->waiters);
+	spin_unlock_irqrestore(&sema->guard, flags);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void lock_dump_stats(const char *name, const struct lock_statistics *stats)
+{
+	fprintf(dbgout, "=== Lock Statistics: %s ===\n", name);
+	fprintf(dbgout, "  acquired: %d, contended: %d\n",
+		stats->acquisitions, stats->contentions);
+	fprintf(dbgout, "  spins: %d, waited: %dus\n",
+		(uint32_t)stats->spins, (uint32_t)(stats->wait_time / 1000));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void atomic_enable_kernel_lock(void)
+{
+	kernel_lock_enabled = 1;
+}
+
+atom_t atomic_enter(void)
+{
+	atom_t atom = (irq_save() & kEFLAGS_IF) ? kATOM_INTERRUPTS : 0;
+	if (!kernel_lock_enabled)
+		return atom;
+
+	// Only the outermost critical section on the CPU takes the lock. Interrupts
+	// are already disabled, so nothing else on this CPU can be waiting for it.
+	struct cpu *cpu = cpu_current();
+	if (cpu->lock_depth++ == 0)
+		spin_lock(&kernel_lock);
+
+	return atom | kATOM_LOCKED;
+}
+
+void atomic_leave(atom_t atom)
+{
+	if (atom & kATOM_LOCKED) {
+		struct cpu *cpu = cpu_current();
+		if (--cpu->lock_depth == 0)
+			spin_unlock(&kernel_lock);
+	}
+
+	if (atom & kATOM_INTERRUPTS)
+		__asm__ __volatile__("sti" ::: "memory");
+}
+
+void preempt_disable(void)
+{
+	irq_flags_t flags = irq_save();
+	cpu_current()->preempt_depth++;
+	irq_restore(flags);
+}
+
+void preempt_enable(void)
+{
+	irq_flags_t flags = irq_save();
+	struct cpu *cpu = cpu_current();
+	int pending = (--cpu->preempt_depth == 0) && cpu->preempt_pending;
+	if (pending)
+		cpu->preempt_pending = 0;
+	irq_restore(flags);
+
+	if (pending)
+		request_preemption();
+}
+
+void atomic_dump_stats(void)
+{
+	lock_dump_stats("kernel", &kernel_lock.stats);
+}
@@ -23,18 +23,30 @@
 	global  switch_stack
 
 ;;
-;;
+;; Switch to the interrupt frame of another task, and return from the interrupt
+;; through it. The PIC is only acknowledged when switching from one of its IRQs,
+;; and the task that is being left is marked as no longer being on a CPU once
+;; its stack is no longer in use.
 ;;
 ;;	__attribute__((noreturn))
-;;	void switch_stack(uint32_t esp, uint32_t ebp);
+;;	void switch_stack(
+;;		uint32_t esp, 
+;;		uint32_t ebp, 
+;;		uint32_t ack_pic, 
+;;		volatile uint8_t *on_cpu
+;;	);
 ;;
 switch_stack:
 	.acknowledge_irq:
+		cmp dword [esp + 12], 0
+		je .swap
 		mov al, 0x20
 		out 0x20, al
 	.swap:
+		mov eax, [esp + 16]
 		mov ebp, [esp + 8]
 		mov esp, [esp + 4]
+		mov byte [eax], 0
 	.conclude:
 		pop gs
 		pop fs
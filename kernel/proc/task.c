@@ -28,19 +28,54 @@
 #include <memory.h>
 #include <panic.h>
 #include <uptime.h>
+#include <process.h>
+#include <virtual.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <wait_queue.h>
+#include <clockevent.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
+struct run_queue
+{
+	struct task *first;
+	struct task *last;
+};
+
+// Every CPU schedules from its own run queues. A CPU that has nothing but idle
+// work steals from the busiest of the others. The lock of a CPU covers its run
+// queues and the state of every task assigned to it, and is always taken with
+// interrupts disabled. Wait queue locks are taken before it, and the timer and
+// task list locks after it.
+struct cpu_scheduler
+{
+	struct spinlock lock;
+	struct task *current;
+	struct run_queue queues[kTHREAD_PRIORITIES];
+	uint32_t map;
+	uint32_t count;
+};
+
 static struct task *first_task = NULL;
 static struct task *last_task = NULL;
-static struct task *current_task = NULL;
+static struct task *dead_tasks = NULL;
 static uint32_t task_count = 0;
+static struct spinlock task_list_lock = { 0 };
 static int allowed = 0;
 
+static struct cpu_scheduler schedulers[kMAX_CPUS];
+
+#define kIDLE_PRIORITY_MASK		(1U << kTHREAD_PRIORITY_IDLE)
+
 ////////////////////////////////////////////////////////////////////////////////
 
-static struct task *task_get_next(void);
-extern void switch_stack(uint32_t esp, uint32_t ebp);
+extern void switch_stack(
+	uint32_t esp, 
+	uint32_t ebp, 
+	uint32_t ack_pic, 
+	volatile uint8_t *on_cpu
+);
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -57,21 +92,326 @@ int task_allowed(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
-int task_create(struct thread *thread)
+static void run_queue_insert(struct task *task, int front)
 {
-	// Make sure a thread has actually been specified first. The thread must
-	// also have an owning process.
-	if (!thread || !thread->owner)
+	// Tasks normally join the back of their queue, so that tasks of equal 
+	// priority take turns. An interactive task that has just woken up joins
+	// the front instead. The bit for the priority marks the queue as non-empty.
+	struct cpu_scheduler *scheduler = &schedulers[task->cpu];
+	uint8_t priority = task->thread->priority;
+	struct run_queue *queue = &scheduler->queues[priority];
+
+	if (front) {
+		task->queue_prev = NULL;
+		task->queue_next = queue->first;
+		if (queue->first)
+			queue->first->queue_prev = task;
+		else
+			queue->last = task;
+		queue->first = task;
+	}
+	else {
+		task->queue_next = NULL;
+		task->queue_prev = queue->last;
+		if (queue->last)
+			queue->last->queue_next = task;
+		else
+			queue->first = task;
+		queue->last = task;
+	}
+
+	task->woken = front;
+	task->queue = task_queue_run;
+	scheduler->map |= (1U << priority);
+	scheduler->count++;
+}
+
+static void run_queue_remove(struct task *task)
+{
+	struct cpu_scheduler *scheduler = &schedulers[task->cpu];
+	uint8_t priority = task->thread->priority;
+	struct run_queue *queue = &scheduler->queues[priority];
+
+	if (task->queue_prev)
+		task->queue_prev->queue_next = task->queue_next;
+	else
+		queue->first = task->queue_next;
+
+	if (task->queue_next)
+		task->queue_next->queue_prev = task->queue_prev;
+	else
+		queue->last = task->queue_prev;
+
+	task->queue_next = task->queue_prev = NULL;
+	task->queue = task_queue_none;
+	task->woken = 0;
+	scheduler->count--;
+
+	if (!queue->first)
+		scheduler->map &= ~(1U << priority);
+}
+
+static struct task *run_queue_peek(struct cpu_scheduler *scheduler)
+{
+	// The highest set bit is the highest priority with a runnable task.
+	if (!scheduler->map)
+		return NULL;
+
+	uint32_t priority;
+	__asm__("bsrl %1, %0" : "=r"(priority) : "rm"(scheduler->map));
+	return scheduler->queues[priority].first;
+}
+
+static struct task *run_queue_take(struct cpu_scheduler *scheduler)
+{
+	struct task *task = run_queue_peek(scheduler);
+	if (task)
+		run_queue_remove(task);
+	return task;
+}
+
+static struct task *run_queue_steal(uint32_t cpu)
+{
+	// Pick the CPU with the most queued tasks, and take its highest priority
+	// task that is worth moving. Idle tasks are never moved, and neither is a 
+	// task that is still being switched out. The caller holds the lock of its
+	// own CPU, so the lock of the other CPU is only tried. Two CPUs stealing
+	// from each other would otherwise deadlock.
+	struct cpu_scheduler *busiest = NULL;
+	for (uint32_t n = 0; n < cpu_count(); ++n) {
+		struct cpu_scheduler *scheduler = &schedulers[n];
+		if (n == cpu || !(scheduler->map & ~kIDLE_PRIORITY_MASK))
+			continue;
+		else if (!busiest || scheduler->count > busiest->count)
+			busiest = scheduler;
+	}
+
+	if (!busiest || !spin_try_lock(&busiest->lock))
+		return NULL;
+
+	for (int priority = kTHREAD_PRIORITIES - 1; 
+		priority > kTHREAD_PRIORITY_IDLE; --priority
+	) {
+		struct task *task = busiest->queues[priority].first;
+		for (; task; task = task->queue_next) {
+			if (task->on_cpu)
+				continue;
+
+			run_queue_remove(task);
+			task->cpu = cpu;
+			spin_unlock(&busiest->lock);
+			return task;
+		}
+	}
+
+	spin_unlock(&busiest->lock);
+	return NULL;
+}
+
+static struct cpu_scheduler *task_lock(struct task *task)
+{
+	// Lock the CPU that the task is assigned to. The task may be stolen by 
+	// another CPU while waiting for the lock, so its CPU is checked again once
+	// the lock is held. Interrupts must already be disabled.
+	while (1) {
+		struct cpu_scheduler *scheduler = &schedulers[task->cpu];
+		spin_lock(&scheduler->lock);
+		if (scheduler == &schedulers[task->cpu])
+			return scheduler;
+		spin_unlock(&scheduler->lock);
+	}
+}
+
+static uint32_t task_least_loaded_cpu(void)
+{
+	uint32_t best = 0;
+	for (uint32_t n = 1; n < cpu_count(); ++n) {
+		if (cpu_get(n)->online && schedulers[n].count < schedulers[best].count)
+			best = n;
+	}
+	return best;
+}
+
+static uint8_t task_current_priority(struct cpu_scheduler *scheduler)
+{
+	return scheduler->current 
+		? scheduler->current->thread->priority 
+		: kTHREAD_PRIORITY_IDLE;
+}
+
+static void task_kick_cpu(uint32_t index)
+{
+	if (index == cpu_current()->index)
+		request_preemption();
+	else
+		lapic_unicast_ipi(cpu_get(index)->apic_id, kRESCHEDULE_VECTOR);
+}
+
+static int task_outranks(struct task *task, struct task *current)
+{
+	// A higher priority always wins. Within a priority, an interactive task
+	// that has just woken up wins over a batch task.
+	uint8_t priority = task->thread->priority;
+	uint8_t current_priority = current->thread->priority;
+	if (priority != current_priority)
+		return priority > current_priority;
+
+	return task->woken && current->thread->sched_class == thread_class_batch;
+}
+
+static int task_preempt_needed_locked(uint32_t index)
+{
+	struct cpu_scheduler *scheduler = &schedulers[index];
+	if (!scheduler->current)
 		return 0;
 
-	fprintf(dbgout, "* Creating task for thread %d\n", thread->tid);
+	struct task *next = run_queue_peek(scheduler);
+	if (next && task_outranks(next, scheduler->current))
+		return 1;
+	else if (task_current_priority(scheduler) != kTHREAD_PRIORITY_IDLE)
+		return 0;
+
+	// An idle CPU should take work from any other CPU that has some queued.
+	// The other run queues are only glanced at, without taking their locks.
+	for (uint32_t n = 0; n < cpu_count(); ++n) {
+		if (n != index && (schedulers[n].map & ~kIDLE_PRIORITY_MASK))
+			return 1;
+	}
+	return 0;
+}
+
+static void task_notify_cpu(struct task *task)
+{
+	// CPUs only look at their run queues when their clock event device fires,
+	// so the CPU that a task was queued on has to be told about it. It only
+	// switches to the task straight away if the task outranks its current 
+	// one, and otherwise starts timeslicing. The lock of the CPU of the task
+	// is held.
+	uint32_t index = cpu_current()->index;
+	if (task->cpu != index)
+		task_kick_cpu(task->cpu);
+	else if (task_preempt_needed_locked(index))
+		request_preemption();
+	else
+		clock_event_reprogram();
+
+	// If the task has to wait for its CPU, an idle CPU is woken up to steal it.
+	struct cpu_scheduler *target = &schedulers[task->cpu];
+	if (!target->current || task_outranks(task, target->current))
+		return;
+
+	for (uint32_t n = 0; n < cpu_count(); ++n) {
+		struct cpu_scheduler *scheduler = &schedulers[n];
+		if (n == task->cpu || !cpu_get(n)->online)
+			continue;
+		else if (task_current_priority(scheduler) != kTHREAD_PRIORITY_IDLE)
+			continue;
+		else if (scheduler->map & ~kIDLE_PRIORITY_MASK)
+			continue;
+
+		task_kick_cpu(n);
+		break;
+	}
+}
+
+static void task_make_runnable(struct task *task)
+{
+	// A killed task stays off the run queues until it has been reaped.
+	if (task->thread->state.mode == thread_killed)
+		return;
+
+	task->thread->state.mode = thread_running;
+	task->thread->state.reason = reason_none;
+	task->thread->state.info = 0;
 
+	// The current task of a CPU is queued again when it is switched out.
+	if (task != schedulers[task->cpu].current && task->queue == task_queue_none) {
+		int interactive = task->thread->sched_class == thread_class_interactive;
+		run_queue_insert(task, interactive);
+		task_notify_cpu(task);
+	}
+}
+
+static void task_sleep_expired(void *context)
+{
+	// Called from the timer interrupt once the sleep of the task is over. The
+	// task may have been killed in the meantime.
+	struct task *task = context;
+	struct cpu_scheduler *scheduler = task_lock(task);
+	if (task->queue == task_queue_sleep) {
+		task->queue = task_queue_none;
+		task_make_runnable(task);
+	}
+	spin_unlock(&scheduler->lock);
+}
+
+static void task_bury(struct task *task)
+{
+	// The task is still on its own stack, so it is only freed later on.
+	task->thread->state.mode = thread_killed;
+	task->queue = task_queue_dead;
+	task->queue_prev = NULL;
+
+	spin_lock(&task_list_lock);
+	task->queue_next = dead_tasks;
+	dead_tasks = task;
+	spin_unlock(&task_list_lock);
+}
+
+static void task_park(struct task *task)
+{
+	// Place a task that is being switched out into the queue matching its
+	// state. Blocked tasks are left out until they are explicitly woken up
+	// (typically by I/O tasks.)
+	if (task->queue != task_queue_none)
+		return;
+
+	switch (task->thread->state.mode) {
+		case thread_running:
+			run_queue_insert(task, 0);
+			break;
+
+		case thread_paused:
+			switch (task->thread->state.reason) {
+				case reason_process:
+				case reason_irq_wait:
+					task->thread->state.mode = thread_blocked;
+					break;
+
+				case reason_exited:
+					task_bury(task);
+					break;
+
+				case reason_none:
+				default:
+					break;
+			}
+			break;
+
+		case thread_killed:
+			task_bury(task);
+			break;
+
+		case thread_blocked:
+		default:
+			break;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static struct task *task_alloc(struct thread *thread)
+{
 	struct task *task = kalloc(sizeof(*task));
 	memset(task, 0, sizeof(*task));
 
 	task->thread = thread;
-	task->prev = last_task;
+	thread->task = task;
+	timer_init(&task->sleep_timer, task_sleep_expired, task);
+
+	irq_flags_t flags = spin_lock_irqsave(&task_list_lock);
 
+	task->prev = last_task;
 	if (last_task) {
 		last_task->next = task;
 	}
@@ -79,129 +419,443 @@ int task_create(struct thread *thread)
 
 	if (!first_task) {
 		first_task = task;
-		current_task = task;
 	}
 
 	++task_count;
 
+	spin_unlock_irqrestore(&task_list_lock, flags);
+	return task;
+}
+
+int task_create(struct thread *thread)
+{
+	// Make sure a thread has actually been specified first. The thread must
+	// also have an owning process.
+	if (!thread || !thread->owner)
+		return 0;
+
+	fprintf(dbgout, "* Creating task for thread %d\n", thread->tid);
+
+	struct task *task = task_alloc(thread);
+
+	// The first task is the one that is already executing on the bootstrap
+	// processor. Every other task waits in the run queue of the least loaded
+	// CPU until it is picked.
+	irq_flags_t flags = irq_save();
+	task->cpu = schedulers[0].current ? task_least_loaded_cpu() : 0;
+	struct cpu_scheduler *scheduler = task_lock(task);
+
+	if (!scheduler->current) {
+		task->on_cpu = 1;
+		scheduler->current = task;
+	}
+	else if (thread->state.mode == thread_running) {
+		run_queue_insert(task, 0);
+		task_notify_cpu(task);
+	}
+
+	spin_unlock(&scheduler->lock);
+	irq_restore(flags);
 	return 1;
 }
 
+static struct task *task_take_dead(void)
+{
+	// Take a killed task that no CPU is still switching away from, and remove 
+	// it from the list of every task.
+	irq_flags_t flags = spin_lock_irqsave(&task_list_lock);
+
+	struct task **link = &dead_tasks;
+	while (*link && (*link)->on_cpu)
+		link = &(*link)->queue_next;
+
+	struct task *task = *link;
+	if (task) {
+		*link = task->queue_next;
+		task->queue_next = NULL;
+		task->queue = task_queue_none;
+
+		if (task->prev)
+			task->prev->next = task->next;
+		else
+			first_task = task->next;
+
+		if (task->next)
+			task->next->prev = task->prev;
+		else
+			last_task = task->prev;
+
+		--task_count;
+	}
+
+	spin_unlock_irqrestore(&task_list_lock, flags);
+	return task;
+}
+
+void task_reap(void)
+{
+	struct task *task;
+	while ((task = task_take_dead())) {
+		struct thread *thread = task->thread;
+		struct process *owner = thread->owner;
+		fprintf(dbgout, "* Reaping task for thread %d\n", thread->tid);
+
+		timer_cancel(&task->sleep_timer);
+		kfree(task);
+
+		// The process is only destroyed along with the last of its threads.
+		// Any others are still running in its address space.
+		atom_t atom;
+		atomic_start(atom);
+		int last_thread = (owner && --owner->threads.count == 0);
+		atomic_end(atom);
+
+		thread_destroy(thread);
+		if (last_thread)
+			process_destroy(owner);
+	}
+}
+
+__attribute__((noreturn))
+void task_cpu_enter(void)
+{
+	// The CPU starts out running an idle thread on the stack that it was
+	// started with. It belongs to the idle process, and takes the place of
+	// the idle thread of that process on this CPU.
+	struct cpu *cpu = cpu_current();
+	struct thread *thread = thread_create("idle", idle);
+	thread->owner = process_get(IDLE_PID);
+	thread->priority = kTHREAD_PRIORITY_IDLE;
+
+	struct task *task = task_alloc(thread);
+
+	atom_t atom;
+	atomic_start(atom);
+	thread->owner->threads.count++;
+	atomic_end(atom);
+
+	irq_flags_t flags = irq_save();
+	task->cpu = cpu->index;
+	struct cpu_scheduler *scheduler = task_lock(task);
+	task->on_cpu = 1;
+	scheduler->current = task;
+	cpu->online = 1;
+	spin_unlock(&scheduler->lock);
+	irq_restore(flags);
+
+	fprintf(dbgout, "CPU %d is online\n", cpu->index);
+
+	__asm__ __volatile__("sti");
+	idle();
+	__builtin_unreachable();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
-void yield(struct interrupt_frame *frame)
+void yield(struct interrupt_frame *frame, int ack_pic)
 {
 	// We shouldn't even attempt this until we have multiple tasks available!
 	if (allowed == 0 || task_count <= 0)
 		return;
 
-	struct task *next = task_get_next();
+	// A task that has disabled preemption keeps the CPU. The switch is asked
+	// for again once it enables preemption.
+	struct cpu *cpu = cpu_current();
+	if (cpu->preempt_depth) {
+		cpu->preempt_pending = 1;
+		return;
+	}
+
+	struct cpu_scheduler *scheduler = &schedulers[cpu->index];
+	irq_flags_t flags = spin_lock_irqsave(&scheduler->lock);
+
+	// Queue the current task according to its state, and then pick the first
+	// task of the highest priority run queue. If the current task is still
+	// the best choice, it is picked again. When there is nothing but idle work
+	// available, a task is taken from another CPU instead.
+	struct task *current = scheduler->current;
+	task_park(current);
+
+	struct task *next = NULL;
+	if (!(scheduler->map & ~kIDLE_PRIORITY_MASK))
+		next = run_queue_steal(cpu->index);
+	int migrated = (next != NULL);
+	if (!next)
+		next = run_queue_take(scheduler);
 
 	// If no task is available to switch to, or its the same as the current task
 	// then abort.
-	if (!next || next == current_task)
+	if (!next || next == current) {
+		spin_unlock_irqrestore(&scheduler->lock, flags);
 		return;
+	}
 
 	// We've got a task to switch to. First we need to update the current task,
-	// so that the stack is remembered.
-	current_task->thread->stack.esp = (uint32_t)frame;
-	current_task->thread->stack.ebp = frame->ebp;
-	current_task->thread->owner->switched_out++;
-	current_task = next;
+	// so that the stack is remembered. It remains marked as being on this CPU
+	// until the switch has left its stack.
+	current->thread->stack.esp = (uint32_t)frame;
+	current->thread->stack.ebp = frame->ebp;
+	current->thread->owner->switched_out++;
+	next->on_cpu = 1;
+	scheduler->current = next;
+
+	// Both tasks are marked as being on this CPU, so no other CPU will take
+	// them, and the rest of the switch is done without the lock. The address
+	// space may have to take the kernel lock to sync the kernel half.
+	spin_unlock(&scheduler->lock);
+
+	// Kernel processes all share the kernel address space, so switching 
+	// between them leaves the TLB alone. A task from another CPU may have 
+	// mappings that changed while this CPU was not using them.
+	address_space_switch(next->thread->owner->address_space);
+	if (migrated)
+		tlb_flush();
+
+	// The saved GS of the task may belong to the CPU that it last ran on.
+	((struct interrupt_frame *)next->thread->stack.esp)->gs = cpu->selector;
+	clock_event_start_slice();
+	irq_restore(flags);
 
 	// Perform the switch. If anything has been misconfigured here, we'll be in
-	// crash land before we know it.
-	switch_stack(next->thread->stack.esp, next->thread->stack.ebp);
+	// crash land before we know it. The PIC is acknowledged on behalf of the
+	// IRQ stub, which is never returned to.
+	switch_stack(
+		next->thread->stack.esp, 
+		next->thread->stack.ebp, 
+		ack_pic, 
+		&current->on_cpu
+	);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static int task_can_resume(struct task *task)
+void task_wake(struct task *task)
 {
-	// If no task specified then cancel. Makes no sense.
 	if (!task)
-		return 0;
-	else if (task->thread->state.mode == thread_running)
-		return 1;
-	else if (task->thread->state.mode == thread_killed)
-		return 0;
-	else if (task->thread->state.mode == thread_blocked)
-		return 0;
+		return;
+
+	irq_flags_t flags = irq_save();
+	struct cpu_scheduler *scheduler = task_lock(task);
+	task_make_runnable(task);
+	spin_unlock(&scheduler->lock);
+	irq_restore(flags);
+}
+
+int task_block(struct task *task, struct wait_queue *queue)
+{
+	// A killed task must not wait, as nothing would ever bury it.
+	irq_flags_t flags = irq_save();
+	struct cpu_scheduler *scheduler = task_lock(task);
+
+	int blocked = task->thread->state.mode != thread_killed 
+		&& task->queue == task_queue_none;
+	if (blocked) {
+		task->queue = task_queue_wait;
+		task->thread->state.info = (uintptr_t)queue;
+		task->thread->state.reason = reason_wait;
+		task->thread->state.mode = thread_blocked;
+	}
+
+	spin_unlock(&scheduler->lock);
+
+	// Indicate to the system that we need to be preempted now.
+	if (blocked)
+		request_preemption();
+
+	irq_restore(flags);
+	return blocked;
+}
+
+void task_sleep(uint64_t deadline)
+{
+	irq_flags_t flags = irq_save();
+	struct task *task = task_get_current();
+	struct cpu_scheduler *scheduler = task_lock(task);
+	if (task->thread->state.mode == thread_killed) {
+		spin_unlock_irqrestore(&scheduler->lock, flags);
+		return;
+	}
 
-	// Paused threads need to be inspected for their resuming conditions. 
-	// Check to see if any of them have met their conditions. Blocked threads
-	// should be ignored. They need to be specifically woken up (typically by
-	// I/O tasks.)
-	switch (task->thread->state.reason) {
-		case reason_sleep:
-			return (get_uptime_ms() >= (suseconds_t)task->thread->state.info);
-
-		case reason_process:
-		case reason_irq_wait:
-		case reason_key_wait:
-			task->thread->state.reason = thread_blocked;
-			return 0;
-
-		case reason_exited:
-			task->thread->state.reason = thread_killed;
-		case reason_none:
+	// The task costs nothing until its timer expires. It is queued straight
+	// away, so that the timer is able to wake it even before it has been 
+	// switched out.
+	task->thread->state.info = deadline;
+	task->thread->state.reason = reason_sleep;
+	task->thread->state.mode = thread_paused;
+	task->queue = task_queue_sleep;
+	spin_unlock(&scheduler->lock);
+
+	timer_start(&task->sleep_timer, deadline);
+	request_preemption();
+	irq_restore(flags);
+}
+
+void task_kill(struct task *task)
+{
+	if (!task)
+		return;
+
+	irq_flags_t flags = irq_save();
+	struct cpu_scheduler *scheduler = task_lock(task);
+	if (task->queue == task_queue_dead) {
+		spin_unlock_irqrestore(&scheduler->lock, flags);
+		return;
+	}
+
+	// Take the task out of whichever queue it is in, so that nothing is able
+	// to wake it or switch to it again. Waiting tasks in particular must not
+	// be left linked in to a wait queue once they have been freed. Once it
+	// has been marked as killed, it can not join another queue.
+	struct wait_queue *waiting = NULL;
+	int sleeping = 0;
+	task->thread->state.mode = thread_killed;
+
+	switch (task->queue) {
+		case task_queue_run:
+			run_queue_remove(task);
+			break;
+
+		case task_queue_sleep:
+			task->queue = task_queue_none;
+			sleeping = 1;
+			break;
+
+		case task_queue_wait:
+			waiting = (struct wait_queue *)(uintptr_t)task->thread->state.info;
+			break;
+
+		case task_queue_none:
 		default:
-			return 0;
+			break;
 	}
 
-	// If we reach this point then we know that the task can not resume.
-	return 0;
+	spin_unlock(&scheduler->lock);
+
+	// The timer and the wait queue have their own locks, which are never 
+	// taken while the lock of a CPU is held.
+	if (sleeping)
+		timer_cancel(&task->sleep_timer);
+	if (waiting)
+		wait_queue_remove(waiting, task);
+
+	// A task that is the current task of a CPU is buried when that CPU next
+	// switches it out. Any other task can be buried straight away, and is 
+	// reaped once it is no longer on a CPU.
+	scheduler = task_lock(task);
+	if (task->queue == task_queue_none) {
+		if (task != scheduler->current)
+			task_bury(task);
+		else
+			task_kick_cpu(task->cpu);
+	}
+	spin_unlock_irqrestore(&scheduler->lock, flags);
 }
 
-void task_resume_any_for(enum thread_mode_reason reason, uint64_t info)
+void task_set_priority(struct thread *thread, uint8_t priority)
 {
-	// Step through all tasks and mark all that fit the specified reason/info
-	// as running.
-	struct task *task = first_task;
-	do {
-		if (task->thread->state.mode != thread_blocked)
-			continue;
-		else if (task->thread->state.reason != reason)
-			continue;
-		else if (task->thread->state.info != info)
-			continue;
+	if (!thread)
+		return;
+	else if (priority >= kTHREAD_PRIORITIES)
+		priority = kTHREAD_PRIORITIES - 1;
+
+	// A queued task has to move to the queue of its new priority.
+	struct task *task = thread->task;
+	if (!task) {
+		thread->priority = priority;
+		return;
+	}
+
+	irq_flags_t flags = irq_save();
+	struct cpu_scheduler *scheduler = task_lock(task);
+
+	if (task->queue == task_queue_run) {
+		run_queue_remove(task);
+		thread->priority = priority;
+		run_queue_insert(task, 0);
+	}
+	else {
+		thread->priority = priority;
+	}
 
-		task->thread->state.mode = thread_running;
-		task->thread->state.reason = reason_none;
-		task->thread->state.info = 0;
-	} 
-	while ((task = task->next));
+	spin_unlock_irqrestore(&scheduler->lock, flags);
+}
+
+void task_set_class(struct thread *thread, enum thread_class sched_class)
+{
+	if (!thread)
+		return;
+
+	// Other CPUs read the class and timeslice while picking and preempting
+	// tasks, so both change together under the lock of the CPU of the task.
+	// The run queues are not ordered by class, so a queued task stays where 
+	// it is.
+	irq_flags_t flags = irq_save();
+	struct cpu_scheduler *scheduler = thread->task 
+		? task_lock(thread->task) 
+		: NULL;
+	thread->sched_class = sched_class;
+	thread->timeslice = (sched_class == thread_class_interactive)
+		? kTHREAD_TIMESLICE_INTERACTIVE
+		: kTHREAD_TIMESLICE_BATCH;
+	if (scheduler)
+		spin_unlock(&scheduler->lock);
+	irq_restore(flags);
+}
+
+void task_set_timeslice(struct thread *thread, uint32_t timeslice)
+{
+	if (!thread)
+		return;
+	else if (timeslice < kTHREAD_TIMESLICE_MIN)
+		timeslice = kTHREAD_TIMESLICE_MIN;
+	else if (timeslice > kTHREAD_TIMESLICE_MAX)
+		timeslice = kTHREAD_TIMESLICE_MAX;
+
+	irq_flags_t flags = irq_save();
+	struct cpu_scheduler *scheduler = thread->task 
+		? task_lock(thread->task) 
+		: NULL;
+	thread->timeslice = timeslice;
+	if (scheduler)
+		spin_unlock(&scheduler->lock);
+	irq_restore(flags);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-struct task *task_get_current(void)
+int task_timeslice_needed(void)
 {
-	return current_task;
+	// Tasks of a lower priority never get a turn while the current task is
+	// runnable, so only those of the same priority or higher need a timeslice
+	// to end. Only the calling CPU changes its current task, and any other CPU
+	// that queues a task here sends an interrupt afterwards.
+	struct cpu_scheduler *scheduler = &schedulers[cpu_current()->index];
+	if (!scheduler->current)
+		return 0;
+
+	uint8_t priority = task_current_priority(scheduler);
+	return (scheduler->map & ~((1U << priority) - 1)) != 0;
 }
 
-static struct task *task_get_next(void)
+int task_preempt_needed(void)
 {
-	// Get a reference to the current task. We'll then need to step along the
-	// task chain, until we've inspected each task, and check each one for its
-	// availability to resume. If they can be resumed then we should mark it as
-	// resumed. We're looking for the first task that can be resumed.
-	// TODO: Potentially factor in time since last run. 
-	struct task *task = task_get_current();
-	uint32_t tasks_remaining = task_count;
-
-	do {
-		--tasks_remaining;
-		task = task->next ?: first_task;
-		
-		if (task_can_resume(task)) {
-			task->thread->state.mode = thread_running;
-			task->thread->state.reason = reason_none;
-			task->thread->state.info = 0;
-			return task;
-		}
-	}
-	while (task && tasks_remaining > 0);
+	irq_flags_t flags = irq_save();
+	uint32_t index = cpu_current()->index;
+	spin_lock(&schedulers[index].lock);
+	int needed = task_preempt_needed_locked(index);
+	spin_unlock_irqrestore(&schedulers[index].lock, flags);
+	return needed;
+}
 
-	return task;
+uint32_t task_timeslice(void)
+{
+	struct task *current = schedulers[cpu_current()->index].current;
+	return current ? current->thread->timeslice : kTHREAD_TIMESLICE_BATCH;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct task *task_get_current(void)
+{
+	return schedulers[cpu_current()->index].current;
 }
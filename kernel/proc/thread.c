@@ -31,7 +31,8 @@
 #include <macro.h>
 #include <task.h>
 #include <uptime.h>
-#include <atomic.h>
+#include <wait_queue.h>
+#include <device/keyboard/keyboard.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -56,6 +57,9 @@ struct thread *thread_create(const char *label, int(*start)(void))
 	thread->state.mode = thread_running;
 	thread->state.reason = 0;
 	thread->state.info = 0;
+	thread->priority = kTHREAD_PRIORITY_NORMAL;
+	thread->sched_class = thread_class_batch;
+	thread->timeslice = kTHREAD_TIMESLICE_BATCH;
 
 	thread->start = start;
 
@@ -90,9 +94,10 @@ static void _thread_start(void)
 	this->start();
 
 	// Mark the thread as terminated. This will prevent the scheduler from
-	// switching to it and leave it marked for removal.
-	this->state.mode = thread_killed;
+	// switching to it and leave it marked for removal. It is switched out
+	// straight away, and freed by an idle thread afterwards.
 	this->state.reason = reason_exited;
+	task_kill(task_get_current());
 
 	// Enter an infinite loop, so that we don't fall out of the bottom of the 
 	// stack.
@@ -108,10 +113,16 @@ int thread_stack_init(struct thread *thread, uint32_t size)
 	if (!thread)
 		return false;
 
-	// Construct a new stack
-	uint32_t *stack = kalloc(size * sizeof(*stack));
+	// Construct a new stack. Stacks are allocated as whole pages so that they
+	// are page aligned and do not share cache lines with other heap objects.
+	uint32_t pages = ((size * sizeof(uint32_t)) + 0xFFF) >> 12;
+	uint32_t *stack = kalloc_stack(pages);
+	if (!stack)
+		return false;
+
 	uint32_t off = 1;
-	memset(stack, 0, size * sizeof(*stack));
+	thread->stack.base = stack;
+	thread->stack.pages = pages;
 
 	fprintf(dbgout, "Initialising stack for thread: %d (%p)\n",
 		thread->tid, thread);
@@ -150,6 +161,17 @@ int thread_stack_init(struct thread *thread, uint32_t size)
 	return true;
 }
 
+void thread_destroy(struct thread *thread)
+{
+	if (!thread)
+		return;
+
+	fprintf(dbgout, "Destroying thread: %d (%p)\n", thread->tid, thread);
+	if (thread->stack.base)
+		kfree_stack(thread->stack.base, thread->stack.pages);
+	kfree(thread);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void sleep(uint64_t ms)
@@ -158,21 +180,10 @@ void sleep(uint64_t ms)
 	if (ms == 0)
 		return;
 
-	// Fetch the current thread and mark it as suspended. Specify the reason, 
-	// and the resume time.
-	atom_t atom;
-	atomic_start(atom);
-
+	// Place the current thread in the sleep queue until the resume time. It
+	// is switched out straight away.
 	struct thread *current = task_get_current()->thread;
-
-	current->state.info = get_uptime_ms() + ms;
-	current->state.reason = reason_sleep;
-	current->state.mode = thread_paused;
-
-	// Indicate to the system that we need to be preempted now.
-	request_preemption();
-
-	atomic_end(atom);
+	task_sleep(get_uptime_u() + (ms * 1000));
 
 	// Wait until the thread is marked as running before resuming. Once it is,
 	// break from the loop and continue on.
@@ -182,24 +193,13 @@ void sleep(uint64_t ms)
 
 void key_wait(void)
 {
-	// Fetch the current thread and mark it as blocked. Specify the reason, 
-	// and the resume condition.
-	atom_t atom;
-	atomic_start(atom);
-
-	struct thread *current = task_get_current()->thread;
-
-	current->state.reason = reason_key_wait;
-	current->state.mode = thread_blocked;
-
-	// Indicate to the system that we need to be preempted now.
-	request_preemption();
-
-	atomic_end(atom);
-
-	// Wait until the thread is marked as running before resuming. Once it is,
-	// break from the loop and continue on.
-	while (current->state.mode != thread_running)
-		__asm__ __volatile__("hlt");
+	// Block on the wait queue of the keyboard device. The keyboard driver 
+	// wakes every thread on it when a scancode is received.
+	struct wait_queue *queue = keyboard_wait_queue();
+	irq_flags_t flags = spin_lock_irqsave(&queue->lock);
+	wait_queue_join(queue);
+	spin_unlock_irqrestore(&queue->lock, flags);
+
+	wait_queue_sleep();
 }
 
@@ -0,0 +1,126 @@
+/*
+ Copyright (c) 2017-2018 Tom Hancocks
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+*/
+
+#include <wait_queue.h>
+#include <task.h>
+#include <stddef.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+void wait_queue_init(struct wait_queue *queue)
+{
+	spin_init(&queue->lock);
+	queue->first = NULL;
+	queue->last = NULL;
+}
+
+void wait_queue_join(struct wait_queue *queue)
+{
+	// The task is marked as waiting before it is linked in, but nothing can
+	// look for it in the queue until the caller releases the lock.
+	struct task *task = task_get_current();
+	if (!task || !task_block(task, queue))
+		return;
+
+	task->queue_next = NULL;
+	task->queue_prev = queue->last;
+	if (queue->last)
+		queue->last->queue_next = task;
+	else
+		queue->first = task;
+	queue->last = task;
+}
+
+void wait_queue_sleep(void)
+{
+	// The thread is switched out at the next opportunity, and only switched
+	// back in once it has been woken.
+	struct thread *current = task_get_current()->thread;
+	while (current->state.mode != thread_running)
+		__asm__ __volatile__("hlt");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static struct task *wait_queue_take(struct wait_queue *queue)
+{
+	struct task *task = queue->first;
+	if (!task)
+		return NULL;
+
+	queue->first = task->queue_next;
+	if (queue->first)
+		queue->first->queue_prev = NULL;
+	else
+		queue->last = NULL;
+
+	task->queue_next = task->queue_prev = NULL;
+	task->queue = task_queue_none;
+	return task;
+}
+
+void wait_queue_remove(struct wait_queue *queue, struct task *task)
+{
+	if (!queue || !task)
+		return;
+
+	// The task may have been woken up before the lock was taken.
+	irq_flags_t flags = spin_lock_irqsave(&queue->lock);
+	if (task->queue != task_queue_wait) {
+		spin_unlock_irqrestore(&queue->lock, flags);
+		return;
+	}
+
+	if (task->queue_prev)
+		task->queue_prev->queue_next = task->queue_next;
+	else
+		queue->first = task->queue_next;
+
+	if (task->queue_next)
+		task->queue_next->queue_prev = task->queue_prev;
+	else
+		queue->last = task->queue_prev;
+
+	task->queue_next = task->queue_prev = NULL;
+	task->queue = task_queue_none;
+	spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+int wake_one(struct wait_queue *queue)
+{
+	irq_flags_t flags = spin_lock_irqsave(&queue->lock);
+	struct task *task = wait_queue_take(queue);
+	if (task)
+		task_wake(task);
+	spin_unlock_irqrestore(&queue->lock, flags);
+	return task ? 1 : 0;
+}
+
+uint32_t wake_all(struct wait_queue *queue)
+{
+	uint32_t count = 0;
+	irq_flags_t flags = spin_lock_irqsave(&queue->lock);
+	for (struct task *task; (task = wait_queue_take(queue)); ++count)
+		task_wake(task);
+	spin_unlock_irqrestore(&queue->lock, flags);
+	return count;
+}
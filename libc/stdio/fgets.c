@@ -40,9 +40,9 @@ char *fgets(char *str, size_t count, FILE *fd)
 	uint32_t i = 0;
 	struct pipe *pipe = pipe_for_file(fd);
 	while (pipe && i < count) {
-		while (feof(fd)) {
+		if (feof(fd)) {
 			fprintf(dbgout, "<blocking fgets() on %s>\n", pipe->owner->name);
-			__asm__ __volatile__("hlt");
+			wait_event(&pipe->readers, !feof(fd));
 		}
 		char c = pipe_read_byte(pipe, NULL);
 		if (c == '\0') {
@@ -41,8 +41,7 @@ int getc(FILE *fd)
 		return 0;
 	}
 
-	while (!pipe_has_unread(pipe, NULL)) 
-		sleep(5);
+	wait_event(&pipe->readers, pipe_has_unread(pipe, NULL));
 
 	// We have keyboard input. Now read the character from the pipe.
 	return (char)pipe_read_byte(pipe, NULL);;